@@ -0,0 +1,31 @@
+// DO WHAT THE FUCK YOU WANT TO PUBLIC LICENSE
+//                    Version 2, December 2004
+//  
+// Copyright (C) 2004 Sam Hocevar <sam@hocevar.net>
+// 
+// Everyone is permitted to copy and distribute verbatim or modified
+// copies of this license document, and changing it is allowed as long
+// as the name is changed.
+//  
+//            DO WHAT THE FUCK YOU WANT TO PUBLIC LICENSE
+//   TERMS AND CONDITIONS FOR COPYING, DISTRIBUTION AND MODIFICATION
+// 
+//  0. You just DO WHAT THE FUCK YOU WANT TO.
+
+#ifndef BOARD_SERIAL_H
+#define BOARD_SERIAL_H
+
+#include "fat_types.h"
+
+// Host port of the board serial driver. The driver only prints from the demo 
+// thread, so the output is dropped and the colour codes are empty
+
+#define ANSI_NORMAL	""
+#define ANSI_RED	""
+#define ANSI_YELLOW	""
+#define BLUE		""
+
+void print(const char* fmt, ...);
+void print_count(const char* data, u32 count);
+
+#endif
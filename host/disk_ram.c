@@ -0,0 +1,153 @@
+// DO WHAT THE FUCK YOU WANT TO PUBLIC LICENSE
+//                    Version 2, December 2004
+//  
+// Copyright (C) 2004 Sam Hocevar <sam@hocevar.net>
+// 
+// Everyone is permitted to copy and distribute verbatim or modified
+// copies of this license document, and changing it is allowed as long
+// as the name is changed.
+//  
+//            DO WHAT THE FUCK YOU WANT TO PUBLIC LICENSE
+//   TERMS AND CONDITIONS FOR COPYING, DISTRIBUTION AND MODIFICATION
+// 
+//  0. You just DO WHAT THE FUCK YOU WANT TO.
+
+#include "disk_ram.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static void disk_ram_delay(const struct disk_ram_s* ram, u32 count);
+
+/// Busy waits for the modelled command time. Sleeping is too coarse for the 
+/// short delays of flash media
+static void disk_ram_delay(const struct disk_ram_s* ram, u32 count) {
+	int64_t delay = (int64_t)ram->latency_us * 1000 + 
+		(int64_t)ram->sector_ns * count;
+	if (delay == 0) {
+		return;
+	}
+	struct timespec start;
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	do {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+	} while ((int64_t)(now.tv_sec - start.tv_sec) * 1000000000 + 
+		(now.tv_nsec - start.tv_nsec) < delay);
+}
+
+static u8 ram_get_status(void* ctx) {
+	const struct disk_ram_s* ram = (const struct disk_ram_s *)ctx;
+	return ram->memory != NULL;
+}
+
+static u8 ram_initialize(void* ctx) {
+	return ram_get_status(ctx);
+}
+
+static u8 ram_read(void* ctx, u8* buffer, u32 lba, u32 count) {
+	struct disk_ram_s* ram = (struct disk_ram_s *)ctx;
+	if ((lba > ram->sector_cnt) || (count > ram->sector_cnt - lba)) {
+		return 0;
+	}
+	disk_ram_delay(ram, count);
+	memcpy(buffer, ram->memory + (size_t)lba * ram->sector_size, 
+		(size_t)count * ram->sector_size);
+	ram->read_cmds++;
+	ram->read_sects += count;
+	return 1;
+}
+
+static u8 ram_write(void* ctx, const u8* buffer, u32 lba, u32 count) {
+	struct disk_ram_s* ram = (struct disk_ram_s *)ctx;
+	if ((lba > ram->sector_cnt) || (count > ram->sector_cnt - lba)) {
+		return 0;
+	}
+	disk_ram_delay(ram, count);
+	memcpy(ram->memory + (size_t)lba * ram->sector_size, buffer, 
+		(size_t)count * ram->sector_size);
+	ram->write_cmds++;
+	ram->write_sects += count;
+	return 1;
+}
+
+/// Erased sectors read back as zero, which is what most SD cards do
+static u8 ram_erase(void* ctx, u32 lba, u32 count) {
+	struct disk_ram_s* ram = (struct disk_ram_s *)ctx;
+	if ((lba > ram->sector_cnt) || (count > ram->sector_cnt - lba)) {
+		return 0;
+	}
+	disk_ram_delay(ram, 0);
+	memset(ram->memory + (size_t)lba * ram->sector_size, 0, 
+		(size_t)count * ram->sector_size);
+	ram->erase_cmds++;
+	return 1;
+}
+
+static u32 ram_sector_size(void* ctx) {
+	const struct disk_ram_s* ram = (const struct disk_ram_s *)ctx;
+	return ram->sector_size;
+}
+
+static const struct disk_ops_s ram_ops = {
+	.get_status = ram_get_status,
+	.initialize = ram_initialize,
+	.read = ram_read,
+	.write = ram_write,
+	.submit = NULL,
+	.poll = NULL,
+	.erase = ram_erase,
+	.sector_size = ram_sector_size
+};
+
+u8 disk_ram_create(struct disk_ram_s* ram, u32 sector_cnt, u32 sector_size) {
+	memset(ram, 0, sizeof(*ram));
+	ram->memory = (u8 *)calloc(sector_cnt, sector_size);
+	if (ram->memory == NULL) {
+		return 0;
+	}
+	ram->sector_cnt = sector_cnt;
+	ram->sector_size = sector_size;
+	return 1;
+}
+
+u8 disk_ram_load(struct disk_ram_s* ram, const char* path, u32 sector_size) {
+	FILE* file = fopen(path, "rb");
+	if (file == NULL) {
+		return 0;
+	}
+	fseek(file, 0, SEEK_END);
+	long size = ftell(file);
+	fseek(file, 0, SEEK_SET);
+	
+	u8 status = (size > 0) && 
+		disk_ram_create(ram, (u32)(size / sector_size), sector_size);
+	if (status) {
+		size_t length = (size_t)ram->sector_cnt * sector_size;
+		status = fread(ram->memory, 1, length, file) == length;
+	}
+	fclose(file);
+	return status;
+}
+
+u8 disk_ram_save(const struct disk_ram_s* ram, const char* path) {
+	FILE* file = fopen(path, "wb");
+	if (file == NULL) {
+		return 0;
+	}
+	size_t length = (size_t)ram->sector_cnt * ram->sector_size;
+	u8 status = fwrite(ram->memory, 1, length, file) == length;
+	return (fclose(file) == 0) && status;
+}
+
+void disk_ram_free(struct disk_ram_s* ram) {
+	free(ram->memory);
+	ram->memory = NULL;
+	ram->sector_cnt = 0;
+}
+
+u8 disk_ram_register(disk_e disk, struct disk_ram_s* ram) {
+	return disk_register(disk, &ram_ops, ram);
+}
@@ -0,0 +1,54 @@
+// DO WHAT THE FUCK YOU WANT TO PUBLIC LICENSE
+//                    Version 2, December 2004
+//  
+// Copyright (C) 2004 Sam Hocevar <sam@hocevar.net>
+// 
+// Everyone is permitted to copy and distribute verbatim or modified
+// copies of this license document, and changing it is allowed as long
+// as the name is changed.
+//  
+//            DO WHAT THE FUCK YOU WANT TO PUBLIC LICENSE
+//   TERMS AND CONDITIONS FOR COPYING, DISTRIBUTION AND MODIFICATION
+// 
+//  0. You just DO WHAT THE FUCK YOU WANT TO.
+
+#ifndef DISK_RAM_H
+#define DISK_RAM_H
+
+#include "disk_interface.h"
+
+/// RAM disk for running the driver on a host. The disk image is kept in 
+/// memory and can be loaded from and saved to an image file. Every command 
+/// can be delayed by `latency_us` plus `sector_ns` per sector to model the 
+/// speed of a real storage device. The command counters are never cleared by
+/// the disk itself
+struct disk_ram_s {
+	u8* memory;
+	u32 sector_cnt;
+	u32 sector_size;
+	u32 latency_us;
+	u32 sector_ns;
+	
+	u32 read_cmds;
+	u32 read_sects;
+	u32 write_cmds;
+	u32 write_sects;
+	u32 erase_cmds;
+};
+
+/// Allocates a zeroed RAM disk of `sector_cnt` sectors of `sector_size` bytes
+u8 disk_ram_create(struct disk_ram_s* ram, u32 sector_cnt, u32 sector_size);
+
+/// Allocates a RAM disk holding the disk image in the file at `path`
+u8 disk_ram_load(struct disk_ram_s* ram, const char* path, u32 sector_size);
+
+/// Writes the RAM disk content to the file at `path`
+u8 disk_ram_save(const struct disk_ram_s* ram, const char* path);
+
+/// Frees the disk memory. The disk must not be mounted
+void disk_ram_free(struct disk_ram_s* ram);
+
+/// Attaches the RAM disk to a disk number
+u8 disk_ram_register(disk_e disk, struct disk_ram_s* ram);
+
+#endif
@@ -0,0 +1,25 @@
+// DO WHAT THE FUCK YOU WANT TO PUBLIC LICENSE
+//                    Version 2, December 2004
+//  
+// Copyright (C) 2004 Sam Hocevar <sam@hocevar.net>
+// 
+// Everyone is permitted to copy and distribute verbatim or modified
+// copies of this license document, and changing it is allowed as long
+// as the name is changed.
+//  
+//            DO WHAT THE FUCK YOU WANT TO PUBLIC LICENSE
+//   TERMS AND CONDITIONS FOR COPYING, DISTRIBUTION AND MODIFICATION
+// 
+//  0. You just DO WHAT THE FUCK YOU WANT TO.
+
+#ifndef DYNAMIC_MEMORY_H
+#define DYNAMIC_MEMORY_H
+
+// Host port of the dynamic memory driver on top of the C library heap
+
+#define DRAM_BANK_0 0
+
+void* dynamic_memory_new(int bank, unsigned int size);
+void dynamic_memory_free(void* memory);
+
+#endif
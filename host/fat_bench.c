@@ -0,0 +1,559 @@
+// DO WHAT THE FUCK YOU WANT TO PUBLIC LICENSE
+//                    Version 2, December 2004
+//  
+// Copyright (C) 2004 Sam Hocevar <sam@hocevar.net>
+// 
+// Everyone is permitted to copy and distribute verbatim or modified
+// copies of this license document, and changing it is allowed as long
+// as the name is changed.
+//  
+//            DO WHAT THE FUCK YOU WANT TO PUBLIC LICENSE
+//   TERMS AND CONDITIONS FOR COPYING, DISTRIBUTION AND MODIFICATION
+// 
+//  0. You just DO WHAT THE FUCK YOU WANT TO.
+
+#include "fat32.h"
+#include "disk_ram.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Host benchmark of the FAT32 driver on a RAM disk. The disk is partitioned 
+// and formatted by the driver, and the test files are written through the 
+// file API. The driver can not create directory entries yet, so the entries
+// are added to the root directory of the unmounted image. Build it from the 
+// repository root with
+//
+//   cc -O2 -Isrc -Ihost -DFAT_STATS=1 src/fat32.c src/disk_interface.c
+//      src/fat_os.c host/host_port.c host/disk_ram.c host/fat_bench.c
+//      -o fat_bench
+//
+// and run `./fat_bench -h` for the options. The random offsets use a fixed 
+// seed, so two runs on the same build do the same work
+
+#define BENCH_DISK		DISK_SD_CARD
+#define BENCH_PART_LBA	2048
+#define BENCH_CHUNK		65536
+#define BENCH_REPEAT	2000
+
+/// Geometry of the formatted volume used to edit the unmounted image
+struct bench_geo_s {
+	u32 sector_size;
+	u32 cluster_size;
+	u32 fat_lba;
+	u32 fat_size;
+	u32 fat_num;
+	u32 fsinfo_lba;
+	u32 data_lba;
+	u32 root_lba;
+	u32 cluster_cnt;
+};
+
+static struct disk_ram_s ram;
+static struct bench_geo_s geo;
+static u8 chunk[BENCH_CHUNK];
+static u32 rand_state = 1;
+
+/// Directory sizes used for the lookup benchmark
+static const u32 dir_sizes[] = {16, 256, 4096};
+#define DIR_CNT	(sizeof(dir_sizes) / sizeof(dir_sizes[0]))
+
+/// Returns the monotonic time in microseconds
+static double bench_now(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1e6 + now.tv_nsec / 1e3;
+}
+
+/// Small deterministic generator for the random offsets
+static u32 bench_rand(void) {
+	rand_state = rand_state * 1103515245 + 12345;
+	return rand_state >> 1;
+}
+
+static void bench_report(const char* name, double value, const char* unit) {
+	printf("%-36s %12.2f %s\n", name, value, unit);
+}
+
+static void bench_fail(const char* what) {
+	fprintf(stderr, "fat_bench: %s failed\n", what);
+	exit(1);
+}
+
+static inline u8* bench_sector(u32 lba) {
+	return ram.memory + (size_t)lba * ram.sector_size;
+}
+
+static inline void bench_store16(u8* dest, u32 value) {
+	dest[0] = (u8)value;
+	dest[1] = (u8)(value >> 8);
+}
+
+static inline void bench_store32(u8* dest, u32 value) {
+	bench_store16(dest, value);
+	bench_store16(dest + 2, value >> 16);
+}
+
+static inline u32 bench_load32(const u8* src) {
+	return src[0] | (src[1] << 8) | (src[2] << 16) | ((u32)src[3] << 24);
+}
+
+/// Writes an 8.3 directory entry. `name` holds the 11 padded name characters
+static void bench_entry(u8* entry, const char* name, u8 attribute, 
+	u32 cluster, u32 size) {
+	memset(entry, 0, 32);
+	memcpy(entry + SFN_NAME, name, 11);
+	entry[SFN_ATTR] = attribute;
+	bench_store16(entry + SFN_CLUSTH, cluster >> 16);
+	bench_store16(entry + SFN_CLUSTL, cluster);
+	bench_store32(entry + SFN_FILE_SIZE, size);
+}
+
+/// Writes an MBR with one FAT32 partition and a placeholder boot sector, so 
+/// the disk can be mounted and formatted by the driver
+static void bench_partition(void) {
+	u32 part_size = ram.sector_cnt - BENCH_PART_LBA;
+	u8* mbr = bench_sector(0);
+	u8* part = mbr + MBR_PARTITION;
+	part[PAR_TYPE] = 0x0C;
+	bench_store32(part + PAR_LBA, BENCH_PART_LBA);
+	bench_store32(part + PAR_SIZE, part_size);
+	bench_store16(mbr + MBR_BOOT_SIG, MBR_BOOT_SIG_VALUE);
+	
+	u8* bpb = bench_sector(BENCH_PART_LBA);
+	bench_store16(bpb + BPB_SECTOR_SIZE, ram.sector_size);
+	bpb[BPB_CLUSTER_SIZE] = 1;
+	bench_store16(bpb + BPB_RSVD_CNT, 32);
+	bpb[BPB_NUM_FATS] = 2;
+	bench_store32(bpb + BPB_TOT_SECT_32, part_size);
+	bench_store32(bpb + BPB_32_FAT_SIZE, 1);
+	bench_store32(bpb + BPB_32_ROOT_CLUST, 2);
+	bench_store16(bpb + BPB_32_FSINFO, 1);
+	memcpy(bpb + BPB_32_FSTYPE, "FAT32   ", 8);
+	bench_store16(bpb + MBR_BOOT_SIG, MBR_BOOT_SIG_VALUE);
+}
+
+static struct volume_s* bench_mount(void) {
+	if (!disk_mount(BENCH_DISK)) {
+		bench_fail("mount");
+	}
+	struct volume_s* vol = volume_get('C');
+	if (vol == NULL) {
+		bench_fail("volume");
+	}
+	return vol;
+}
+
+static void bench_eject(void) {
+	if (!disk_eject(BENCH_DISK)) {
+		bench_fail("eject");
+	}
+}
+
+static void bench_open(struct file_s* file, const char* path) {
+	if (fat_file_open(file, path, strlen(path)) != FSTATUS_OK) {
+		bench_fail(path);
+	}
+}
+
+/// Writes `size` bytes to the file at `path` and returns the time taken
+static double bench_write_file(const char* path, u32 size) {
+	struct file_s file;
+	bench_open(&file, path);
+	double start = bench_now();
+	for (u32 done = 0; done < size; done += BENCH_CHUNK) {
+		u32 count = (size - done < BENCH_CHUNK) ? size - done : BENCH_CHUNK;
+		if (fat_file_write(&file, chunk, count) != FSTATUS_OK) {
+			bench_fail("write");
+		}
+	}
+	if (fat_file_close(&file) != FSTATUS_OK) {
+		bench_fail("close");
+	}
+	return bench_now() - start;
+}
+
+/// Returns the root directory entry named `name`, or a free entry if `name` 
+/// is NULL. Only the first root cluster is searched
+static u8* bench_root_entry(const char* name) {
+	u8* entry = bench_sector(geo.root_lba);
+	u8* end = entry + geo.cluster_size * geo.sector_size;
+	for (; entry < end; entry += 32) {
+		if (name == NULL) {
+			if ((entry[0] == 0x00) || (entry[0] == 0xE5)) {
+				return entry;
+			}
+		} else if ((entry[0] != 0x00) && !memcmp(entry, name, 11)) {
+			return entry;
+		}
+	}
+	bench_fail("root entry");
+	return NULL;
+}
+
+static inline u32 bench_entry_cluster(const u8* entry) {
+	return (entry[SFN_CLUSTH] << 16) | (entry[SFN_CLUSTH + 1] << 24) |
+		entry[SFN_CLUSTL] | (entry[SFN_CLUSTL + 1] << 8);
+}
+
+static inline u32 bench_cluster_lba(u32 cluster) {
+	return geo.data_lba + (cluster - 2) * geo.cluster_size;
+}
+
+/// Builds the SFN name of the lookup benchmark directory with `count` 
+/// entries. It is a BIN file until it is turned into a directory
+static void bench_dir_name(char* name, u32 count, u8 file) {
+	char text[12];
+	snprintf(text, sizeof(text), "D%u", count);
+	memset(name, ' ', 11);
+	memcpy(name, text, strlen(text));
+	if (file) {
+		memcpy(name + 8, "BIN", 3);
+	}
+}
+
+/// Fills `buffer` with `count` entries of the lookup benchmark directory 
+/// after the dot entries, which are written once the cluster is known
+static void bench_dir_fill(u8* buffer, u32 count) {
+	char name[16];
+	for (u32 i = 0; i < count; i++) {
+		snprintf(name, sizeof(name), "F%07uTXT", i);
+		bench_entry(buffer + (i + 2) * 32, name, ATTR_ARCH, 0, 0);
+	}
+}
+
+/// Formats the disk and fills it with the benchmark files
+static void bench_setup(u32 cluster_bytes, double* write_time, u32 file_mb) {
+	u32 file_size = file_mb << 20;
+	
+	bench_partition();
+	if (!disk_ram_register(BENCH_DISK, &ram)) {
+		bench_fail("register");
+	}
+	struct volume_s* vol = bench_mount();
+	struct fat_fmt_s fmt = { cluster_bytes, 0, 1, chunk, sizeof(chunk) };
+	if (volume_format(vol, &fmt) != FSTATUS_OK) {
+		bench_fail("format");
+	}
+	geo.sector_size = vol->sector_size;
+	geo.cluster_size = vol->cluster_size;
+	geo.fat_lba = vol->fat_lba;
+	geo.fat_size = vol->fat_size;
+	geo.fat_num = vol->fat_num;
+	geo.fsinfo_lba = vol->fsinfo_lba;
+	geo.data_lba = vol->data_lba;
+	geo.root_lba = vol->root_lba;
+	geo.cluster_cnt = vol->cluster_cnt;
+	bench_eject();
+	
+	// Empty files which are filled through the driver
+	bench_entry(bench_root_entry(NULL), "BENCH   BIN", ATTR_ARCH, 0, 0);
+	bench_entry(bench_root_entry(NULL), "ALLOC   BIN", ATTR_ARCH, 0, 0);
+	char name[12];
+	for (u32 i = 0; i < DIR_CNT; i++) {
+		bench_dir_name(name, dir_sizes[i], 1);
+		bench_entry(bench_root_entry(NULL), name, ATTR_ARCH, 0, 0);
+	}
+	
+	vol = bench_mount();
+	for (u32 i = 0; i < BENCH_CHUNK; i++) {
+		chunk[i] = (u8)bench_rand();
+	}
+	*write_time = bench_write_file("C:/BENCH.BIN", file_size);
+	
+	// The directories are written as files holding the entries and turned
+	// into directories afterwards. They are padded to whole clusters
+	u32 cluster_bytes_used = geo.cluster_size * geo.sector_size;
+	for (u32 i = 0; i < DIR_CNT; i++) {
+		u32 size = (dir_sizes[i] + 2) * 32;
+		size = (size + cluster_bytes_used - 1) / cluster_bytes_used * 
+			cluster_bytes_used;
+		u8* buffer = calloc(1, size);
+		if (buffer == NULL) {
+			bench_fail("malloc");
+		}
+		bench_dir_fill(buffer, dir_sizes[i]);
+		
+		char path[16];
+		struct file_s file;
+		snprintf(path, sizeof(path), "C:/D%u.BIN", dir_sizes[i]);
+		bench_open(&file, path);
+		if ((fat_file_write(&file, buffer, size) != FSTATUS_OK) ||
+			(fat_file_close(&file) != FSTATUS_OK)) {
+			bench_fail("directory write");
+		}
+		free(buffer);
+	}
+	if (volume_sync(vol) != FSTATUS_OK) {
+		bench_fail("sync");
+	}
+	bench_eject();
+	
+	for (u32 i = 0; i < DIR_CNT; i++) {
+		bench_dir_name(name, dir_sizes[i], 1);
+		u8* entry = bench_root_entry(name);
+		memcpy(entry + 8, "   ", 3);
+		entry[SFN_ATTR] = ATTR_DIR;
+		bench_store32(entry + SFN_FILE_SIZE, 0);
+		
+		u32 cluster = bench_entry_cluster(entry);
+		u8* dots = bench_sector(bench_cluster_lba(cluster));
+		bench_entry(dots, ".          ", ATTR_DIR, cluster, 0);
+		bench_entry(dots + 32, "..         ", ATTR_DIR, 0, 0);
+	}
+}
+
+/// Mounts and ejects the volume repeatedly
+static void bench_mount_time(void) {
+	const u32 repeat = 100;
+	u32 read_cmds = ram.read_cmds;
+	double start = bench_now();
+	for (u32 i = 0; i < repeat; i++) {
+		bench_mount();
+		bench_eject();
+	}
+	double time = bench_now() - start;
+	bench_report("mount and eject", time / repeat, "us");
+	bench_report("mount reads", (double)(ram.read_cmds - read_cmds) / repeat,
+		"cmds");
+}
+
+/// Reads the benchmark file sequentially and at random offsets
+static void bench_read(u32 file_mb) {
+	u32 file_size = file_mb << 20;
+	struct file_s file;
+	u32 status;
+	
+	bench_open(&file, "C:/BENCH.BIN");
+	double start = bench_now();
+	for (u32 done = 0; done < file_size; done += status) {
+		if ((fat_file_read(&file, chunk, BENCH_CHUNK, &status) != 
+			FSTATUS_OK) || (status == 0)) {
+			bench_fail("read");
+		}
+	}
+	double time = bench_now() - start;
+	bench_report("sequential read", file_mb / (time / 1e6), "MB/s");
+	
+	start = bench_now();
+	for (u32 i = 0; i < BENCH_REPEAT; i++) {
+		u32 offset = (bench_rand() % (file_size / 4096)) * 4096;
+		if ((fat_file_jump(&file, offset) != FSTATUS_OK) ||
+			(fat_file_read(&file, chunk, 4096, &status) != FSTATUS_OK)) {
+			bench_fail("random read");
+		}
+	}
+	time = bench_now() - start;
+	bench_report("random 4 KiB read", BENCH_REPEAT / (time / 1e6), "IOPS");
+	fat_file_close(&file);
+}
+
+/// Times a jump to a random offset followed by a one byte read, which is 
+/// where the cluster chain is walked. This is done with and without an 
+/// extent map
+static void bench_seek(u32 file_mb) {
+	u32 file_size = file_mb << 20;
+	static struct extent_s map[64];
+	
+	for (u32 mapped = 0; mapped < 2; mapped++) {
+		struct file_s file;
+		u32 status;
+		bench_open(&file, "C:/BENCH.BIN");
+		if (mapped && (fat_file_set_map(&file, map, 64) != FSTATUS_OK)) {
+			bench_fail("extent map");
+		}
+		
+		double start = bench_now();
+		for (u32 i = 0; i < BENCH_REPEAT; i++) {
+			u32 offset = bench_rand() % file_size;
+			if ((fat_file_jump(&file, offset) != FSTATUS_OK) ||
+				(fat_file_read(&file, chunk, 1, &status) != FSTATUS_OK)) {
+				bench_fail("seek");
+			}
+		}
+		double time = bench_now() - start;
+		bench_report(mapped ? "seek with extent map" : "seek", 
+			time / BENCH_REPEAT, "us");
+		fat_file_close(&file);
+	}
+}
+
+/// Opens the last file in each benchmark directory, with and without the 
+/// directory name index
+static void bench_lookup(struct volume_s* vol) {
+	const u32 repeat = 200;
+	static u32 pool[65536];
+	
+	for (u32 indexed = 0; indexed < 2; indexed++) {
+		if (indexed && (volume_index_attach(vol, pool, sizeof(pool)) != 
+			FSTATUS_OK)) {
+			bench_fail("index attach");
+		}
+		for (u32 i = 0; i < DIR_CNT; i++) {
+			char path[32];
+			char name[40];
+			struct file_s file;
+			snprintf(path, sizeof(path), "C:/D%u/F%07u.TXT", dir_sizes[i],
+				dir_sizes[i] - 1);
+			
+			double start = bench_now();
+			for (u32 j = 0; j < repeat; j++) {
+				bench_open(&file, path);
+				fat_file_close(&file);
+			}
+			double time = bench_now() - start;
+			snprintf(name, sizeof(name), "lookup in %u entries%s", 
+				dir_sizes[i], indexed ? " indexed" : "");
+			bench_report(name, time / repeat, "us");
+		}
+	}
+	volume_index_attach(vol, NULL, 0);
+}
+
+/// Marks every other free cluster as used, so no two free clusters are 
+/// adjacent, and invalidates the FSinfo free cluster count
+static void bench_fragment(void) {
+	u32 entries = geo.sector_size / 4;
+	u32 last = geo.cluster_cnt + 2;
+	for (u32 cluster = 3; cluster < last; cluster += 2) {
+		u32 lba = geo.fat_lba + cluster / entries;
+		u32 offset = (cluster % entries) * 4;
+		if (bench_load32(bench_sector(lba) + offset) & 0x0FFFFFFF) {
+			continue;
+		}
+		for (u32 fat = 0; fat < geo.fat_num; fat++) {
+			bench_store32(bench_sector(lba + fat * geo.fat_size) + offset, 
+				0x0FFFFFFF);
+		}
+	}
+	u8* fsinfo = bench_sector(geo.fsinfo_lba);
+	bench_store32(fsinfo + 488, 0xFFFFFFFF);
+	bench_store32(fsinfo + 492, 2);
+}
+
+/// Times growing a file on a fragmented volume with and without the free
+/// cluster bitmap. Both runs start from the same image
+static void bench_alloc(u32 alloc_mb) {
+	size_t bytes = (size_t)ram.sector_cnt * ram.sector_size;
+	u8* image = malloc(bytes);
+	if (image == NULL) {
+		bench_fail("malloc");
+	}
+	bench_fragment();
+	memcpy(image, ram.memory, bytes);
+	
+	for (u32 mapped = 0; mapped < 2; mapped++) {
+		memcpy(ram.memory, image, bytes);
+		struct volume_s* vol = bench_mount();
+		u32* bitmap = NULL;
+		if (mapped) {
+			u32 size = volume_bitmap_size(vol);
+			bitmap = malloc(size);
+			if ((bitmap == NULL) || 
+				(volume_bitmap_attach(vol, bitmap, size) != FSTATUS_OK)) {
+				bench_fail("bitmap attach");
+			}
+			double start = bench_now();
+			if (volume_bitmap_build(vol, 0) != FSTATUS_OK) {
+				bench_fail("bitmap build");
+			}
+			bench_report("bitmap build", (bench_now() - start) / 1e3, "ms");
+		}
+		
+		u32 write_cmds = ram.write_cmds;
+		double time = bench_write_file("C:/ALLOC.BIN", alloc_mb << 20);
+		double start = bench_now();
+		if (volume_sync(vol) != FSTATUS_OK) {
+			bench_fail("sync");
+		}
+		time += bench_now() - start;
+		bench_report(mapped ? "fragmented write with bitmap" : 
+			"fragmented write", alloc_mb / (time / 1e6), "MB/s");
+		bench_report("  disk writes", ram.write_cmds - write_cmds, "cmds");
+		
+#if FAT_STATS
+		struct fat_stats_s stats;
+		if (volume_get_stats(vol, &stats, 0) == FSTATUS_OK) {
+			bench_report("  FAT lookups", stats.fat_lookups, "");
+			bench_report("  clusters scanned", stats.alloc_scan, "");
+		}
+#endif
+		bench_eject();
+		free(bitmap);
+	}
+	free(image);
+}
+
+static void bench_usage(void) {
+	printf("usage: fat_bench [options]\n"
+		"  -d MB    disk size (512)\n"
+		"  -s SIZE  sector size (512)\n"
+		"  -c SIZE  cluster size in bytes (4096)\n"
+		"  -f MB    benchmark file size (32)\n"
+		"  -a MB    fragmented write size (4)\n"
+		"  -l US    command latency in microseconds (0)\n"
+		"  -n NS    transfer time per sector in nanoseconds (0)\n"
+		"  -o PATH  save the disk image to PATH\n");
+}
+
+int main(int argc, char** argv) {
+	u32 disk_mb = 512;
+	u32 sector_size = 512;
+	u32 cluster_bytes = 4096;
+	u32 file_mb = 32;
+	u32 alloc_mb = 4;
+	u32 latency_us = 0;
+	u32 sector_ns = 0;
+	const char* output = NULL;
+	
+	for (int i = 1; i < argc; i++) {
+		if ((argv[i][0] != '-') || (argv[i][1] == 'h') || (i + 1 == argc)) {
+			bench_usage();
+			return argv[i][1] == 'h' ? 0 : 1;
+		}
+		const char* value = argv[++i];
+		switch (argv[i - 1][1]) {
+			case 'd': disk_mb = atoi(value); break;
+			case 's': sector_size = atoi(value); break;
+			case 'c': cluster_bytes = atoi(value); break;
+			case 'f': file_mb = atoi(value); break;
+			case 'a': alloc_mb = atoi(value); break;
+			case 'l': latency_us = atoi(value); break;
+			case 'n': sector_ns = atoi(value); break;
+			case 'o': output = value; break;
+			default: bench_usage(); return 1;
+		}
+	}
+	if ((sector_size > FAT_SECTOR_SIZE) || 
+		!disk_ram_create(&ram, (u32)(((uint64_t)disk_mb << 20) / 
+		sector_size), sector_size)) {
+		bench_fail("disk create");
+	}
+	
+	// The disk is formatted without a delay
+	double write_time;
+	bench_setup(cluster_bytes, &write_time, file_mb);
+	ram.latency_us = latency_us;
+	ram.sector_ns = sector_ns;
+	
+	printf("disk %u MiB, %u byte sectors, %u byte clusters\n", disk_mb, 
+		sector_size, geo.cluster_size * geo.sector_size);
+	bench_report("sequential write", file_mb / (write_time / 1e6), "MB/s");
+	bench_mount_time();
+	
+	struct volume_s* vol = bench_mount();
+	bench_read(file_mb);
+	bench_seek(file_mb);
+	bench_lookup(vol);
+	bench_eject();
+	
+	bench_alloc(alloc_mb);
+	
+	if (output && !disk_ram_save(&ram, output)) {
+		bench_fail("save");
+	}
+	disk_ram_free(&ram);
+	return 0;
+}
@@ -0,0 +1,67 @@
+// DO WHAT THE FUCK YOU WANT TO PUBLIC LICENSE
+//                    Version 2, December 2004
+//  
+// Copyright (C) 2004 Sam Hocevar <sam@hocevar.net>
+// 
+// Everyone is permitted to copy and distribute verbatim or modified
+// copies of this license document, and changing it is allowed as long
+// as the name is changed.
+//  
+//            DO WHAT THE FUCK YOU WANT TO PUBLIC LICENSE
+//   TERMS AND CONDITIONS FOR COPYING, DISTRIBUTION AND MODIFICATION
+// 
+//  0. You just DO WHAT THE FUCK YOU WANT TO.
+
+#include "board_serial.h"
+#include "board_sd_card.h"
+#include "sd_protocol.h"
+#include "dynamic_memory.h"
+
+#include <stdlib.h>
+
+void print(const char* fmt, ...) {
+	(void)fmt;
+}
+
+void print_count(const char* data, u32 count) {
+	(void)data;
+	(void)count;
+}
+
+void board_sd_card_config(void) {
+	
+}
+
+int board_sd_card_get_status(void) {
+	return 0;
+}
+
+u8 sd_protocol_config(sd_card* card) {
+	(void)card;
+	return 0;
+}
+
+u8 sd_protocol_read(sd_card* card, u8* buffer, u32 lba, u32 count) {
+	(void)card;
+	(void)buffer;
+	(void)lba;
+	(void)count;
+	return 0;
+}
+
+u8 sd_protocol_write(sd_card* card, const u8* buffer, u32 lba, u32 count) {
+	(void)card;
+	(void)buffer;
+	(void)lba;
+	(void)count;
+	return 0;
+}
+
+void* dynamic_memory_new(int bank, unsigned int size) {
+	(void)bank;
+	return malloc(size);
+}
+
+void dynamic_memory_free(void* memory) {
+	free(memory);
+}
@@ -0,0 +1,31 @@
+// DO WHAT THE FUCK YOU WANT TO PUBLIC LICENSE
+//                    Version 2, December 2004
+//  
+// Copyright (C) 2004 Sam Hocevar <sam@hocevar.net>
+// 
+// Everyone is permitted to copy and distribute verbatim or modified
+// copies of this license document, and changing it is allowed as long
+// as the name is changed.
+//  
+//            DO WHAT THE FUCK YOU WANT TO PUBLIC LICENSE
+//   TERMS AND CONDITIONS FOR COPYING, DISTRIBUTION AND MODIFICATION
+// 
+//  0. You just DO WHAT THE FUCK YOU WANT TO.
+
+#ifndef SD_PROTOCOL_H
+#define SD_PROTOCOL_H
+
+#include "fat_types.h"
+
+// Host port of the SD card protocol. All transfers fail, so only disks 
+// registered with `disk_ram_register` can be mounted
+
+typedef struct {
+	u8 unused;
+} sd_card;
+
+u8 sd_protocol_config(sd_card* card);
+u8 sd_protocol_read(sd_card* card, u8* buffer, u32 lba, u32 count);
+u8 sd_protocol_write(sd_card* card, const u8* buffer, u32 lba, u32 count);
+
+#endif
@@ -13,44 +13,262 @@
 //  0. You just DO WHAT THE FUCK YOU WANT TO.
 
 #include "disk_interface.h"
+#include "fat_config.h"
 #include "board_sd_card.h"
 #include "sd_protocol.h"
 
+#if FAT_THREAD_SAFE
+#include "fat_os.h"
+#endif
+
+#include <stddef.h>
+
+/// A registered storage device. The request queue is used by devices which 
+/// do not queue requests themselves
+struct disk_s {
+	const struct disk_ops_s* ops;
+	void* ctx;
+	struct disk_req_s* queue[DISK_QUEUE_SIZE];
+	u32 queue_head;
+	u32 queue_cnt;
+	u32 au_size;
+#if FAT_THREAD_SAFE
+	void* lock;
+#endif
+};
+
+static struct disk_s disks[DISK_MAX];
+
 /// Make a clobal SD card structure
 sd_card sd_slot_1;
 
-u8 disk_get_status(disk_e disk) {
-	switch (disk) {
-		case DISK_SD_CARD: {
-			return (u8)board_sd_card_get_status();
+static struct disk_s* disk_get(disk_e disk);
+static void disk_lock(struct disk_s* dev);
+static void disk_unlock(struct disk_s* dev);
+
+/// SD card driver. The board has one slot and `ctx` points to its SD card 
+/// structure
+static u8 sd_get_status(void* ctx) {
+	(void)ctx;
+	return (u8)board_sd_card_get_status();
+}
+
+static u8 sd_initialize(void* ctx) {
+	return (u8)sd_protocol_config((sd_card *)ctx);
+}
+
+static u8 sd_read(void* ctx, u8* buffer, u32 lba, u32 count) {
+	return sd_protocol_read((sd_card *)ctx, buffer, lba, count);
+}
+
+static u8 sd_write(void* ctx, const u8* buffer, u32 lba, u32 count) {
+	return sd_protocol_write((sd_card *)ctx, buffer, lba, count);
+}
+
+static const struct disk_ops_s sd_ops = {
+	.get_status = sd_get_status,
+	.initialize = sd_initialize,
+	.read = sd_read,
+	.write = sd_write,
+	.submit = NULL,
+	.poll = NULL,
+	.erase = NULL,
+	.sector_size = NULL
+};
+
+void disk_register_board(void) {
+	disk_register(DISK_SD_CARD, &sd_ops, &sd_slot_1);
+}
+
+u8 disk_register(disk_e disk, const struct disk_ops_s* ops, void* ctx) {
+	if ((u32)disk >= DISK_MAX) {
+		return 0;
+	}
+	struct disk_s* dev = &disks[disk];
+#if FAT_THREAD_SAFE
+	if (dev->lock == NULL) {
+		dev->lock = fat_os_mutex_new();
+		if (dev->lock == NULL) {
+			return 0;
 		}
 	}
-	return 0;
+#endif
+	dev->ops = ops;
+	dev->ctx = ctx;
+	dev->queue_head = 0;
+	dev->queue_cnt = 0;
+	dev->au_size = 0;
+	return 1;
+}
+
+u8 disk_set_au_size(disk_e disk, u32 sectors) {
+	struct disk_s* dev = disk_get(disk);
+	if (dev == NULL) {
+		return 0;
+	}
+	dev->au_size = sectors;
+	return 1;
+}
+
+u32 disk_get_au_size(disk_e disk) {
+	struct disk_s* dev = disk_get(disk);
+	if (dev == NULL) {
+		return 0;
+	}
+	return dev->au_size;
+}
+
+u8 disk_get_status(disk_e disk) {
+	struct disk_s* dev = disk_get(disk);
+	if (dev == NULL) {
+		return 0;
+	}
+	return dev->ops->get_status(dev->ctx);
 }
 
 u8 disk_initialize(disk_e disk) {
-	switch (disk) {
-		case DISK_SD_CARD: {
-			return (u8)sd_protocol_config(&sd_slot_1);
-		}
+	struct disk_s* dev = disk_get(disk);
+	if (dev == NULL) {
+		return 0;
 	}
-	return 0;
+	disk_lock(dev);
+	u8 status = dev->ops->initialize(dev->ctx);
+	disk_unlock(dev);
+	return status;
 }
 
 u8 disk_read(disk_e disk, u8* buffer, u32 lba, u32 count) {
-	switch (disk) {
-		case DISK_SD_CARD: {
-			return sd_protocol_read(&sd_slot_1, buffer, lba, count);
-		}
+	struct disk_s* dev = disk_get(disk);
+	if (dev == NULL) {
+		return 0;
 	}
-	return 0;
+	
+	// Blocking transfers are ordered after all queued requests
+	disk_lock(dev);
+	while (dev->queue_cnt) {
+		disk_poll(disk);
+	}
+	u8 status = dev->ops->read(dev->ctx, buffer, lba, count);
+	disk_unlock(dev);
+	return status;
 }
 
 u8 disk_write(disk_e disk, const u8* buffer, u32 lba, u32 count) {
-	switch (disk) {
-		case DISK_SD_CARD: {
-			return sd_protocol_write(&sd_slot_1, buffer, lba, count);
-		}
+	struct disk_s* dev = disk_get(disk);
+	if (dev == NULL) {
+		return 0;
+	}
+	disk_lock(dev);
+	while (dev->queue_cnt) {
+		disk_poll(disk);
+	}
+	u8 status = dev->ops->write(dev->ctx, buffer, lba, count);
+	disk_unlock(dev);
+	return status;
+}
+
+u32 disk_get_sector_size(disk_e disk) {
+	struct disk_s* dev = disk_get(disk);
+	if ((dev == NULL) || (dev->ops->sector_size == NULL)) {
+		return 512;
+	}
+	return dev->ops->sector_size(dev->ctx);
+}
+
+u8 disk_erase(disk_e disk, u32 lba, u32 count) {
+	struct disk_s* dev = disk_get(disk);
+	if ((dev == NULL) || (dev->ops->erase == NULL)) {
+		return 0;
+	}
+	disk_lock(dev);
+	while (dev->queue_cnt) {
+		disk_poll(disk);
+	}
+	u8 status = dev->ops->erase(dev->ctx, lba, count);
+	disk_unlock(dev);
+	return status;
+}
+
+u8 disk_submit(struct disk_req_s* req) {
+	struct disk_s* dev = disk_get(req->disk);
+	if (dev == NULL) {
+		return 0;
+	}
+	if (dev->ops->submit) {
+		return dev->ops->submit(dev->ctx, req);
+	}
+	
+	disk_lock(dev);
+	u8 status = 0;
+	if (dev->queue_cnt < DISK_QUEUE_SIZE) {
+		dev->queue[(dev->queue_head + dev->queue_cnt) % DISK_QUEUE_SIZE] = req;
+		dev->queue_cnt++;
+		status = 1;
 	}
+	disk_unlock(dev);
+	return status;
+}
+
+void disk_poll(disk_e disk) {
+	struct disk_s* dev = disk_get(disk);
+	if (dev == NULL) {
+		return;
+	}
+	if (dev->ops->poll) {
+		dev->ops->poll(dev->ctx);
+		return;
+	}
+	
+	// Drivers without their own queue are blocking, so the oldest request is 
+	// completed here
+	disk_lock(dev);
+	if (dev->queue_cnt == 0) {
+		disk_unlock(dev);
+		return;
+	}
+	struct disk_req_s* req = dev->queue[dev->queue_head];
+	dev->queue_head = (dev->queue_head + 1) % DISK_QUEUE_SIZE;
+	dev->queue_cnt--;
+	
+	u8 status;
+	if (req->write) {
+		status = dev->ops->write(dev->ctx, req->buffer, req->lba, req->count);
+	} else {
+		status = dev->ops->read(dev->ctx, req->buffer, req->lba, req->count);
+	}
+	disk_unlock(dev);
+	if (req->callback) {
+		req->callback(req->arg, status);
+	}
+}
+
+u32 disk_get_time(void) {
+	// No RTC on this board
 	return 0;
 }
+
+/// Returns the registered device with number `disk`, or NULL
+static struct disk_s* disk_get(disk_e disk) {
+	if (((u32)disk >= DISK_MAX) || (disks[disk].ops == NULL)) {
+		return NULL;
+	}
+	return &disks[disk];
+}
+
+/// The device lock serializes the users of one device. It is never shared by
+/// two devices
+static void disk_lock(struct disk_s* dev) {
+#if FAT_THREAD_SAFE
+	fat_os_mutex_lock(dev->lock);
+#else
+	(void)dev;
+#endif
+}
+
+static void disk_unlock(struct disk_s* dev) {
+#if FAT_THREAD_SAFE
+	fat_os_mutex_unlock(dev->lock);
+#else
+	(void)dev;
+#endif
+}
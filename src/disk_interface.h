@@ -17,11 +17,54 @@
 
 #include "fat_types.h"
 
-/// Add new physical disk here
+/// Disk numbers. A storage device is attached to a number with 
+/// `disk_register`, and any number below DISK_MAX can be used
 typedef enum {
-	DISK_SD_CARD
+	DISK_SD_CARD,
+	DISK_SD_CARD_2,
+	DISK_EMMC
 } disk_e;
 
+#define DISK_MAX 4
+
+/// Maximum number of asynchronous requests in flight per disk
+#define DISK_QUEUE_SIZE 4
+
+struct disk_req_s;
+
+/// Storage device driver. Every function takes the device context given to
+/// `disk_register`. `submit`, `poll`, `erase` and `sector_size` are optional.
+/// Without them the requests are queued by the disk interface and completed 
+/// with `read` and `write` when the disk is polled, and the sectors are 512 
+/// bytes. A driver with its own queue must 
+/// complete `read` and `write` after all requests submitted before them
+struct disk_ops_s {
+	u8 (*get_status)(void* ctx);
+	u8 (*initialize)(void* ctx);
+	u8 (*read)(void* ctx, u8* buffer, u32 lba, u32 count);
+	u8 (*write)(void* ctx, const u8* buffer, u32 lba, u32 count);
+	u8 (*submit)(void* ctx, struct disk_req_s* req);
+	void (*poll)(void* ctx);
+	u8 (*erase)(void* ctx, u32 lba, u32 count);
+	u32 (*sector_size)(void* ctx);
+};
+
+/// Attach a storage device driver and its context to a disk number. Disks do
+/// not share any state, so transfers on different disks can run in parallel
+u8 disk_register(disk_e disk, const struct disk_ops_s* ops, void* ctx);
+
+/// Registers the storage devices on this board
+void disk_register_board(void);
+
+/// Set the allocation unit (erase block) size of a disk in sectors. Flash 
+/// media are written fastest in whole allocation units, so the file system 
+/// allocates and writes back within one unit at a time. Zero disables this. 
+/// It takes effect on the next mount
+u8 disk_set_au_size(disk_e disk, u32 sectors);
+
+/// Returns the allocation unit size of a disk in sectors, or zero if unknown
+u32 disk_get_au_size(disk_e disk);
+
 /// Returns the status of the MSD (mass storage device)
 u8 disk_get_status(disk_e disk);
 
@@ -34,4 +77,38 @@ u8 disk_read(disk_e disk, u8* buffer, u32 lba, u32 count);
 /// Write a number of sectors to the MSD
 u8 disk_write(disk_e disk, const u8* buffer, u32 lba, u32 count);
 
+/// Returns the logical sector size of the MSD in bytes
+u32 disk_get_sector_size(disk_e disk);
+
+/// Erase (discard) a number of sectors on the MSD. The content of erased 
+/// sectors is undefined. Returns `0` if the disk has no erase command
+u8 disk_erase(disk_e disk, u32 lba, u32 count);
+
+/// Called when an asynchronous request has completed. `status` is `1` if the 
+/// transfer succeeded
+typedef void (*disk_callback_t)(void* arg, u8 status);
+
+/// Asynchronous sector transfer. The request and its buffer must stay valid 
+/// until the callback is called
+struct disk_req_s {
+	disk_e disk;
+	u8* buffer;
+	u32 lba;
+	u32 count;
+	u8 write;
+	disk_callback_t callback;
+	void* arg;
+};
+
+/// Queue an asynchronous transfer. Requests complete in the order they were
+/// submitted. Returns `0` if the in-flight queue is full
+u8 disk_submit(struct disk_req_s* req);
+
+/// Progress queued transfers and call the callbacks of completed requests
+void disk_poll(disk_e disk);
+
+/// Returns the current time in FAT format with the date in the upper 16 bits
+/// and the time in the lower 16 bits. Returns zero if no clock is available
+u32 disk_get_time(void);
+
 #endif
\ No newline at end of file
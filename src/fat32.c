@@ -15,11 +15,42 @@
 #include "fat32.h"
 #include "board_serial.h"
 #include "board_sd_card.h"
+#if FAT_DYNAMIC_MEMORY
 #include "dynamic_memory.h"
+#endif
+#if FAT_THREAD_SAFE
+#include "fat_os.h"
+#endif
 #include "syscall.h"
 
 #include <stddef.h>
 
+// Use 128-bit vector copies on ARM cores with NEON or Helium (MVE). Both
+// extensions provide the same load and store intrinsics
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#define FAT_SIMD 1
+#elif defined(__ARM_FEATURE_MVE)
+#include <arm_mve.h>
+#define FAT_SIMD 1
+#else
+#define FAT_SIMD 0
+#endif
+
+/// Word type used by the memory functions. It may alias any other type
+#if defined(__GNUC__)
+typedef u32 __attribute__((__may_alias__)) fat_word;
+#else
+typedef u32 fat_word;
+#endif
+
+/// Adds `n` to a volume statistics counter. It compiles to nothing when the
+/// statistics are disabled
+#if FAT_STATS
+#define FAT_STAT(vol, field, n)	((vol)->stats.field += (n))
+#else
+#define FAT_STAT(vol, field, n)	((void)0)
+#endif
 
 /// Buffer and bitmask used for volume mounting. When a partition on the MSD 
 /// contains a valid FAT32 file system, a FAT32 volume is dynamically allocated
@@ -28,9 +59,12 @@
 static struct volume_s* volume_base;
 static u32 volume_bitmask;
 
-/// Temporary buffer used in the mounting process, specifically for retrieving
-/// the MBR boot sector and BPB sector for FAT32 recognition
-static u8 mount_buffer[512];
+/// Optional pool of volume objects. The pool memory is split into blocks of 
+/// `fat_pool_block_size` bytes, and free blocks are linked through their first
+/// word
+static void* pool_free;
+static u8* pool_start;
+static u8* pool_end;
 
 /// UCS-2 offsets used in long file name (LFN) entries
 static const u8 lfn_lut[] = {1, 3, 5, 7, 9, 14, 16, 18, 20, 22, 24, 28, 30};
@@ -66,34 +100,196 @@ static u32 fat_load32(const void* src);
 static u16 fat_load16(const void* src);
 static u8 fat_volume_add(struct volume_s* vol);
 static u8 fat_volume_remove(char letter);
+static struct volume_s* fat_volume_new(void);
+static void fat_volume_setup(struct volume_s* vol, const u8* bpb, u32 lba);
+static u8 fat_format_clear(struct volume_s* vol, u32 lba, u32 count, 
+	const u8* zero, u32 zero_sect);
+static void fat_volume_delete(struct volume_s* vol);
+static void fat_part_add(struct partition_s* parts, u32* count, u32 lba, 
+	u32 size, u8 type);
+static inline u8 fat_part_extended(u8 type);
+static u8 fat_mount_scan(disk_e disk, u8* buffer, u32 buffer_cnt, 
+	u32 sect_size, struct partition_s* parts, u32* count);
+static u8 fat_mount_ebr(disk_e disk, u8* buffer, u32 ext_lba, 
+	struct partition_s* parts, u32* count);
+static u8 fat_mount_gpt(disk_e disk, u8* buffer, u32 buffer_cnt, 
+	u32 sect_size, struct partition_s* parts, u32* count);
+static void fat_mount_probe(disk_e disk, u8* buffer, u32 sect_size,
+	const struct partition_s* parts, u32 count);
 static u8 fat_search(const u8* bpb);
 static void fat_print_sector(const u8* sector);
 static u8 fat_dir_lfn_cmp(const u8* lfn, const char* name, u32 size);
+static u32 fat_dir_lfn_length(const u8* lfn);
 static u8 fat_dir_sfn_cmp(const char* sfn, const char* name, u8 size);
+static u8 fat_dir_sfn_name(const u8* sfn, char* name);
 static u8 fat_dir_sfn_crc(const u8* sfn);
-static u8 fat_dir_set_index(struct dir_s* dir, u32 index);
+static u8 fat_dir_set_index(struct dir_s* dir, const struct dir_pos_s* pos);
+static u8 fat_dir_in_chain(struct dir_s* dir, u32 cluster);
+static u8 fat_dir_lfn_start(struct dir_s* dir, u8* start);
 static u8 fat_dir_get_next(struct dir_s* dir);
 static u8 fat_dir_search(struct dir_s* dir, const char* name, u32 size);
+static u8 fat_dir_scan(struct dir_s* dir, const char* name, u32 size, 
+	u8 single);
+static u16 fat_dir_hash(const char* name, u32 size);
+static struct dir_index_s* fat_dir_index_get(struct volume_s* vol, u32 start);
+static u8 fat_dir_index_build(struct volume_s* vol, struct dir_index_s* index);
+static u8 fat_dir_index_add(struct dir_index_s* index, u16 hash, u32 sector,
+	u32 offset);
+static void fat_dir_index_drop(struct volume_s* vol, u32 start_sect);
 static u8 fat_table_get(struct volume_s* vol, u32 cluster, u32* fat);
 static u8 fat_table_set(struct volume_s* vol, u32 cluster, u32 fat_entry);
+static u8 fat_table_extent(struct volume_s* vol, u32 cluster, u32 max,
+	u32* length);
+static inline void fat_bitmap_mark(struct volume_s* vol, u32 cluster, 
+	u8 used);
+static u8 fat_bitmap_find(struct volume_s* vol, u32 start, u32* cluster);
+static u8 fat_bitmap_free_range(struct volume_s* vol, u32 first, u32 count);
+static u8 fat_bitmap_find_au(struct volume_s* vol, u32 start, u32* cluster);
+static u8 fat_find_run(struct volume_s* vol, u32 want, u32* start, 
+	u32* length);
+static u8 fat_file_chain_end(struct file_s* file, u32* last, u32* count);
+static u8 fat_file_walk(struct file_s* file, u32 index, u32* cluster);
+static u8 fat_file_runs(struct file_s* file, u32* clusters, u32* fragments);
+static u8 fat_chain_free(struct volume_s* vol, u32 cluster);
+static u8 fat_file_set_first(struct file_s* file, u32 cluster);
+static u8 fat_file_grow(struct file_s* file, u32 size);
+static u8 fat_file_span(struct file_s* file, u32 max, u32* span);
 static u8 fat_read(struct volume_s* vol, u32 lba);
+static u8 fat_read_new(struct volume_s* vol, u32 lba);
+static void fat_cache_drop(struct volume_s* vol, u32 lba, u32 count);
 static u8 fat_flush(struct volume_s* vol);
+static u8 fat_sync(struct volume_s* vol);
+static u8 fat_fsinfo_load(struct volume_s* vol);
+static u8 fat_fsinfo_store(struct volume_s* vol);
+static u8 fat_flush_range(struct volume_s* vol, u32 lba, u32 count);
+static u32 fat_crc32(u32 crc, const u8* data, u32 count);
+static u8 fat_is_blank(const u8* data, u32 size);
+#if FAT_FAST_MOUNT
+static u8 fat_snap_load(struct volume_s* vol, u32 vol_id);
+static u8 fat_snap_store(struct volume_s* vol);
+static u8 fat_snap_bitmap_load(struct volume_s* vol);
+static u8 fat_snap_fat_crc(struct volume_s* vol, u32* crc);
+#endif
+static inline void fat_mark_dirty(struct volume_s* vol);
+static struct cache_s* fat_cache_fetch(struct volume_s* vol, 
+	struct sect_cache_s* cache, u32 lba, u8 load);
+static u8 fat_cache_flush(struct volume_s* vol, struct sect_cache_s* cache,
+	u32 lba, u32 count);
+static u8 fat_cache_write(struct volume_s* vol, struct sect_cache_s* cache,
+	const u8* buffer, u32 lba, u32 count);
+#if FAT_MIRROR != FAT_MIRROR_EAGER
+static void fat_mirror_add(struct volume_s* vol, u32 sect, u32 count);
+static u8 fat_mirror_sync(struct volume_s* vol);
+#endif
+#if FAT_MIRROR == FAT_MIRROR_SINGLE
+static u8 fat_mirror_disable(struct volume_s* vol, u8* bpb);
+#endif
+static inline u32 fat_rsvd_cnt(const struct volume_s* vol);
+static void fat_cache_init(struct volume_s* vol);
+static struct cache_s* fat_table_read(struct volume_s* vol, u32 lba);
 static inline u32 fat_sect_to_clust(struct volume_s* vol, u32 sect);
+static inline u32 fat_sect_size(const struct volume_s* vol);
+static inline u32 fat_sect_shift(const struct volume_s* vol);
+static inline u32 fat_entry_sect(const struct volume_s* vol, u32 cluster);
+static inline u32 fat_entry_index(const struct volume_s* vol, u32 cluster);
 static inline u32 fat_clust_to_sect(struct volume_s* vol, u32 clust);
 static fstatus fat_follow_path(struct dir_s* dir, const char* path, u32 length);
 static fstatus fat_get_vol_label(struct volume_s* vol, char* label);
+static u32 fat_path_lookup(struct volume_s* vol, const char* path, 
+	u32* start_sect);
+static void fat_path_add(struct volume_s* vol, const char* path, u32 length,
+	u32 start_sect);
+#if FAT_PATH_CACHE_SIZE
+static u8 fat_path_prefix(const struct path_cache_s* entry, const char* path);
+#endif
+static void fat_path_drop(struct volume_s* vol);
 static void fat_print_info(struct info_s* info);
 static u8 fat_file_addr_resolve(struct file_s* file);
+static struct extent_s* fat_file_map_find(struct file_s* file, u32 index);
+static void fat_file_map_add(struct file_s* file, u32 index, u32 cluster,
+	u32 length);
 static fstatus fat_make_entry_chain(struct dir_s* dir, u8 entry_cnt);
+static void fat_file_complete(void* arg, u8 status);
+static u8 fat_file_submit(struct file_s* file, u8* buffer, u32 count, 
+	u8 write);
+static void fat_file_ra_reset(struct file_s* file);
+static u8 fat_file_ra_fill(struct file_s* file);
+static u8 fat_file_ra_get(struct file_s* file, const u8** data, u32* length);
+static inline u8 fat_disk_read(struct volume_s* vol, u8* buffer, u32 lba,
+	u32 count);
+static void fat_req_complete(void* arg, u8 status);
+static void fat_req_submit(struct fat_req_s* req, disk_e disk, u8* buffer, 
+	u32 lba, u32 count, u8 write);
+static u8 fat_req_wait(struct fat_req_s* req, disk_e disk);
+static inline u8 fat_disk_write(struct volume_s* vol, const u8* buffer, 
+	u32 lba, u32 count);
+static inline u32 fat_stat_clock(void);
+static inline void fat_stat_io(struct volume_s* vol, u8 write, u32 count,
+	u32 cycles);
+static inline void fat_lock(struct volume_s* vol);
+static inline void fat_unlock(struct volume_s* vol);
+static fstatus volume_set_label_locked(struct volume_s* vol, const char* name,
+	u8 length);
+static fstatus volume_get_label_locked(struct volume_s* vol, char* name);
+static fstatus volume_sync_locked(struct volume_s* vol);
+static fstatus volume_format_locked(struct volume_s* vol, 
+	struct fat_fmt_s* fmt);
+static fstatus volume_bitmap_attach_locked(struct volume_s* vol, u32* bitmap,
+	u32 size);
+static fstatus volume_bitmap_build_locked(struct volume_s* vol,
+	u32 sector_cnt);
+static fstatus volume_index_attach_locked(struct volume_s* vol, void* memory,
+	u32 size);
+static fstatus volume_write_attach_locked(struct volume_s* vol, u8* buffer,
+	u32 size);
+static fstatus volume_frag_scan_locked(struct volume_s* vol, 
+	struct frag_s* frag, u32 sector_cnt);
+static fstatus volume_get_stats_locked(struct volume_s* vol,
+	struct fat_stats_s* stats, u8 reset);
+static fstatus fat_dir_close_locked(struct dir_s* dir);
+static fstatus fat_dir_read_locked(struct dir_s* dir, struct info_s* info);
+static fstatus fat_dir_read_many_locked(struct dir_s* dir,
+	struct dir_entry_s* entries, u32 max, char* names, u32 names_size,
+	dir_filter_e filter, u32* count);
+static fstatus fat_dir_rename_locked(struct dir_s* dir, const char* name,
+	u8 length);
+static fstatus fat_file_open_locked(struct file_s* file, const char* path,
+	u16 length);
+static fstatus fat_file_flush_locked(struct file_s* file);
+static fstatus fat_file_read_locked(struct file_s* file, u8* buffer, u32 count,
+	u32* status);
+static fstatus fat_file_write_locked(struct file_s* file, const u8* buffer,
+	u32 count);
+static fstatus fat_file_read_async_locked(struct file_s* file, u8* buffer,
+	u32 count, u32* status);
+static fstatus fat_file_write_async_locked(struct file_s* file,
+	const u8* buffer, u32 count, u32* status);
+static fstatus fat_file_jump_locked(struct file_s* file, u32 offset);
+static fstatus fat_file_reserve_locked(struct file_s* file, u32 size);
+static fstatus fat_file_set_map_locked(struct file_s* file,
+	struct extent_s* map, u32 size);
+static fstatus fat_file_get_extents_locked(struct file_s* file, u32 offset,
+	struct lba_extent_s* extents, u32 size, u32* count);
+static fstatus fat_file_frag_locked(struct file_s* file, struct frag_s* frag);
+static fstatus fat_file_defrag_locked(struct file_s* file, struct defrag_s* df,
+	u8* buffer, u32 size);
+static fstatus fat_file_defrag_abort_locked(struct file_s* file, 
+	struct defrag_s* df);
+static fstatus fat_file_set_readahead_locked(struct file_s* file,
+	struct readahead_s* ra, u8* buffer, u32 size);
 
 
 /// Remove
 static void fat_print_table(struct volume_s* vol, u32 sector) {
-	fat_read(vol, vol->fat_lba + sector);
+	struct cache_s* entry = fat_table_read(vol, vol->fat_lba + sector);
+	if (entry == NULL) {
+		return;
+	}
 	print("\n" ANSI_YELLOW);
-	print("FAT: %d\t", sector * 128);
-	for (u8 i = 0; i < 128;) {
-		u32 curr = fat_load32(vol->buffer + i * 4);
+	u32 entries = fat_sect_size(vol) / 4;
+	print("FAT: %d\t", sector * entries);
+	for (u32 i = 0; i < entries;) {
+		u32 curr = fat_load32(entry->buffer + i * 4);
 		
 		print("%h", (u8)(curr >> 24));
 		print("%h", (u8)(curr >> 16));
@@ -102,41 +298,123 @@ static void fat_print_table(struct volume_s* vol, u32 sector) {
 		print("   ");
 		if ((i++ % 4) == 0) {
 			print("\n");
-			print("FAT: %d\t", sector * 128 + i);
+			print("FAT: %d\t", sector * entries + i);
 			
 		}
 	}
 	print("\n" BLUE);
 }
 
-/// Copies `count` number of bytes from source to destination using byte access
+/// Copies `count` number of bytes from source to destination. Blocks with the
+/// same word alignment are copied in 16-byte bursts, the rest byte by byte
 static void fat_memcpy(const void* src, void* dest, u32 count) {
 	const u8* src_ptr = (const u8 *)src;
 	u8* dest_ptr = (u8 *)dest;
-	do {
+	
+#if FAT_SIMD
+	// Vector loads and stores have no alignment requirements
+	while (count >= 16) {
+		vst1q_u8(dest_ptr, vld1q_u8(src_ptr));
+		src_ptr += 16;
+		dest_ptr += 16;
+		count -= 16;
+	}
+#else
+	if ((((size_t)src_ptr ^ (size_t)dest_ptr) & 3) == 0) {
+		// Copy the unaligned head bytes
+		while (count && ((size_t)src_ptr & 3)) {
+			*dest_ptr++ = *src_ptr++;
+			count--;
+		}
+		const fat_word* src_word = (const fat_word *)src_ptr;
+		fat_word* dest_word = (fat_word *)dest_ptr;
+		
+		while (count >= 16) {
+			dest_word[0] = src_word[0];
+			dest_word[1] = src_word[1];
+			dest_word[2] = src_word[2];
+			dest_word[3] = src_word[3];
+			src_word += 4;
+			dest_word += 4;
+			count -= 16;
+		}
+		while (count >= 4) {
+			*dest_word++ = *src_word++;
+			count -= 4;
+		}
+		src_ptr = (const u8 *)src_word;
+		dest_ptr = (u8 *)dest_word;
+	}
+#endif
+	while (count--) {
 		*dest_ptr++ = *src_ptr++;
-	} while (--count);
+	}
 }
 
-/// Compares two memory blocks with size `count`
+/// Compares two memory blocks with size `count`. Returns `1` if they are equal
 static u8 fat_memcmp(const void* src_1, const void* src_2, u32 count) {
-	if (count == 0) {
-		return 1;
-	}
 	const u8* src_1_ptr = (const u8 *)src_1;
 	const u8* src_2_ptr = (const u8 *)src_2;
 	
-	do {
-		if (*src_1_ptr != *src_2_ptr) {
+	// Compare one word at the time if the blocks have the same alignment
+	if ((((size_t)src_1_ptr ^ (size_t)src_2_ptr) & 3) == 0) {
+		while (count && ((size_t)src_1_ptr & 3)) {
+			if (*src_1_ptr++ != *src_2_ptr++) {
+				return 0;
+			}
+			count--;
+		}
+		const fat_word* word_1 = (const fat_word *)src_1_ptr;
+		const fat_word* word_2 = (const fat_word *)src_2_ptr;
+		
+		while (count >= 4) {
+			if (*word_1++ != *word_2++) {
+				return 0;
+			}
+			count -= 4;
+		}
+		src_1_ptr = (const u8 *)word_1;
+		src_2_ptr = (const u8 *)word_2;
+	}
+	while (count--) {
+		if (*src_1_ptr++ != *src_2_ptr++) {
 			return 0;
 		}
-		src_1_ptr++;
-		src_2_ptr++;
-	} while (--count);
-	
+	}
 	return 1;
 }
 
+#if FAT_LITTLE_ENDIAN
+
+// The on-disk format matches the CPU. The compiler turns these copies into 
+// single loads and stores
+
+/// Store a 32-bit value in LE format
+static void fat_store32(void* dest, u32 value) {
+	__builtin_memcpy(dest, &value, 4);
+}
+
+/// Store a 16-bit value in LE format
+static void fat_store16(void* dest, u16 value) {
+	__builtin_memcpy(dest, &value, 2);
+}
+
+/// Load a 32-bit value from `src` in LE format
+static u32 fat_load32(const void* src) {
+	u32 value;
+	__builtin_memcpy(&value, src, 4);
+	return value;
+}
+
+/// Load a 16-bit value from `src` in LE format
+static u16 fat_load16(const void* src) {
+	u16 value;
+	__builtin_memcpy(&value, src, 2);
+	return value;
+}
+
+#else
+
 /// Store a 32-bit value in LE format
 static void fat_store32(void* dest, u32 value) {
 	u8* dest_ptr = (u8 *)dest;
@@ -164,7 +442,7 @@ static u32 fat_load32(const void* src) {
 	value |= *src_ptr++;
 	value |= (*src_ptr++ << 8);
 	value |= (*src_ptr++ << 16);
-	value |= (*src_ptr++ << 24);
+	value |= ((u32)*src_ptr++ << 24);
 	return value;
 }
 
@@ -177,6 +455,8 @@ static u16 fat_load16(const void* src) {
 	return value;
 }
 
+#endif
+
 /// Remove
 static void fat_print_sector(const u8* sector) {
 	for (u32 i = 0; i < 512;) {
@@ -189,6 +469,106 @@ static void fat_print_sector(const u8* sector) {
 	print("\n");
 }
 
+/// Returns the current cycle count used to time the disk transfers
+static inline u32 fat_stat_clock(void) {
+#if FAT_STATS && defined(FAT_STATS_CLOCK)
+	return (u32)(FAT_STATS_CLOCK);
+#else
+	return 0;
+#endif
+}
+
+/// Counts one disk command of `count` sectors taking `cycles` cycles
+static inline void fat_stat_io(struct volume_s* vol, u8 write, u32 count,
+	u32 cycles) {
+#if FAT_STATS
+	if (write) {
+		vol->stats.write_cmds++;
+		vol->stats.write_sects += count;
+		vol->stats.write_cycles += cycles;
+	} else {
+		vol->stats.read_cmds++;
+		vol->stats.read_sects += count;
+		vol->stats.read_cycles += cycles;
+	}
+#else
+	(void)vol;
+	(void)write;
+	(void)count;
+	(void)cycles;
+#endif
+}
+
+/// Reads `count` sectors from the disk of `vol` and counts the transfer
+static inline u8 fat_disk_read(struct volume_s* vol, u8* buffer, u32 lba,
+	u32 count) {
+	u32 start = fat_stat_clock();
+	u8 status = disk_read(vol->disk, buffer, lba, count);
+	fat_stat_io(vol, 0, count, fat_stat_clock() - start);
+	return status;
+}
+
+/// Writes `count` sectors to the disk of `vol` and counts the transfer
+static inline u8 fat_disk_write(struct volume_s* vol, const u8* buffer, 
+	u32 lba, u32 count) {
+	u32 start = fat_stat_clock();
+	u8 status = disk_write(vol->disk, buffer, lba, count);
+	fat_stat_io(vol, 1, count, fat_stat_clock() - start);
+	return status;
+}
+
+/// Completion callback of the internal disk requests
+static void fat_req_complete(void* arg, u8 status) {
+	struct fat_req_s* req = (struct fat_req_s *)arg;
+	req->status = status;
+	req->pending = 0;
+}
+
+/// Queues a transfer of `count` sectors at `lba`. Waits for room if the disk 
+/// queue is full
+static void fat_req_submit(struct fat_req_s* req, disk_e disk, u8* buffer, 
+	u32 lba, u32 count, u8 write) {
+	req->req.disk = disk;
+	req->req.buffer = buffer;
+	req->req.lba = lba;
+	req->req.count = count;
+	req->req.write = write;
+	req->req.callback = fat_req_complete;
+	req->req.arg = req;
+	req->status = 0;
+	req->pending = 1;
+	while (!disk_submit(&req->req)) {
+		disk_poll(disk);
+	}
+}
+
+/// Waits for a queued transfer and returns its result
+static u8 fat_req_wait(struct fat_req_s* req, disk_e disk) {
+	while (req->pending) {
+		disk_poll(disk);
+	}
+	return req->status;
+}
+
+/// Takes the volume lock. It protects the sector caches, the FAT and all other 
+/// volume state, and is taken by every public function using the volume
+static inline void fat_lock(struct volume_s* vol) {
+#if FAT_THREAD_SAFE
+	fat_os_mutex_lock(vol->lock);
+#else
+	(void)vol;
+#endif
+}
+
+/// Releases the volume lock
+static inline void fat_unlock(struct volume_s* vol) {
+#if FAT_THREAD_SAFE
+	fat_os_mutex_unlock(vol->lock);
+#else
+	(void)vol;
+#endif
+}
+
 /// Add a volume to the system volumes and assign a letter to it
 static u8 fat_volume_add(struct volume_s* vol) {
 	if (volume_base == NULL) {
@@ -245,6 +625,37 @@ static u8 fat_volume_remove(char letter) {
 	return 1;
 }
 
+/// Allocates memory for a new volume from the volume pool, or from the dynamic
+/// memory driver if there is no pool. Returns NULL if no memory is available
+static struct volume_s* fat_volume_new(void) {
+	if (pool_start) {
+		void* block = pool_free;
+		if (block) {
+			pool_free = *(void **)block;
+		}
+		return (struct volume_s *)block;
+	}
+#if FAT_DYNAMIC_MEMORY
+	return (struct volume_s *)dynamic_memory_new(DRAM_BANK_0, 
+		sizeof(struct volume_s));
+#else
+	return NULL;
+#endif
+}
+
+/// Returns the memory of a removed volume to where it was allocated from
+static void fat_volume_delete(struct volume_s* vol) {
+	u8* block = (u8 *)vol;
+	if ((block >= pool_start) && (block < pool_end)) {
+		*(void **)block = pool_free;
+		pool_free = block;
+		return;
+	}
+#if FAT_DYNAMIC_MEMORY
+	dynamic_memory_free(vol);
+#endif
+}
+
 /// Checks for a valid FAT32 file system on the given partition. The `bpb`
 /// should point to a buffer containing the first sector in this parition. 
 static u8 fat_search(const u8* bpb) {
@@ -297,8 +708,77 @@ static u8 fat_dir_sfn_crc(const u8* sfn) {
 	return crc;
 }
 
-/// Move the directory pointer to entry `index` relative to the directory base. 
-static u8 fat_dir_set_index(struct dir_s* dir, u32 index) {
+/// Move the directory pointer to the position `pos` taken from the same 
+/// directory. Returns `0` if the position does not belong to `dir`, does not
+/// point to an entry in a cluster of the directory or does not point to the 
+/// first entry of an object. `dir` is only changed if the position is valid
+static u8 fat_dir_set_index(struct dir_s* dir, const struct dir_pos_s* pos) {
+	struct volume_s* vol = dir->vol;
+	
+	if ((pos->start_sect != dir->start_sect) || (pos->cluster < 2) ||
+		(pos->cluster >= vol->cluster_cnt + 2)) {
+		return 0;
+	}
+	if ((pos->sector - fat_clust_to_sect(vol, pos->cluster) >= 
+		vol->cluster_size) || (pos->rw_offset >= fat_sect_size(vol)) ||
+		(pos->rw_offset & 31)) {
+		return 0;
+	}
+	
+	// The cluster must belong to this directory, otherwise the position could
+	// point into any other file on the volume
+	if (!fat_dir_in_chain(dir, pos->cluster)) {
+		return 0;
+	}
+	struct dir_s tmp = *dir;
+	tmp.cluster = pos->cluster;
+	tmp.sector = pos->sector;
+	tmp.rw_offset = pos->rw_offset;
+	u8 start;
+	if (!fat_dir_lfn_start(&tmp, &start) || (start != pos->lfn_start)) {
+		return 0;
+	}
+	*dir = tmp;
+	return 1;
+}
+
+/// Returns `1` if `cluster` is part of the cluster chain of `dir`. The walk is
+/// limited to the number of clusters on the volume in case the chain loops
+static u8 fat_dir_in_chain(struct dir_s* dir, u32 cluster) {
+	struct volume_s* vol = dir->vol;
+	u32 curr = fat_sect_to_clust(vol, dir->start_sect);
+	
+	for (u32 i = 0; i < vol->cluster_cnt; i++) {
+		if (curr == cluster) {
+			return 1;
+		}
+		if (!fat_table_get(vol, curr, &curr)) {
+			return 0;
+		}
+		curr &= 0xFFFFFFF;
+		if ((curr < 2) || (curr >= vol->cluster_cnt + 2)) {
+			return 0;
+		}
+	}
+	return 0;
+}
+
+/// Reads the entry at the `dir` pointer and returns in `start` whether it is 
+/// the first entry of a LFN name. Returns `0` if it can not be read, or if it
+/// is inside a LFN name and does not start an object
+static u8 fat_dir_lfn_start(struct dir_s* dir, u8* start) {
+	if (!fat_read(dir->vol, dir->sector)) {
+		return 0;
+	}
+	const u8* entry = dir->vol->buffer + dir->rw_offset;
+	*start = 0;
+	if ((entry[0] != 0x00) && (entry[0] != 0xE5) && 
+		((entry[SFN_ATTR] & ATTR_LFN) == ATTR_LFN)) {
+		if (!(entry[LFN_SEQ] & 0x40)) {
+			return 0;
+		}
+		*start = 1;
+	}
 	return 1;
 }
 
@@ -308,8 +788,8 @@ static u8 fat_dir_get_next(struct dir_s* dir) {
 	dir->rw_offset += 32;
 	
 	// Check for sector overflow
-	if (dir->rw_offset >= dir->vol->sector_size) {
-		dir->rw_offset -= dir->vol->sector_size;
+	if (dir->rw_offset >= fat_sect_size(dir->vol)) {
+		dir->rw_offset -= fat_sect_size(dir->vol);
 		dir->sector++;
 		
 		// Check for cluster overflow
@@ -342,25 +822,37 @@ static u8 fat_dir_get_next(struct dir_s* dir) {
 /// descriptor
 static u8 fat_file_addr_resolve(struct file_s* file) {	
 	// Check for sector overflow
-	if (file->rw_offset >= file->vol->sector_size) {
-		file->rw_offset -= file->vol->sector_size;
+	if (file->rw_offset >= fat_sect_size(file->vol)) {
+		file->rw_offset -= fat_sect_size(file->vol);
 		file->sector++;
 		
 		// Check for cluster overflow
 		if (file->sector >= (fat_clust_to_sect(file->vol, file->cluster) +
 			file->vol->cluster_size)) {
 			
-			// Get the next cluster from the FAT table
+			// The file pointer is at the start of the new cluster, which gives
+			// the file relative cluster index
+			u32 index = (file->glob_offset >> fat_sect_shift(file->vol)) / 
+				file->vol->cluster_size;
 			u32 new_cluster;
-			if (!fat_table_get(file->vol, file->cluster, &new_cluster)) {
-				return 0;
-			}
 			
-			// Check if the FAT table entry is the EOC
-			u32 eoc_value = new_cluster & 0xFFFFFFF;
-			if ((eoc_value >= 0xFFFFFF8) && (eoc_value <= 0xFFFFFFF)) {
-				print("EOC value: %d\n", eoc_value);
-				return 0;
+			// Try the extent map before reading the FAT table
+			struct extent_s* ext = fat_file_map_find(file, index);
+			if (ext && (index < ext->offset + ext->length)) {
+				new_cluster = ext->cluster + (index - ext->offset);
+			} else {
+				
+				// Get the next cluster from the FAT table
+				if (!fat_table_get(file->vol, file->cluster, &new_cluster)) {
+					return 0;
+				}
+				
+				// Check if the FAT table entry is the EOC
+				u32 eoc_value = new_cluster & 0xFFFFFFF;
+				if ((eoc_value >= 0xFFFFFF8) && (eoc_value <= 0xFFFFFFF)) {
+					return 0;
+				}
+				fat_file_map_add(file, index, new_cluster, 1);
 			}
 			
 			// Update the sector LBA from the cluster number
@@ -371,909 +863,4564 @@ static u8 fat_file_addr_resolve(struct file_s* file) {
 	return 1;
 }
 
+/// Returns the last extent in the map starting at or before the file relative
+/// cluster `index`. Returns NULL if the file has no extent map
+static struct extent_s* fat_file_map_find(struct file_s* file, u32 index) {
+	if ((file->map == NULL) || (file->map_cnt == 0)) {
+		return NULL;
+	}
+	
+	// Binary search. The extents are sorted by the file offset
+	u32 low = 0;
+	u32 high = file->map_cnt - 1;
+	while (low < high) {
+		u32 mid = (low + high + 1) / 2;
+		if (file->map[mid].offset <= index) {
+			low = mid;
+		} else {
+			high = mid - 1;
+		}
+	}
+	return &file->map[low];
+}
+
+/// Adds `length` contiguous clusters starting at file relative cluster `index`
+/// to the extent map. The map only covers the start of the chain, so clusters
+/// not following the mapped area are ignored. When the map is full the new 
+/// clusters are dropped
+static void fat_file_map_add(struct file_s* file, u32 index, u32 cluster, 
+	u32 length) {
+	
+	if (file->map == NULL) {
+		return;
+	}
+	u32 end = 0;
+	struct extent_s* last = NULL;
+	if (file->map_cnt) {
+		last = &file->map[file->map_cnt - 1];
+		end = last->offset + last->length;
+	}
+	if ((index > end) || (index + length <= end)) {
+		return;
+	}
+	
+	// Skip the part which is already mapped
+	cluster += end - index;
+	length -= end - index;
+	
+	if (last && (last->cluster + last->length == cluster)) {
+		last->length += length;
+	} else if (file->map_cnt < file->map_size) {
+		last = &file->map[file->map_cnt++];
+		last->cluster = cluster;
+		last->offset = end;
+		last->length = length;
+	}
+}
+
 /// Returns the 32-bit FAT entry corresponding with the cluster number
 static u8 fat_table_get(struct volume_s* vol, u32 cluster, u32* fat_entry) {
+	FAT_STAT(vol, fat_lookups, 1);
+	
 	// Calculate the sector LBA from the FAT table base address
-	u32 start_sect = vol->fat_lba + cluster / 128;
-	u32 start_off = cluster % 128;
+	u32 start_sect = fat_entry_sect(vol, cluster);
+	u32 start_off = fat_entry_index(vol, cluster);
 	
-	if (!fat_read(vol, start_sect)) {
+	struct cache_s* entry = fat_table_read(vol, start_sect);
+	if (entry == NULL) {
 		return 0;
 	}
-	*fat_entry = fat_load32(vol->buffer + start_off * 4);
+	*fat_entry = fat_load32(entry->buffer + start_off * 4);
 	return 1;
 }
 
 /// Set the FAT table entry corresponding to `cluster` to a specified value
 static u8 fat_table_set(struct volume_s* vol, u32 cluster, u32 fat_entry) {
 	// Calculate the sector LBA from the FAT table base address
-	u32 start_sect = vol->fat_lba + cluster / 128;
-	u32 start_offset = cluster % 128;
+	u32 start_sect = fat_entry_sect(vol, cluster);
+	u32 start_offset = fat_entry_index(vol, cluster);
 	
-	if (!fat_read(vol, start_sect)) {
+	struct cache_s* entry = fat_table_read(vol, start_sect);
+	if (entry == NULL) {
 		return 0;
 	}
-	fat_store32(vol->buffer + 4 * start_offset, fat_entry);
+	fat_store32(entry->buffer + 4 * start_offset, fat_entry);
 	
 	// Mark the buffer as dirty
-	vol->buffer_dirty = 1;
+	entry->dirty = 1;
 	
-	// Remove?
-	fat_flush(vol);
+	// Keep the free cluster bitmap in sync with the FAT table
+	fat_bitmap_mark(vol, cluster, (fat_entry & 0xFFFFFFF) != 0);
+#if FAT_FAST_MOUNT
+	vol->snap_bitmap = 0;
+#endif
+	
+#if FAT_SYNC_WRITES
+	if (!fat_sync(vol)) {
+		return 0;
+	}
+#endif
 	return 1;
 }
 
-/// Get the next free cluster from the FAT table and update the FSinfo to
-/// point to the next free cluster
-static u8 fat_get_cluster(struct volume_s* vol, u32* cluster) {
-	// Load the FSinfo sector
-	if (!fat_read(vol, vol->fsinfo_lba)) {
-		return 0;
-	}
-	u32 next_free = fat_load32(vol->buffer + INFO_NEXT_FREE);
-	u32 tot_free = fat_load32(vol->buffer + INFO_CLUST_CNT);
-	
-	// The `next_free` pointer does necessary point to a free cluster. However
-	// it specifies where to start looking for a free block. The `sector` and 
-	// `rw` combined point to this position
-	u32 sector = vol->fat_lba + (next_free / 128);
-	u32 rw = (next_free % 128) * 4;
+/// Counts the number of physically contiguous clusters in the chain starting
+/// at `cluster`. The first cluster is included, and the scan stops at a 
+/// chain discontinuity, the EOC or when `max` clusters are counted
+static u8 fat_table_extent(struct volume_s* vol, u32 cluster, u32 max, 
+	u32* length) {
 	
-	u32 entry = 0;
-	u8 match_found = 0;
-	while (1) {
-		// Load the current sector
-		if (!fat_read(vol, sector)) {
+	*length = 1;
+	while (*length < max) {
+		u32 next_cluster;
+		if (!fat_table_get(vol, cluster, &next_cluster)) {
 			return 0;
 		}
-		
-		// Check if the entry is available
-		entry = fat_load32(vol->buffer + rw);
-		if ((entry & 0b1111111) == 0) {
-			if (match_found) {
-				break;
-			} else {
-				match_found = 1;
-				*cluster = (128 * (sector - vol->fat_lba)) + (rw / 4);
-				fat_store32(vol->buffer + rw, 0xFFFFFFF);
-				vol->buffer_dirty = 1;
-			}
-		}
-		// Make `rw` and `sector` point to the next 4-byte table entry
-		rw += 4;
-		if (rw >= vol->sector_size) {
-			sector++;
-			rw = 0;
+		// The EOC value will never match the next cluster number
+		if ((next_cluster & 0xFFFFFFF) != cluster + 1) {
+			break;
 		}
+		cluster++;
+		(*length)++;
 	}
-	// `cluster` points to the first free cluster which can now be used, while
-	// `sector` holdes the next free cluster value which should be written back
-	// to the FSinfo sector
-	if (!fat_read(vol, vol->fsinfo_lba)) {
-		return 0;
-	}	
-	fat_store32(vol->buffer + INFO_NEXT_FREE, (128 * (sector - 
-		vol->fat_lba)) + (rw / 4));
-	fat_store32(vol->buffer + INFO_CLUST_CNT, tot_free - 1);
-	vol->buffer_dirty = 1;
+	return 1;
+}
+
+/// Sets or clears the bit for `cluster` in the free cluster bitmap
+static inline void fat_bitmap_mark(struct volume_s* vol, u32 cluster, u8 used) {
+	if ((vol->bitmap == NULL) || (cluster >= vol->cluster_cnt + 2)) {
+		return;
+	}
+	u32 mask = 1U << (cluster % 32);
+	u32* word = &vol->bitmap[cluster / 32];
 	
-	// Remove?
-	fat_flush(vol);
+	if (used && !(*word & mask)) {
+		*word |= mask;
+		vol->bitmap_free--;
+	} else if (!used && (*word & mask)) {
+		*word &= ~mask;
+		vol->bitmap_free++;
+	}
 }
 
-/// Caches the `lba` sector in the volume buffer. If this buffer is already
-/// present, the function returns `1`. Any dirty buffer will be written back
-/// before the next sector is fetched. Return `0` in case of hardware fault
-static u8 fat_read(struct volume_s* vol, u32 lba) {
+/// Finds the first free cluster in the bitmap at or after `start`. The search
+/// wraps around to the start of the volume. Returns `0` if the volume is full
+static u8 fat_bitmap_find(struct volume_s* vol, u32 start, u32* cluster) {
+	u32 words = (vol->cluster_cnt + 2 + 31) / 32;
+	u32 index = start / 32;
 	
-	// Check if the sector is already cached
-	if (vol->buffer_lba != lba) {
-		// Flush any dirty buffer back to the storage device
-		if (!fat_flush(vol)) {
-			return 0;
+	// All bits below `start` in the first word are treated as used
+	u32 word = vol->bitmap[index] | ((1U << (start % 32)) - 1);
+	for (u32 i = 0; i <= words; i++) {
+		if (word != 0xFFFFFFFF) {
+			// Find the first zero bit
+			word = ~word;
+#if defined(__GNUC__)
+			u32 bit = __builtin_ctz(word);
+#else
+			u32 bit = 0;
+			while (!(word & (1U << bit))) {
+				bit++;
+			}
+#endif
+			*cluster = index * 32 + bit;
+			return 1;
 		}
-		// Cache the next sector
-		if (!disk_read(vol->disk, vol->buffer, lba, 1)) {
-			return 0;
+		if (++index >= words) {
+			index = 0;
 		}
-		vol->buffer_lba = lba;
+		word = vol->bitmap[index];
 	}
-	return 1;
+	return 0;
 }
 
-/// Clean a volume buffer
-static u8 fat_flush(struct volume_s* vol) {
-	if (vol->buffer_dirty) {
-		if (!disk_write(vol->disk, vol->buffer, vol->buffer_lba, 1)) {
+/// Returns `1` if the `count` clusters from `first` are all free in the bitmap
+static u8 fat_bitmap_free_range(struct volume_s* vol, u32 first, u32 count) {
+	while (count) {
+		u32 bit = first % 32;
+		u32 chunk = 32 - bit;
+		if (chunk > count) {
+			chunk = count;
+		}
+		u32 mask = (chunk == 32) ? 0xFFFFFFFF : (((1U << chunk) - 1) << bit);
+		if (vol->bitmap[first / 32] & mask) {
 			return 0;
 		}
-		vol->buffer_dirty = 0;
+		first += chunk;
+		count -= chunk;
 	}
 	return 1;
 }
 
-/// Convert a relative cluster number to the absolute LBA address
-static inline u32 fat_sect_to_clust(struct volume_s* vol, u32 sect) {
-	return ((sect - vol->data_lba) / vol->cluster_size) + 2;
-}
-
-/// Convert an absolute LBA address to the relative cluster number
-static inline u32 fat_clust_to_sect(struct volume_s* vol, u32 clust) {
-	return ((clust - 2) * vol->cluster_size) + vol->data_lba;
-}
-
-/// Compares `size` characters from two strings without case sensitivity
-static u8 fat_dir_sfn_cmp(const char* sfn, const char* name, u8 size) {
-	if (size > 8) {
-		size = 8;
+/// Finds the first cluster of a completely free allocation unit at or after
+/// `start`. Only units fully inside the data region are considered, and the
+/// search wraps around to the start of the volume. Returns `0` if there is no
+/// free unit, or if the units are not aligned to whole clusters
+static u8 fat_bitmap_find_au(struct volume_s* vol, u32 start, u32* cluster) {
+	u32 au_size = vol->au_size;
+	u32 clust_size = vol->cluster_size;
+	if ((au_size < clust_size) || (au_size % clust_size)) {
+		return 0;
 	}
-	do {
-		char tmp_char = *name;
-		
-		// A lowercase characters is converted to an uppercase
-		if (tmp_char >= 'a' && tmp_char <= 'z') {
-			tmp_char -= 32;
+	u32 au_clust = au_size / clust_size;
+	u32 end = vol->cluster_cnt + 2;
+	
+	// First cluster of the first unit starting inside the data region
+	u32 first = (au_size - (vol->data_lba % au_size)) % au_size;
+	if (first % clust_size) {
+		return 0;
+	}
+	first = first / clust_size + 2;
+	if (first + au_clust > end) {
+		return 0;
+	}
+	u32 units = (end - first) / au_clust;
+	
+	// Start with the unit that contains `start`
+	u32 index = (start > first) ? (start - first) / au_clust : 0;
+	if (index >= units) {
+		index = 0;
+	}
+	for (u32 i = 0; i < units; i++) {
+		u32 curr = first + index * au_clust;
+		if (fat_bitmap_free_range(vol, curr, au_clust)) {
+			*cluster = curr;
+			return 1;
 		}
-		if (tmp_char != *sfn) {
-			return 0;
+		if (++index >= units) {
+			index = 0;
 		}
-		sfn++;
-		name++;
-	} while (--size);
-	return 1;
+	}
+	return 0;
 }
 
-/// Compartes a LFN entry against a given file name. `name` is the full string 
-/// to be comared and `lfn` is only one LFN entry. The code will just compare
-/// the affected fragment of the `name` string.
-static u8 fat_dir_lfn_cmp(const u8* lfn, const char* name, u32 size) {
+/// Finds a run of free clusters. The first run of at least `want` clusters
+/// is returned. If no run is large enough, the largest run on the volume is
+/// returned. Returns `0` if the volume is full
+static u8 fat_find_run(struct volume_s* vol, u32 want, u32* start, 
+	u32* length) {
 	
-	// Compute the `name` offset of a fragment which should match the LFN name
-	u8 name_off = 13 * ((lfn[LFN_SEQ] & LFN_SEQ_MSK) - 1);
+	u8 use_bitmap = vol->bitmap && (vol->bitmap_fill >= vol->fat_size);
+	u32 end = vol->cluster_cnt + 2;
+	u32 run_start = 0;
+	u32 run_length = 0;
+	*length = 0;
 	
-	for (u8 i = 0; i < 13; i++) {
-		// The first empty UCS-2 character will contain 0x0000 and the rest will
-		// contain 0xFFFF. 
-		if (lfn[lfn_lut[i]] == 0x00 || lfn[lfn_lut[i]] == 0xff) {
-			break;
+	u32 cluster = 2;
+	while (cluster <= end) {
+		u8 free = 0;
+		if (cluster < end) {
+			if (use_bitmap) {
+				u32 word = vol->bitmap[cluster / 32];
+				
+				// Skip whole words of used clusters
+				if ((word == 0xFFFFFFFF) && (run_length == 0)) {
+					cluster = (cluster / 32 + 1) * 32;
+					continue;
+				}
+				free = !(word & (1U << (cluster % 32)));
+			} else {
+				u32 entry;
+				if (!fat_table_get(vol, cluster, &entry)) {
+					return 0;
+				}
+				free = (entry & 0xFFFFFFF) == 0;
+			}
 		}
-		// Compare the first charater in the UCS-2. This will typically be a
-		// ordinary ASCII character
-		if (lfn[lfn_lut[i]] != name[name_off + i]) {
-			return 0;
+		
+		if (free) {
+			if (run_length++ == 0) {
+				run_start = cluster;
+			}
+			if (run_length >= want) {
+				*start = run_start;
+				*length = run_length;
+				return 1;
+			}
+		} else if (run_length) {
+			// End of a free run
+			if (run_length > *length) {
+				*start = run_start;
+				*length = run_length;
+			}
+			run_length = 0;
 		}
+		cluster++;
 	}
-	return 1;
+	return *length != 0;
 }
 
-/// Takes in a pointer to a directory (does not need to be the leading entry)
-/// and tries to find a directory entry matching `name`
-static u8 fat_dir_search(struct dir_s* dir, const char* name, u32 size) {
-	
-	// A search start from the leading entry
-	if (dir->start_sect != dir->sector) {
-		dir->sector = dir->start_sect;
-		dir->cluster = fat_sect_to_clust(dir->vol, dir->sector);
-		dir->rw_offset = 0;
+/// Get the next free cluster from the FAT table and update the FSinfo to
+/// point to the next free cluster. The cluster is marked as EOC
+static u8 fat_get_cluster(struct volume_s* vol, u32* cluster) {
+	// Load the FSinfo values
+	if (!fat_fsinfo_load(vol)) {
+		return 0;
 	}
 	
-	u8 lfn_crc = 0;
-	u8 lfn_match = 1;
-	u8 match = 0;
+	// The `next_free` pointer does necessary point to a free cluster. However
+	// it specifies where to start looking for a free block
+	u32 start = vol->next_free;
+	if ((start < 2) || (start >= vol->cluster_cnt + 2)) {
+		start = 2;
+	}
 	
-	while (1) {
-		// Update the buffer if needed
-		if (!fat_read(dir->vol, dir->sector)) {
+	FAT_STAT(vol, alloc_cnt, 1);
+	if (vol->bitmap && (vol->bitmap_fill >= vol->fat_size)) {
+		if (!fat_bitmap_find(vol, start, cluster)) {
 			return 0;
 		}
-		u8* buffer = dir->vol->buffer;
-		u32 rw_offset = dir->rw_offset;
 		
-		u8 sfn_tmp = buffer[rw_offset];
-		// Check for the EOD marker
-		if (sfn_tmp == 0x00) {
-			break;
+		// The bitmap search length is counted in clusters passed
+		FAT_STAT(vol, alloc_scan, (*cluster >= start) ? *cluster - start : 
+			*cluster + vol->cluster_cnt - start);
+		
+		// On flash media a new allocation unit is only started when the
+		// current one is full. When the search leaves the unit of the last
+		// allocation, an empty unit is preferred over a partly used one so 
+		// old and new data are not mixed in one erase block
+		if (vol->au_size) {
+			u32 prev = fat_clust_to_sect(vol, start - 1) / vol->au_size;
+			u32 next = fat_clust_to_sect(vol, *cluster) / vol->au_size;
+			u32 au_start;
+			if ((prev != next) && fat_bitmap_find_au(vol, *cluster, 
+				&au_start)) {
+				*cluster = au_start;
+			}
 		}
-		// Only allow used folders to be compared
-		if (!((sfn_tmp == 0x00) || (sfn_tmp == 0x05) || (sfn_tmp == 0xE5))) {
-			
-			// Check if the entry pointed to by `dir` is a LFN or a SFN
-			if ((buffer[rw_offset + SFN_ATTR] & ATTR_LFN) == ATTR_LFN) {
-				
-				// If the LFN name does not match the input
-				if (!fat_dir_lfn_cmp(buffer + rw_offset, name, size)) {
-					// TODO:
-					// LFN contains the sequence number so we could jump to
-					// the next entry right away. This will speed up directory
-					// search around x3 times
-					lfn_match = 0;
-				}
-				lfn_crc = buffer[rw_offset + LFN_CRC];
-			} else {
-				
+	} else {
+		
+		// Scan the FAT table one entry at a time, wrapping around at the end
+		u32 curr = start;
+		u32 cnt = vol->cluster_cnt;
+		while (cnt) {
+			u32 entry;
+			if (!fat_table_get(vol, curr, &entry)) {
+				return 0;
+			}
+			if ((entry & 0xFFFFFFF) == 0) {
+				break;
+			}
+			if (++curr >= vol->cluster_cnt + 2) {
+				curr = 2;
+			}
+			cnt--;
+		}
+		FAT_STAT(vol, alloc_scan, vol->cluster_cnt - cnt);
+		if (cnt == 0) {
+			return 0;
+		}
+		*cluster = curr;
+	}
+	
+	// Mark the cluster as the end of a chain
+	if (!fat_table_set(vol, *cluster, 0xFFFFFFF)) {
+		return 0;
+	}
+	
+	// The FSinfo is written back when the volume is synced
+	vol->next_free = *cluster + 1;
+	if (vol->free_count != 0xFFFFFFFF) {
+		vol->free_count--;
+	}
+	vol->fsinfo_dirty = 1;
+	
+#if FAT_SYNC_WRITES
+	if (!fat_sync(vol)) {
+		return 0;
+	}
+#endif
+	return 1;
+}
+
+/// Loads the free cluster count and the next free hint from the FSinfo sector
+/// if not already present
+static u8 fat_fsinfo_load(struct volume_s* vol) {
+	if (vol->fsinfo_valid) {
+		return 1;
+	}
+	if (!fat_read(vol, vol->fsinfo_lba)) {
+		return 0;
+	}
+	vol->free_count = fat_load32(vol->buffer + INFO_CLUST_CNT);
+	vol->next_free = fat_load32(vol->buffer + INFO_NEXT_FREE);
+	vol->fsinfo_valid = 1;
+	vol->fsinfo_dirty = 0;
+	return 1;
+}
+
+/// Writes modified FSinfo values back to the FSinfo sector in the cache
+static u8 fat_fsinfo_store(struct volume_s* vol) {
+	if (!vol->fsinfo_dirty) {
+		return 1;
+	}
+	if (!fat_read(vol, vol->fsinfo_lba)) {
+		return 0;
+	}
+	fat_store32(vol->buffer + INFO_CLUST_CNT, vol->free_count);
+	fat_store32(vol->buffer + INFO_NEXT_FREE, vol->next_free);
+	fat_mark_dirty(vol);
+	vol->fsinfo_dirty = 0;
+	return 1;
+}
+
+/// Commits all pending changes on a volume to the storage device. This stores
+/// the FSinfo values and writes back all dirty cached sectors
+static u8 fat_sync(struct volume_s* vol) {
+	if (!fat_fsinfo_store(vol)) {
+		return 0;
+	}
+#if FAT_MIRROR != FAT_MIRROR_EAGER
+	if (!fat_flush(vol)) {
+		return 0;
+	}
+	return fat_mirror_sync(vol);
+#else
+	return fat_flush(vol);
+#endif
+}
+
+/// Updates a CRC-32 (IEEE 802.3) with `count` bytes. This is used for the GPT
+/// and to sign the mount snapshot, so a torn or unrelated sector is never 
+/// trusted
+static u32 fat_crc32(u32 crc, const u8* data, u32 count) {
+	crc = ~crc;
+	while (count--) {
+		crc ^= *data++;
+		for (u8 i = 0; i < 8; i++) {
+			crc = (crc >> 1) ^ (0xEDB88320 & (0 - (crc & 1)));
+		}
+	}
+	return ~crc;
+}
+
+/// Returns `1` if all `size` bytes are zero
+static u8 fat_is_blank(const u8* data, u32 size) {
+	for (u32 i = 0; i < size; i++) {
+		if (data[i]) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+#if FAT_FAST_MOUNT
+
+/// CRC of the first FAT_SNAPSHOT_FAT_CNT sectors of the FAT in use. Any host
+/// allocating or freeing clusters there changes it
+static u8 fat_snap_fat_crc(struct volume_s* vol, u32* crc) {
+	u32 count = (vol->fat_size < FAT_SNAPSHOT_FAT_CNT) ? vol->fat_size : 
+		FAT_SNAPSHOT_FAT_CNT;
+	*crc = 0;
+	for (u32 i = 0; i < count; i++) {
+		struct cache_s* entry = fat_table_read(vol, vol->fat_lba + i);
+		if (entry == NULL) {
+			return 0;
+		}
+		*crc = fat_crc32(*crc, entry->buffer, fat_sect_size(vol));
+	}
+	return 1;
+}
+
+/// Restores the mount snapshot stored by the last clean eject. The geometry in
+/// the snapshot must match the one derived from the boot sector. A host which
+/// changed the volume after the eject does not know about the snapshot, so 
+/// the FSinfo sector and the start of the FAT must also be unchanged. The 
+/// clean flag is cleared on the disk right away, so the snapshot is not used
+/// again if the volume is changed and not ejected. Returns `0` if no valid 
+/// snapshot was found
+static u8 fat_snap_load(struct volume_s* vol, u32 vol_id) {
+	if (FAT_SNAPSHOT_SECT >= fat_rsvd_cnt(vol)) {
+		return 0;
+	}
+	u32 lba = vol->part_lba + FAT_SNAPSHOT_SECT;
+	if (!fat_read(vol, lba)) {
+		return 0;
+	}
+	u8* snap = vol->buffer;
+	if ((fat_load32(snap + SNAP_MAGIC) != SNAP_MAGIC_VALUE) ||
+		(fat_load32(snap + SNAP_CRC) != fat_crc32(0, snap, SNAP_CRC)) ||
+		(fat_load32(snap + SNAP_CLEAN) != 1) ||
+		(fat_load32(snap + SNAP_VOL_ID) != vol_id) ||
+		(fat_load32(snap + SNAP_FAT_LBA) != vol->fat_lba) ||
+		(fat_load32(snap + SNAP_FAT_SIZE) != vol->fat_size) ||
+		(fat_load32(snap + SNAP_DATA_LBA) != vol->data_lba) ||
+		(fat_load32(snap + SNAP_ROOT_LBA) != vol->root_lba) ||
+		(fat_load32(snap + SNAP_CLUST_CNT) != vol->cluster_cnt)) {
+		return 0;
+	}
+	u32 free_count = fat_load32(snap + SNAP_FREE_CNT);
+	u32 next_free = fat_load32(snap + SNAP_NEXT_FREE);
+	u32 fat_crc = fat_load32(snap + SNAP_FAT_CRC);
+	
+	// Every FAT writer updates these, so they tell if another host has 
+	// changed the volume since the eject
+	u32 crc;
+	if (!fat_read(vol, vol->fsinfo_lba) ||
+		(fat_load32(vol->buffer + INFO_CLUST_CNT) != free_count) ||
+		(fat_load32(vol->buffer + INFO_NEXT_FREE) != next_free) ||
+		!fat_snap_fat_crc(vol, &crc) || (crc != fat_crc) ||
+		!fat_read(vol, lba)) {
+		return 0;
+	}
+	snap = vol->buffer;
+	
+	// The FSinfo counts and the bitmap are trusted as they were at the eject
+	vol->free_count = free_count;
+	vol->next_free = next_free;
+	vol->fsinfo_valid = 1;
+	vol->fsinfo_dirty = 0;
+	fat_memcpy(snap + SNAP_LABEL, vol->label, 12);
+	vol->label[12] = '\0';
+	vol->label_valid = 1;
+	vol->snap_bitmap = fat_load32(snap + SNAP_BITMAP_CNT);
+	
+	fat_store32(snap + SNAP_CLEAN, 0);
+	fat_store32(snap + SNAP_CRC, fat_crc32(0, snap, SNAP_CRC));
+	fat_mark_dirty(vol);
+	return fat_flush_range(vol, lba, 1);
+}
+
+/// Stores the mount snapshot after all changes on the volume are written 
+/// back. The bitmap is included if it is complete and fits in the reserved 
+/// region. The bitmap sectors are written before the header, so the header 
+/// only becomes valid when the snapshot is complete. Sectors which are not 
+/// blank or owned by an earlier snapshot are never overwritten
+static u8 fat_snap_store(struct volume_s* vol) {
+	u32 rsvd_cnt = fat_rsvd_cnt(vol);
+	if (FAT_SNAPSHOT_SECT >= rsvd_cnt) {
+		return 1;
+	}
+	if (!fat_fsinfo_load(vol)) {
+		return 0;
+	}
+	if (!vol->label_valid) {
+		if (fat_get_vol_label(vol, vol->label) != FSTATUS_OK) {
+			return 0;
+		}
+		vol->label_valid = 1;
+	}
+	if (!fat_read(vol, vol->part_lba)) {
+		return 0;
+	}
+	u32 vol_id = fat_load32(vol->buffer + BPB_32_VOL_ID);
+	
+	u32 lba = vol->part_lba + FAT_SNAPSHOT_SECT;
+	if (!fat_read(vol, lba)) {
+		return 0;
+	}
+	u8 owned = (fat_load32(vol->buffer + SNAP_MAGIC) == SNAP_MAGIC_VALUE);
+	if (!owned && !fat_is_blank(vol->buffer, vol->sector_size)) {
+		return 1;
+	}
+	
+	// Only the bitmap sectors of the earlier snapshot belong to it
+	u32 owned_cnt = owned ? fat_load32(vol->buffer + SNAP_BITMAP_CNT) : 0;
+	
+	u32 bitmap_cnt = 0;
+	if (vol->bitmap && (vol->bitmap_fill == vol->fat_size)) {
+		bitmap_cnt = (volume_bitmap_size(vol) + vol->sector_size - 1) / 
+			vol->sector_size;
+		if (FAT_SNAPSHOT_SECT + 1 + bitmap_cnt > rsvd_cnt) {
+			bitmap_cnt = 0;
+		}
+		
+		// Sectors past the earlier bitmap are only used if they are blank
+		for (u32 i = owned_cnt; i < bitmap_cnt; i++) {
+			if (!fat_read(vol, lba + 1 + i)) {
+				return 0;
+			}
+			if (!fat_is_blank(vol->buffer, vol->sector_size)) {
+				bitmap_cnt = 0;
+			}
+		}
+	}
+	
+	// The bitmap is stored in little endian words padded with used clusters
+	u32 words = volume_bitmap_size(vol) / 4;
+	u32 word = 0;
+	u32 bitmap_crc = 0;
+	for (u32 i = 0; i < bitmap_cnt; i++) {
+		if (!fat_read_new(vol, lba + 1 + i)) {
+			return 0;
+		}
+		for (u32 j = 0; j < vol->sector_size; j += 4, word++) {
+			fat_store32(vol->buffer + j, (word < words) ? 
+				vol->bitmap[word] : 0xFFFFFFFF);
+		}
+		bitmap_crc = fat_crc32(bitmap_crc, vol->buffer, vol->sector_size);
+		fat_mark_dirty(vol);
+		if (!fat_flush_range(vol, lba + 1 + i, 1)) {
+			return 0;
+		}
+	}
+	
+	u32 fat_crc;
+	if (!fat_snap_fat_crc(vol, &fat_crc) || !fat_read(vol, lba)) {
+		return 0;
+	}
+	u8* snap = vol->buffer;
+	for (u32 i = 0; i < vol->sector_size; i++) {
+		snap[i] = 0;
+	}
+	fat_store32(snap + SNAP_MAGIC, SNAP_MAGIC_VALUE);
+	fat_store32(snap + SNAP_CLEAN, 1);
+	fat_store32(snap + SNAP_VOL_ID, vol_id);
+	fat_store32(snap + SNAP_FAT_LBA, vol->fat_lba);
+	fat_store32(snap + SNAP_FAT_SIZE, vol->fat_size);
+	fat_store32(snap + SNAP_DATA_LBA, vol->data_lba);
+	fat_store32(snap + SNAP_ROOT_LBA, vol->root_lba);
+	fat_store32(snap + SNAP_CLUST_CNT, vol->cluster_cnt);
+	fat_store32(snap + SNAP_FREE_CNT, vol->free_count);
+	fat_store32(snap + SNAP_NEXT_FREE, vol->next_free);
+	fat_store32(snap + SNAP_BITMAP_CNT, bitmap_cnt);
+	fat_store32(snap + SNAP_BITMAP_FREE, bitmap_cnt ? vol->bitmap_free : 0);
+	fat_store32(snap + SNAP_BITMAP_CRC, bitmap_crc);
+	fat_memcpy(vol->label, snap + SNAP_LABEL, 12);
+	fat_store32(snap + SNAP_FAT_CRC, fat_crc);
+	fat_store32(snap + SNAP_CRC, fat_crc32(0, snap, SNAP_CRC));
+	fat_mark_dirty(vol);
+	return fat_flush_range(vol, lba, 1);
+}
+
+/// Loads the bitmap saved in the mount snapshot into the attached bitmap. 
+/// Returns `0` if it does not pass the CRC, and the bitmap must then be built
+/// from the FAT
+static u8 fat_snap_bitmap_load(struct volume_s* vol) {
+	u32 lba = vol->part_lba + FAT_SNAPSHOT_SECT;
+	if (!fat_read(vol, lba)) {
+		return 0;
+	}
+	u8* snap = vol->buffer;
+	if ((fat_load32(snap + SNAP_MAGIC) != SNAP_MAGIC_VALUE) ||
+		(fat_load32(snap + SNAP_CRC) != fat_crc32(0, snap, SNAP_CRC)) ||
+		(fat_load32(snap + SNAP_BITMAP_CNT) != vol->snap_bitmap)) {
+		return 0;
+	}
+	u32 bitmap_crc = fat_load32(snap + SNAP_BITMAP_CRC);
+	u32 bitmap_free = fat_load32(snap + SNAP_BITMAP_FREE);
+	
+	u32 words = volume_bitmap_size(vol) / 4;
+	u32 word = 0;
+	u32 crc = 0;
+	for (u32 i = 0; i < vol->snap_bitmap; i++) {
+		if (!fat_read(vol, lba + 1 + i)) {
+			return 0;
+		}
+		crc = fat_crc32(crc, vol->buffer, vol->sector_size);
+		for (u32 j = 0; (j < vol->sector_size) && (word < words); j += 4) {
+			vol->bitmap[word++] = fat_load32(vol->buffer + j);
+		}
+	}
+	if (crc != bitmap_crc) {
+		for (u32 i = 0; i < words; i++) {
+			vol->bitmap[i] = 0xFFFFFFFF;
+		}
+		return 0;
+	}
+	vol->bitmap_free = bitmap_free;
+	vol->bitmap_fill = vol->fat_size;
+	return 1;
+}
+#endif
+
+/// Caches the `lba` sector in the volume cache and makes `vol->buffer` point
+/// to it. If the sector is already present, the function returns `1`. Return 
+/// `0` in case of hardware fault
+static u8 fat_read(struct volume_s* vol, u32 lba) {
+	
+	// Check if the sector is the current one
+	if (vol->buffer_lba == lba) {
+		vol->cache.hits++;
+		vol->cache_curr->stamp = ++vol->cache_tick;
+		return 1;
+	}
+	
+	// The current sector might be the one replaced by the fetch
+	vol->buffer_lba = 0;
+	struct cache_s* entry = fat_cache_fetch(vol, &vol->cache, lba, 1);
+	if (entry == NULL) {
+		return 0;
+	}
+	vol->cache_curr = entry;
+	vol->buffer = entry->buffer;
+	vol->buffer_lba = lba;
+	return 1;
+}
+
+/// Same as `fat_read`, but a sector not present in the cache is zeroed instead
+/// of read from the storage device. This is used for sectors with no valid 
+/// data which are about to be written
+static u8 fat_read_new(struct volume_s* vol, u32 lba) {
+	if (vol->buffer_lba == lba) {
+		return fat_read(vol, lba);
+	}
+	vol->buffer_lba = 0;
+	struct cache_s* entry = fat_cache_fetch(vol, &vol->cache, lba, 0);
+	if (entry == NULL) {
+		return 0;
+	}
+	vol->cache_curr = entry;
+	vol->buffer = entry->buffer;
+	vol->buffer_lba = lba;
+	return 1;
+}
+
+/// Returns the cache entry holding the FAT table sector `lba`. FAT sectors
+/// must only be accessed through this function. Returns NULL in case of 
+/// hardware fault
+static struct cache_s* fat_table_read(struct volume_s* vol, u32 lba) {
+	return fat_cache_fetch(vol, &vol->fat_cache, lba, 1);
+}
+
+/// Returns the entry in `cache` holding sector `lba`. If the sector is not
+/// present, the least recently used entry is written back if dirty and 
+/// replaced. The new sector is read from the storage device if `load` is set,
+/// and zeroed if not. Returns NULL in case of hardware fault
+static struct cache_s* fat_cache_fetch(struct volume_s* vol, 
+	struct sect_cache_s* cache, u32 lba, u8 load) {
+	
+	// Search the cache and find the least recently used entry on the way
+	struct cache_s* victim = &cache->entries[0];
+	for (u32 i = 0; i < cache->size; i++) {
+		struct cache_s* entry = &cache->entries[i];
+		
+		if (entry->lba == lba) {
+			cache->hits++;
+			entry->stamp = ++vol->cache_tick;
+			return entry;
+		}
+		if (entry->stamp < victim->stamp) {
+			victim = entry;
+		}
+	}
+	cache->misses++;
+	
+	// Flush the dirty victim back to the storage device
+	if (victim->dirty) {
+		if (!fat_cache_write(vol, cache, victim->buffer, victim->lba, 1)) {
+			return NULL;
+		}
+		victim->dirty = 0;
+	}
+	
+	// Cache the next sector. The entry is invalid until the read has completed
+	victim->lba = 0;
+	if (load) {
+		if (!fat_disk_read(vol, victim->buffer, lba, 1)) {
+			return NULL;
+		}
+	} else {
+		for (u32 i = 0; i < vol->sector_size; i++) {
+			victim->buffer[i] = 0;
+		}
+	}
+	victim->lba = lba;
+	victim->stamp = ++vol->cache_tick;
+	return victim;
+}
+
+/// Marks the sector pointed to by `vol->buffer` as modified
+static inline void fat_mark_dirty(struct volume_s* vol) {
+	vol->cache_curr->dirty = 1;
+}
+
+/// Write all dirty sectors in the volume caches back to the storage device
+static u8 fat_flush(struct volume_s* vol) {
+	if (!fat_cache_flush(vol, &vol->fat_cache, 0, 0xFFFFFFFF)) {
+		return 0;
+	}
+	return fat_cache_flush(vol, &vol->cache, 0, 0xFFFFFFFF);
+}
+
+/// Write back the dirty sectors in the data cache in the range `lba` to 
+/// `lba + count`
+static u8 fat_flush_range(struct volume_s* vol, u32 lba, u32 count) {
+	return fat_cache_flush(vol, &vol->cache, lba, count);
+}
+
+/// Write back the dirty sectors in `cache` in the range `lba` to `lba + count`.
+/// The sectors are written in address order. If a write buffer is attached, 
+/// consecutive dirty sectors are copied into it and written with one command,
+/// which never crosses an allocation unit boundary
+static u8 fat_cache_flush(struct volume_s* vol, struct sect_cache_s* cache,
+	u32 lba, u32 count) {
+	u32 sector_size = fat_sect_size(vol);
+	
+	while (1) {
+		// Find the dirty sector with the lowest address
+		struct cache_s* first = NULL;
+		for (u32 i = 0; i < cache->size; i++) {
+			struct cache_s* entry = &cache->entries[i];
+			if (entry->dirty && (entry->lba - lba < count) && 
+				(!first || (entry->lba < first->lba))) {
+				first = entry;
+			}
+		}
+		if (first == NULL) {
+			return 1;
+		}
+		
+		// Gather the following dirty sectors into the write buffer
+		const u8* src = first->buffer;
+		u32 run = 1;
+		while (run < vol->wbuf_cnt) {
+			u32 next_lba = first->lba + run;
+			if (vol->au_size && (next_lba % vol->au_size == 0)) {
+				break;
+			}
+			struct cache_s* next = NULL;
+			for (u32 i = 0; i < cache->size; i++) {
+				struct cache_s* entry = &cache->entries[i];
+				if (entry->dirty && (entry->lba == next_lba) && 
+					(entry->lba - lba < count)) {
+					next = entry;
+					break;
+				}
+			}
+			if (next == NULL) {
+				break;
+			}
+			if (run == 1) {
+				fat_memcpy(first->buffer, vol->wbuf, sector_size);
+				src = vol->wbuf;
+			}
+			fat_memcpy(next->buffer, vol->wbuf + run * sector_size, 
+				sector_size);
+			run++;
+		}
+		
+		if (!fat_cache_write(vol, cache, src, first->lba, run)) {
+			return 0;
+		}
+		
+		// All dirty sectors in the run have now been written
+		u32 run_lba = first->lba;
+		for (u32 i = 0; i < cache->size; i++) {
+			struct cache_s* entry = &cache->entries[i];
+			if (entry->dirty && (entry->lba - run_lba < run)) {
+				entry->dirty = 0;
+			}
+		}
+	}
+}
+
+/// Writes `count` sectors from `buffer` back from `cache` to the storage 
+/// device. Sectors from the FAT cache go to the FAT in use, and are written 
+/// to or remembered for the mirror FATs depending on FAT_MIRROR
+static u8 fat_cache_write(struct volume_s* vol, struct sect_cache_s* cache,
+	const u8* buffer, u32 lba, u32 count) {
+	if (!fat_disk_write(vol, buffer, lba, count)) {
+		return 0;
+	}
+	if ((cache != &vol->fat_cache) || (vol->fat_cnt < 2)) {
+		return 1;
+	}
+#if FAT_MIRROR == FAT_MIRROR_EAGER
+	for (u32 i = 1; i < vol->fat_cnt; i++) {
+		if (!fat_disk_write(vol, buffer, lba + i * vol->fat_size, count)) {
+			return 0;
+		}
+	}
+#else
+	fat_mirror_add(vol, lba - vol->fat_lba, count);
+#endif
+	return 1;
+}
+
+#if FAT_MIRROR != FAT_MIRROR_EAGER
+
+/// Remembers that `count` FAT sectors from `sect` must be copied to the mirror
+/// FATs. The sectors are merged into an overlapping or adjacent range. If all
+/// ranges are in use, the range which grows the least is extended
+static void fat_mirror_add(struct volume_s* vol, u32 sect, u32 count) {
+	struct mirror_s* best = NULL;
+	u32 best_grow = 0xFFFFFFFF;
+	
+	for (u32 i = 0; i < FAT_MIRROR_RANGES; i++) {
+		struct mirror_s* range = &vol->mirror[i];
+		if (range->count == 0) {
+			if (best_grow) {
+				best = range;
+				best_grow = 0;
+			}
+			continue;
+		}
+		u32 start = (sect < range->start) ? sect : range->start;
+		u32 end = range->start + range->count;
+		if (sect + count > end) {
+			end = sect + count;
+		}
+		
+		// Merge with an overlapping or adjacent range right away
+		if ((sect <= range->start + range->count) && 
+			(sect + count >= range->start)) {
+			range->start = start;
+			range->count = end - start;
+			return;
+		}
+		u32 grow = end - start - range->count;
+		if (grow < best_grow) {
+			best = range;
+			best_grow = grow;
+		}
+	}
+	
+	if (best->count == 0) {
+		best->start = sect;
+		best->count = count;
+	} else {
+		u32 end = best->start + best->count;
+		if (sect + count > end) {
+			end = sect + count;
+		}
+		if (sect < best->start) {
+			best->start = sect;
+		}
+		best->count = end - best->start;
+	}
+}
+
+/// Copies the remembered FAT ranges from the FAT in use to the mirror FATs. 
+/// The copy goes through the write buffer if one is attached, otherwise 
+/// through a FAT cache entry one sector at a time. All FAT cache entries must
+/// be clean when this is called
+static u8 fat_mirror_sync(struct volume_s* vol) {
+	u8* buffer = vol->wbuf;
+	u32 buffer_cnt = vol->wbuf_cnt;
+	if (buffer_cnt > FAT_MAX_TRANSFER) {
+		buffer_cnt = FAT_MAX_TRANSFER;
+	}
+	
+	for (u32 i = 0; i < FAT_MIRROR_RANGES; i++) {
+		struct mirror_s* range = &vol->mirror[i];
+		
+		while (range->count) {
+			if (buffer == NULL) {
+				struct cache_s* entry = &vol->fat_cache.entries[0];
+				entry->lba = 0;
+				buffer = entry->buffer;
+				buffer_cnt = 1;
+			}
+			u32 chunk = (range->count < buffer_cnt) ? range->count : 
+				buffer_cnt;
+			u32 lba = vol->fat_lba + range->start;
+			if (!fat_disk_read(vol, buffer, lba, chunk)) {
+				return 0;
+			}
+			for (u32 j = 1; j < vol->fat_cnt; j++) {
+				if (!fat_disk_write(vol, buffer, lba + j * vol->fat_size,
+					chunk)) {
+					return 0;
+				}
+			}
+			range->start += chunk;
+			range->count -= chunk;
+		}
+	}
+	return 1;
+}
+
+#endif
+
+#if FAT_MIRROR == FAT_MIRROR_SINGLE
+
+/// Turns off FAT mirroring in the boot sector `bpb` and its backup with the
+/// first FAT active. The FATs are equal when a volume is mounted, so the 
+/// mirrors can be left as they are. If the boot sector can not be written 
+/// the volume keeps using deferred mirroring
+static u8 fat_mirror_disable(struct volume_s* vol, u8* bpb) {
+	if (vol->fat_cnt < 2) {
+		return 1;
+	}
+	u16 flags = fat_load16(bpb + BPB_32_EXT_FLAGS);
+	flags &= ~(EXT_FLAGS_ACTIVE | EXT_FLAGS_NO_MIRROR);
+	fat_store16(bpb + BPB_32_EXT_FLAGS, flags | EXT_FLAGS_NO_MIRROR);
+	if (!fat_disk_write(vol, bpb, vol->part_lba, 1)) {
+		return 0;
+	}
+	vol->fat_cnt = 1;
+	
+	u16 backup = fat_load16(bpb + BPB_32_BOOT_SECT);
+	if (backup && (backup < fat_rsvd_cnt(vol))) {
+		return fat_disk_write(vol, bpb, vol->part_lba + backup, 1);
+	}
+	return 1;
+}
+
+#endif
+
+/// Removes the sectors in the range `lba` to `lba + count` from the data cache
+/// without writing them back. This is used when the sectors are overwritten
+/// directly on the storage device
+static void fat_cache_drop(struct volume_s* vol, u32 lba, u32 count) {
+	for (u32 i = 0; i < FAT_CACHE_SIZE; i++) {
+		struct cache_s* entry = &vol->cache_mem[i];
+		
+		if (entry->lba && (entry->lba - lba < count)) {
+			if (entry == vol->cache_curr) {
+				vol->buffer_lba = 0;
+			}
+			entry->lba = 0;
+			entry->dirty = 0;
+			entry->stamp = 0;
+		}
+	}
+}
+
+/// Invalidates all entries in the volume caches
+static void fat_cache_init(struct volume_s* vol) {
+	vol->cache.entries = vol->cache_mem;
+	vol->cache.size = FAT_CACHE_SIZE;
+	vol->fat_cache.entries = vol->fat_cache_mem;
+	vol->fat_cache.size = FAT_TABLE_CACHE_SIZE;
+	
+	for (u32 i = 0; i < FAT_CACHE_SIZE; i++) {
+		vol->cache_mem[i].lba = 0;
+		vol->cache_mem[i].stamp = 0;
+		vol->cache_mem[i].dirty = 0;
+	}
+	for (u32 i = 0; i < FAT_TABLE_CACHE_SIZE; i++) {
+		vol->fat_cache_mem[i].lba = 0;
+		vol->fat_cache_mem[i].stamp = 0;
+		vol->fat_cache_mem[i].dirty = 0;
+	}
+	vol->cache.hits = 0;
+	vol->cache.misses = 0;
+	vol->fat_cache.hits = 0;
+	vol->fat_cache.misses = 0;
+	
+	vol->cache_curr = &vol->cache_mem[0];
+	vol->cache_tick = 0;
+	vol->buffer = vol->cache_mem[0].buffer;
+	vol->buffer_lba = 0;
+}
+
+/// Returns the number of sectors in the reserved region before the first FAT
+static inline u32 fat_rsvd_cnt(const struct volume_s* vol) {
+	return vol->data_lba - vol->part_lba - vol->fat_num * vol->fat_size;
+}
+
+/// Returns the sector size of the volume in bytes. This is a constant when 
+/// the sector size is fixed at compile time
+static inline u32 fat_sect_size(const struct volume_s* vol) {
+#if FAT_SECTOR_FIXED
+	return FAT_SECTOR_SIZE;
+#else
+	return vol->sector_size;
+#endif
+}
+
+/// Returns the base two logarithm of the sector size of the volume
+static inline u32 fat_sect_shift(const struct volume_s* vol) {
+#if FAT_SECTOR_FIXED
+	return FAT_SECTOR_SHIFT;
+#else
+	return vol->sector_shift;
+#endif
+}
+
+/// Returns the LBA of the FAT sector holding the entry for `cluster`. Each 
+/// sector holds one 32-bit entry per four bytes
+static inline u32 fat_entry_sect(const struct volume_s* vol, u32 cluster) {
+	return vol->fat_lba + (cluster >> (fat_sect_shift(vol) - 2));
+}
+
+/// Returns the index of the entry for `cluster` within its FAT sector
+static inline u32 fat_entry_index(const struct volume_s* vol, u32 cluster) {
+	return cluster & ((fat_sect_size(vol) >> 2) - 1);
+}
+
+/// Convert a relative cluster number to the absolute LBA address
+static inline u32 fat_sect_to_clust(struct volume_s* vol, u32 sect) {
+	return ((sect - vol->data_lba) / vol->cluster_size) + 2;
+}
+
+/// Convert an absolute LBA address to the relative cluster number
+static inline u32 fat_clust_to_sect(struct volume_s* vol, u32 clust) {
+	return ((clust - 2) * vol->cluster_size) + vol->data_lba;
+}
+
+/// Compares a 8.3 SFN entry against a given file name without case 
+/// sensitivity. The name should be on the form `NAME.EXT` or `NAME`
+static u8 fat_dir_sfn_cmp(const char* sfn, const char* name, u8 size) {
+	char sfn_name[12];
+	if (fat_dir_sfn_name((const u8 *)sfn, sfn_name) != size) {
+		return 0;
+	}
+	for (u8 i = 0; i < size; i++) {
+		char tmp_char = name[i];
+		
+		// A lowercase characters is converted to an uppercase
+		if (tmp_char >= 'a' && tmp_char <= 'z') {
+			tmp_char -= 32;
+		}
+		if (tmp_char != sfn_name[i]) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/// Converts the padded 8.3 SFN to the `NAME.EXT` form and returns the length
+static u8 fat_dir_sfn_name(const u8* sfn, char* name) {
+	u8 length = 0;
+	for (u8 i = 0; (i < 8) && (sfn[i] != ' '); i++) {
+		name[length++] = sfn[i];
+	}
+	if (sfn[8] != ' ') {
+		name[length++] = '.';
+		for (u8 i = 8; (i < 11) && (sfn[i] != ' '); i++) {
+			name[length++] = sfn[i];
+		}
+	}
+	return length;
+}
+
+/// Compartes a LFN entry against a given file name. `name` is the full string 
+/// to be comared and `lfn` is only one LFN entry. The code will just compare
+/// the affected fragment of the `name` string.
+static u8 fat_dir_lfn_cmp(const u8* lfn, const char* name, u32 size) {
+	
+	// Compute the `name` offset of a fragment which should match the LFN name
+	u8 name_off = 13 * ((lfn[LFN_SEQ] & LFN_SEQ_MSK) - 1);
+	
+	for (u8 i = 0; i < 13; i++) {
+		// The first empty UCS-2 character will contain 0x0000 and the rest will
+		// contain 0xFFFF. 
+		if (lfn[lfn_lut[i]] == 0x00 || lfn[lfn_lut[i]] == 0xff) {
+			break;
+		}
+		// Compare the first charater in the UCS-2. This will typically be a
+		// ordinary ASCII character. Like the SFN compare, it is done without
+		// case sensitivity
+		char lfn_char = (char)lfn[lfn_lut[i]];
+		char tmp_char = name[name_off + i];
+		if (lfn_char >= 'a' && lfn_char <= 'z') {
+			lfn_char -= 32;
+		}
+		if (tmp_char >= 'a' && tmp_char <= 'z') {
+			tmp_char -= 32;
+		}
+		if (lfn_char != tmp_char) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/// Returns the length of the long file name from the first physical entry in a
+/// chain of LFN entries. This entry holds the last name fragment
+static u32 fat_dir_lfn_length(const u8* lfn) {
+	u32 length = 13 * ((lfn[LFN_SEQ] & LFN_SEQ_MSK) - 1);
+	
+	for (u8 i = 0; i < 13; i++) {
+		if (lfn[lfn_lut[i]] == 0x00 || lfn[lfn_lut[i]] == 0xff) {
+			break;
+		}
+		length++;
+	}
+	return length;
+}
+
+/// Takes in a pointer to a directory (does not need to be the leading entry)
+/// and tries to find a directory entry matching `name`. If the volume has a
+/// name index pool, the search is a lookup in the index of the directory
+static u8 fat_dir_search(struct dir_s* dir, const char* name, u32 size) {
+	struct dir_index_s* index = fat_dir_index_get(dir->vol, dir->start_sect);
+	
+	if (index) {
+		// Every slot with a matching hash is a candidate, which is verified
+		// by comparing the directory entries
+		u16 hash = fat_dir_hash(name, size);
+		u32 slot = hash % index->size;
+		
+		while (index->slots[slot].sector) {
+			if (index->slots[slot].hash == hash) {
+				dir->sector = index->slots[slot].sector;
+				dir->cluster = fat_sect_to_clust(dir->vol, dir->sector);
+				dir->rw_offset = index->slots[slot].offset;
+				
+				if (fat_dir_scan(dir, name, size, 1)) {
+					return 1;
+				}
+			}
+			if (++slot >= index->size) {
+				slot = 0;
+			}
+		}
+		if (index->complete) {
+			return 0;
+		}
+	}
+	
+	// A search start from the leading entry
+	dir->sector = dir->start_sect;
+	dir->cluster = fat_sect_to_clust(dir->vol, dir->sector);
+	dir->rw_offset = 0;
+	return fat_dir_scan(dir, name, size, 0);
+}
+
+/// Compares the directory entries from the position of `dir` against `name`.
+/// If `single` is set only the first object is compared. On a match the `dir`
+/// object is updated to point to the found object
+static u8 fat_dir_scan(struct dir_s* dir, const char* name, u32 size, 
+	u8 single) {
+	
+	// `lfn_skip` is set when the current chain of LFN entries is known not to
+	// match. The rest of the chain is then passed without any compare
+	u8 lfn_crc = 0;
+	u8 lfn_skip = 0;
+	u8 match = 0;
+	
+	while (1) {
+		// Update the buffer if needed
+		if (!fat_read(dir->vol, dir->sector)) {
+			return 0;
+		}
+		u8* buffer = dir->vol->buffer;
+		u32 rw_offset = dir->rw_offset;
+		FAT_STAT(dir->vol, dir_entries, 1);
+		
+		u8 sfn_tmp = buffer[rw_offset];
+		// Check for the EOD marker
+		if (sfn_tmp == 0x00) {
+			break;
+		}
+		// Only allow used folders to be compared
+		if (!((sfn_tmp == 0x00) || (sfn_tmp == 0x05) || (sfn_tmp == 0xE5))) {
+			
+			// Check if the entry pointed to by `dir` is a LFN or a SFN
+			if ((buffer[rw_offset + SFN_ATTR] & ATTR_LFN) == ATTR_LFN) {
+				
+				// The first physical entry in a chain gives the name length,
+				// so names with a different length are rejected right away
+				if (sfn_tmp & 0x40) {
+					lfn_skip = (fat_dir_lfn_length(buffer + rw_offset) != size);
+				}
+				
+				// If the LFN name does not match the input, the rest of the 
+				// chain is skipped
+				if (!lfn_skip) {
+					if (!fat_dir_lfn_cmp(buffer + rw_offset, name, size)) {
+						lfn_skip = 1;
+					}
+				}
+				lfn_crc = buffer[rw_offset + LFN_CRC];
+			} else {
+				
 				// The current entry is a SFN
-				if (lfn_crc && lfn_match) {
+				if (lfn_crc && !lfn_skip) {
 					// The current SFN entry is the last in a sequence of LFN's
 					if (lfn_crc == fat_dir_sfn_crc(buffer + rw_offset)) {
 						match = 1;
 					}
-				} else {
-					// Compare `name` with the SFN 8.3 file name
-					if (fat_dir_sfn_cmp((char *)buffer + rw_offset, name, size)) {
-						match = 1;
+				} else {
+					// Compare `name` with the SFN 8.3 file name
+					if (fat_dir_sfn_cmp((char *)buffer + rw_offset, name, size)) {
+						match = 1;
+					}
+				}
+				if (match) {
+					// Remember where the entry is located
+					dir->entry_lba = dir->sector;
+					dir->entry_offset = rw_offset;
+					dir->attribute = buffer[rw_offset + SFN_ATTR];
+					
+					// Update the `dir` pointer
+					dir->cluster = (fat_load16(buffer + rw_offset +
+						SFN_CLUSTH) << 16) | fat_load16(buffer +
+						rw_offset + SFN_CLUSTL);
+					dir->sector = fat_clust_to_sect(dir->vol, dir->cluster);
+					dir->start_sect = dir->sector;
+					dir->size = fat_load32(buffer + rw_offset + SFN_FILE_SIZE);
+					dir->rw_offset = 0;
+
+					return 1;
+				}
+				if (single) {
+					return 0;
+				}
+				lfn_skip = 0;
+				lfn_crc = 0;
+			}
+		}
+		// Get the next 32-byte directory entry
+		if (!fat_dir_get_next(dir)) {
+			return 0;
+		}
+	}
+	return 0;
+}
+
+/// Returns a 16-bit hash of the case folded `name`
+static u16 fat_dir_hash(const char* name, u32 size) {
+	u32 hash = 2166136261;
+	for (u32 i = 0; i < size; i++) {
+		char tmp_char = name[i];
+		if (tmp_char >= 'a' && tmp_char <= 'z') {
+			tmp_char -= 32;
+		}
+		hash = (hash ^ (u8)tmp_char) * 16777619;
+	}
+	return (u16)(hash ^ (hash >> 16));
+}
+
+/// Returns the name index of the directory starting at `start`. If there is 
+/// no index, the least recently used one is replaced and built. Returns NULL
+/// if the volume has no index pool
+static struct dir_index_s* fat_dir_index_get(struct volume_s* vol, u32 start) {
+	if (vol->dir_index[0].slots == NULL) {
+		return NULL;
+	}
+	struct dir_index_s* victim = &vol->dir_index[0];
+	for (u32 i = 0; i < FAT_DIR_INDEX_CNT; i++) {
+		struct dir_index_s* index = &vol->dir_index[i];
+		
+		if (index->start_sect == start) {
+			index->stamp = ++vol->index_tick;
+			return index;
+		}
+		if (index->stamp < victim->stamp) {
+			victim = index;
+		}
+	}
+	
+	victim->start_sect = start;
+	victim->stamp = ++vol->index_tick;
+	if (!fat_dir_index_build(vol, victim)) {
+		victim->start_sect = 0;
+		victim->stamp = 0;
+		return NULL;
+	}
+	return victim;
+}
+
+/// Scans the whole directory and adds every name to the index
+static u8 fat_dir_index_build(struct volume_s* vol, struct dir_index_s* index) {
+	for (u32 i = 0; i < index->size; i++) {
+		index->slots[i].sector = 0;
+	}
+	index->count = 0;
+	index->complete = 1;
+	
+	struct dir_s dir;
+	dir.vol = vol;
+	dir.sector = index->start_sect;
+	dir.cluster = fat_sect_to_clust(vol, dir.sector);
+	dir.rw_offset = 0;
+	
+	// Position of the first entry in the current LFN chain
+	u32 chain_sect = 0;
+	u32 chain_off = 0;
+	u32 lfn_length = 0;
+	u8 lfn_crc = 0;
+	
+	while (1) {
+		if (!fat_read(vol, dir.sector)) {
+			return 0;
+		}
+		u8* entry = vol->buffer + dir.rw_offset;
+		
+		// Check for the EOD marker
+		if (entry[0] == 0x00) {
+			break;
+		}
+		if ((entry[0] == 0xE5) || (entry[0] == 0x05)) {
+			lfn_crc = 0;
+		} else if ((entry[SFN_ATTR] & ATTR_LFN) == ATTR_LFN) {
+			
+			// The LFN fragments are collected in the volume LFN buffer
+			u8 seq = entry[LFN_SEQ] & LFN_SEQ_MSK;
+			if (entry[LFN_SEQ] & 0x40) {
+				chain_sect = dir.sector;
+				chain_off = dir.rw_offset;
+				lfn_length = fat_dir_lfn_length(entry);
+			}
+			if (seq && (13 * seq <= sizeof(vol->lfn))) {
+				for (u8 i = 0; i < 13; i++) {
+					vol->lfn[13 * (seq - 1) + i] = entry[lfn_lut[i]];
+				}
+			}
+			lfn_crc = entry[LFN_CRC];
+		} else {
+			if (!(entry[SFN_ATTR] & ATTR_VOL_LABEL)) {
+				
+				// A long name which does not fit in the LFN buffer is not
+				// indexed, so the index can no longer prove a name absent
+				if (lfn_crc && (lfn_crc == fat_dir_sfn_crc(entry)) &&
+					(lfn_length > sizeof(vol->lfn))) {
+					index->complete = 0;
+				}
+				
+				// Without a valid LFN chain the entry starts at the SFN
+				if (!lfn_crc || (lfn_crc != fat_dir_sfn_crc(entry)) ||
+					(lfn_length > sizeof(vol->lfn))) {
+					lfn_crc = 0;
+					chain_sect = dir.sector;
+					chain_off = dir.rw_offset;
+				}
+				
+				// Both the LFN and the SFN alias point to the entry
+				char sfn_name[12];
+				u16 hash = fat_dir_hash(sfn_name, fat_dir_sfn_name(entry,
+					sfn_name));
+				if (!fat_dir_index_add(index, hash, chain_sect, chain_off)) {
+					index->complete = 0;
+				}
+				if (lfn_crc) {
+					hash = fat_dir_hash(vol->lfn, lfn_length);
+					if (!fat_dir_index_add(index, hash, chain_sect, 
+						chain_off)) {
+						index->complete = 0;
+					}
+				}
+			}
+			lfn_crc = 0;
+		}
+		if (!fat_dir_get_next(&dir)) {
+			break;
+		}
+	}
+	return 1;
+}
+
+/// Adds one name to the index. The table is never filled above 75 % so that 
+/// a lookup always hits an empty slot. Returns `0` if the index is full
+static u8 fat_dir_index_add(struct dir_index_s* index, u16 hash, u32 sector,
+	u32 offset) {
+	
+	if (index->count >= index->size - index->size / 4) {
+		return 0;
+	}
+	u32 slot = hash % index->size;
+	while (index->slots[slot].sector) {
+		if (++slot >= index->size) {
+			slot = 0;
+		}
+	}
+	index->slots[slot].sector = sector;
+	index->slots[slot].offset = (u16)offset;
+	index->slots[slot].hash = hash;
+	index->count++;
+	return 1;
+}
+
+/// Removes the index of the directory starting at `start_sect`. This must be
+/// called whenever names in a directory are created, renamed or deleted. If 
+/// `start_sect` is zero all indexes on the volume are removed
+static void fat_dir_index_drop(struct volume_s* vol, u32 start_sect) {
+	for (u32 i = 0; i < FAT_DIR_INDEX_CNT; i++) {
+		struct dir_index_s* index = &vol->dir_index[i];
+		
+		if ((start_sect == 0) || (index->start_sect == start_sect)) {
+			index->start_sect = 0;
+			index->stamp = 0;
+		}
+	}
+}
+
+/// Follows the `path` and returns the `dir` object pointing to the last found 
+/// folder. If not found the functions returns `0`, but the `dir` object may
+/// still be changed
+/// 
+/// Path should be on the form: C:/home/usr/bin/chrome.exe
+static fstatus fat_follow_path(struct dir_s* dir, const char* path, u32 length) {
+	
+	// Volume object is determined from the first character
+	struct volume_s* vol = volume_get(*path++);
+	if (vol == NULL) {
+		return FSTATUS_NO_VOLUME;
+	}
+	// Rewind the `dir` object to the root directory
+	dir->vol = vol;
+	dir->start_sect = dir->sector = vol->root_lba;
+	dir->cluster = fat_sect_to_clust(vol, vol->root_lba);
+	dir->rw_offset = 0;
+	
+	// Check for the colon
+	if (*path++ != ':') {
+		return FSTATUS_PATH_ERR;
+	}
+	if (*path != '/') {
+		return FSTATUS_PATH_ERR;
+	}
+	
+	// Resume from the deepest directory already resolved. `base` points to the
+	// first slash and is the start of all cached paths
+	const char* base = path;
+	u32 start_sect;
+	u32 cached = fat_path_lookup(vol, base, &start_sect);
+	if (cached) {
+		dir->start_sect = dir->sector = start_sect;
+		dir->cluster = fat_sect_to_clust(vol, start_sect);
+		path += cached;
+	}
+	
+	// `frag_ptr` and `frag_size` will contain one fragment of the path name
+	const char* frag_ptr;
+	u8 frag_size;
+	while (1) {
+		
+		// Search for the first `/`
+		while (*path && (*path != '/')) {
+			path++;
+		}
+		// TODO: This is not right is it?
+		// Check if the next fragment exist
+		if (*path++ == '\0') break;
+		if (*path == '\0') break;
+		
+		// `path` points to the first character in the current name fragment
+		const char* tmp_ptr = path;
+		frag_ptr = path;
+		frag_size = 0;
+		
+		while ((*tmp_ptr != '\0') && (*tmp_ptr != '/')) {
+						
+			// The current fragment describes is a file, However, the name 
+			// fragment before it has been found
+			if (*tmp_ptr == '.') {
+				return FSTATUS_OK;
+			}
+			frag_size++;
+			tmp_ptr++;
+		}
+		
+		// Now `frag_ptr` will point to the first character in the name
+		// fragment, and `frag_size` will contain the size
+		
+		// Search for a matching directory name in the current directory. If
+		// matched, the `fat_dir_search` will update the `dir` pointer as well
+		if (!fat_dir_search(dir, frag_ptr, frag_size)) {
+			return FSTATUS_PATH_ERR;
+		}
+		if (dir->attribute & ATTR_DIR) {
+			fat_path_add(vol, base, (frag_ptr + frag_size) - base, 
+				dir->start_sect);
+		}
+	}	
+	return FSTATUS_OK;
+}
+
+#if FAT_PATH_CACHE_SIZE
+/// Returns `1` if `path` starts with the cached path in `entry`. The cached 
+/// path is stored in upper case, so the comparison ignores case
+static u8 fat_path_prefix(const struct path_cache_s* entry, const char* path) {
+	for (u32 i = 0; i < entry->length; i++) {
+		char tmp_char = path[i];
+		if (tmp_char >= 'a' && tmp_char <= 'z') {
+			tmp_char -= 32;
+		}
+		if (tmp_char != entry->path[i]) {
+			return 0;
+		}
+	}
+	return 1;
+}
+#endif
+
+/// Searches the path cache for the deepest cached directory in `path`, which 
+/// starts at the slash following the colon. Returns the number of characters
+/// resolved by the cache, or `0` if no ancestor is cached
+static u32 fat_path_lookup(struct volume_s* vol, const char* path, 
+	u32* start_sect) {
+#if FAT_PATH_CACHE_SIZE
+	struct path_cache_s* best = NULL;
+	
+	for (u32 i = 0; i < FAT_PATH_CACHE_SIZE; i++) {
+		struct path_cache_s* entry = &vol->path_cache[i];
+		if ((entry->length == 0) || (best && (entry->length <= best->length))) {
+			continue;
+		}
+		
+		// The entry must match a whole number of path fragments
+		if (fat_path_prefix(entry, path) && ((path[entry->length] == '/') || 
+			(path[entry->length] == '\0'))) {
+			best = entry;
+		}
+	}
+	if (best == NULL) {
+		FAT_STAT(vol, path_misses, 1);
+		return 0;
+	}
+	FAT_STAT(vol, path_hits, 1);
+	best->stamp = ++vol->path_tick;
+	*start_sect = best->start_sect;
+	return best->length;
+#else
+	return 0;
+#endif
+}
+
+/// Adds the directory `path` with `length` characters to the path cache. The
+/// least recently used entry is replaced
+static void fat_path_add(struct volume_s* vol, const char* path, u32 length,
+	u32 start_sect) {
+#if FAT_PATH_CACHE_SIZE
+	if (length >= FAT_PATH_CACHE_LEN) {
+		return;
+	}
+	struct path_cache_s* victim = &vol->path_cache[0];
+	for (u32 i = 0; i < FAT_PATH_CACHE_SIZE; i++) {
+		struct path_cache_s* entry = &vol->path_cache[i];
+		
+		// The path might already be present
+		if ((entry->length == length) && (entry->start_sect == start_sect) &&
+			fat_path_prefix(entry, path)) {
+			entry->stamp = ++vol->path_tick;
+			return;
+		}
+		if (entry->stamp < victim->stamp) {
+			victim = entry;
+		}
+	}
+	for (u32 i = 0; i < length; i++) {
+		char tmp_char = path[i];
+		if (tmp_char >= 'a' && tmp_char <= 'z') {
+			tmp_char -= 32;
+		}
+		victim->path[i] = tmp_char;
+	}
+	victim->length = (u8)length;
+	victim->start_sect = start_sect;
+	victim->stamp = ++vol->path_tick;
+#endif
+}
+
+/// Removes all cached paths on a volume. This must be called when directories
+/// are renamed, moved or deleted
+static void fat_path_drop(struct volume_s* vol) {
+#if FAT_PATH_CACHE_SIZE
+	for (u32 i = 0; i < FAT_PATH_CACHE_SIZE; i++) {
+		vol->path_cache[i].length = 0;
+		vol->path_cache[i].stamp = 0;
+	}
+	vol->path_tick = 0;
+#endif
+}
+
+/// Get the volume label stored in the root directory. This is the one used by
+/// Microsoft, not the BPB volume ID
+static fstatus fat_get_vol_label(struct volume_s* vol, char* label) {	
+	// Make a directory object pointing to the root directory
+	struct dir_s dir;
+	dir.vol = vol;
+	dir.sector = vol->root_lba;
+	dir.rw_offset = 0;
+	dir.cluster = fat_sect_to_clust(vol, dir.sector);
+	
+	// The volume label is a SFN entry in the root directory with bit 3 set in
+	// the attribute field. Volume label is limited to 13 uppercase characters
+	while (1) {
+		if (!fat_read(vol, dir.sector)) {
+			return FSTATUS_ERROR;
+		}
+		
+		// A blank volume has no label entry before the end of the directory
+		if (vol->buffer[dir.rw_offset] == 0x00) {
+			label[0] = '\0';
+			return FSTATUS_OK;
+		}
+		
+		// Check if the attribute is volume label
+		u8 attribute = vol->buffer[dir.rw_offset + SFN_ATTR];
+		if (attribute & ATTR_VOL_LABEL) {
+			
+			// LFN file name entries are also marked with volume label
+			if ((attribute & ATTR_LFN) != ATTR_LFN) {
+				const char* src = (const char *)(vol->buffer + dir.rw_offset);
+				
+				for (u8 i = 0; i < 11; i++) {
+					*label++ = *src++;
+				}
+				*label = '\0';
+				return FSTATUS_OK;
+			}
+		}
+		// Get the next directory
+		if (!fat_dir_get_next(&dir)) {
+			return FSTATUS_ERROR;
+		}
+	}
+}
+
+/// Remove
+/// Print directory information
+static void fat_print_info(struct info_s* info) {
+	print(BLUE);
+	u32 size = info->size;
+	char ext = 0;	
+	u8 ext_cnt = 0;
+	while (size >= 1000) {
+		size /= 1000;
+		ext = file_size_ext[ext_cnt++];
+	}
+	print("%d", size);
+	if (ext) {
+		print("%c", ext);
+	}
+	print("B\t");
+	u16 time = info->w_time;
+	u16 date = info->w_date;
+	
+	print("%d/%d/%d %d:%d\t", 
+		date & 0b11111,
+		(date >> 5) & 0b1111,
+		((date >> 9) & 0b1111111) + 1980,
+		(time >> 11) & 0b11111,
+		(time >> 5) & 0b111111);
+		
+	if (info->attribute & ATTR_DIR) {
+		print("DIR\t");
+	} else {
+		print("\t");
+	}
+	
+	print_count(info->name, info->name_length);
+	print("\n");
+}
+
+
+//------------------------------------------------------------------------------
+// FAT23 file system API
+// This section will implement the file system API exposed to the user
+//------------------------------------------------------------------------------
+
+/// This is the `main` functions that is used to tast the file system
+void fat32_thread(void* arg) {
+	
+	// Configure the hardware
+	board_sd_card_config();
+	disk_register_board();
+	
+	// Wait for the SD card to be insterted
+	while (!board_sd_card_get_status());
+	
+	// Try to mount the disk. If this is not working the disk initialize 
+	// functions may be ehh...
+	disk_mount(DISK_SD_CARD);
+	
+	for (u8 i = 0; i < 6; i++) {
+		print("S: %d c: %d\n", cluster_size_lut[i].clust_size, cluster_size_lut[i].sector_cnt);
+	}
+	
+	struct volume_s* tmp = volume_get('C');
+	u32 cluster;
+	
+	fat_get_cluster(tmp, &cluster);
+	fat_table_set(tmp, 33, 0);
+	fat_print_table(tmp, 0);
+
+	// Print all the volumes on the system
+	print(BLUE "Displaying system volumes:\n");
+	struct volume_s* vol = volume_get_first();
+	while (vol) {
+		for (u8 i = 0; i < 11; i++) {
+			if (vol->label[i]) {
+				print("%c", vol->label[i]);
+			}
+		}
+		print(" (%c:)\n", vol->letter);
+		vol = vol->next;
+	}
+	print("\n");
+	
+	
+	// List all directories
+	struct dir_s dir;
+	fat_dir_open(&dir, "C:/alpha/", 0);
+	
+	static struct info_s info_mem;
+	struct info_s* info = &info_mem;
+	fstatus status;
+	print("\nListing directories in: C:/alpha\n");
+	do {
+		status = fat_dir_read(&dir, info);
+		
+		if (fat_memcmp(info->name, "uuuuuughh.txt", info->name_length)) {
+			//fat_dir_rename(&dir, "dude", 4);
+		}
+		
+		// Print the information
+		if (status == FSTATUS_OK) {
+			fat_print_info(info);
+		}
+	} while (status != FSTATUS_EOF);
+	print(BLUE "- EOD -\n");
+
+	while (1) {
+		
+	}
+}
+
+/// Sets up the volume geometry from the BPB sector `bpb` of the partition at
+/// `lba`. All caches are emptied and the bitmap, name index and write buffer
+/// are detached
+static void fat_volume_setup(struct volume_s* vol, const u8* bpb, u32 lba) {
+	vol->part_lba = lba;
+	
+	// Update FAT32 information
+	vol->sector_size = fat_load16(bpb + BPB_SECTOR_SIZE);
+	vol->sector_shift = 0;
+	while ((1U << vol->sector_shift) < vol->sector_size) {
+		vol->sector_shift++;
+	}
+	vol->cluster_size = bpb[BPB_CLUSTER_SIZE];
+	vol->total_size = fat_load32(bpb + BPB_TOT_SECT_32);
+	
+	// Update FAT32 offsets that will be used by the driver
+	vol->fsinfo_lba = lba + fat_load16(bpb + BPB_32_FSINFO);
+	vol->fat_lba = lba + fat_load16(bpb + BPB_RSVD_CNT);
+	vol->fat_size = fat_load32(bpb + BPB_32_FAT_SIZE);
+	vol->fat_num = bpb[BPB_NUM_FATS];
+	vol->data_lba = vol->fat_lba + vol->fat_size * vol->fat_num;
+	vol->root_lba = fat_clust_to_sect(vol, fat_load32(bpb + 
+		BPB_32_ROOT_CLUST));
+	
+	// With mirroring turned off only the active FAT is used
+	u16 flags = fat_load16(bpb + BPB_32_EXT_FLAGS);
+	vol->fat_cnt = vol->fat_num;
+	if ((flags & EXT_FLAGS_NO_MIRROR) && 
+		((flags & EXT_FLAGS_ACTIVE) < vol->fat_num)) {
+		vol->fat_lba += (flags & EXT_FLAGS_ACTIVE) * vol->fat_size;
+		vol->fat_cnt = 1;
+	}
+#if FAT_MIRROR != FAT_MIRROR_EAGER
+	for (u32 i = 0; i < FAT_MIRROR_RANGES; i++) {
+		vol->mirror[i].count = 0;
+	}
+#endif
+	
+	// The number of data clusters is limited by both the volume size and the
+	// number of entries in the FAT
+	vol->cluster_cnt = (vol->total_size - (vol->data_lba - lba)) / 
+		vol->cluster_size;
+	u32 entries = vol->fat_size << (vol->sector_shift - 2);
+	if (vol->cluster_cnt > entries - 2) {
+		vol->cluster_cnt = entries - 2;
+	}
+	vol->bitmap = NULL;
+	vol->au_size = disk_get_au_size(vol->disk);
+	vol->wbuf = NULL;
+	vol->wbuf_cnt = 0;
+#if FAT_STATS
+	struct fat_stats_s empty = { 0 };
+	vol->stats = empty;
+#endif
+	vol->label[0] = '\0';
+	vol->label_valid = 0;
+#if FAT_FAST_MOUNT
+	vol->snap_bitmap = 0;
+#endif
+	volume_index_attach_locked(vol, NULL, 0);
+#if FAT_PATH_CACHE_SIZE
+	fat_path_drop(vol);
+#endif
+	
+	// Sector zero will not exist in any file system. This forces the code to
+	// read the first block from the storage device
+	fat_cache_init(vol);
+	vol->fsinfo_valid = 0;
+	vol->fsinfo_dirty = 0;
+}
+
+/// Writes zeros to `count` sectors starting at `lba`. Each write covers up to
+/// `zero_sect` sectors from the same zeroed buffer, and several writes are
+/// queued on the disk at a time
+static u8 fat_format_clear(struct volume_s* vol, u32 lba, u32 count, 
+	const u8* zero, u32 zero_sect) {
+	
+	struct fat_req_s reqs[DISK_QUEUE_SIZE];
+	for (u32 i = 0; i < DISK_QUEUE_SIZE; i++) {
+		reqs[i].pending = 0;
+		reqs[i].status = 1;
+	}
+	
+	u32 index = 0;
+	while (count) {
+		struct fat_req_s* req = &reqs[index];
+		if (!fat_req_wait(req, vol->disk)) {
+			break;
+		}
+		u32 sect_cnt = (count < zero_sect) ? count : zero_sect;
+		fat_req_submit(req, vol->disk, (u8 *)zero, lba, sect_cnt, 1);
+		fat_stat_io(vol, 1, sect_cnt, 0);
+		lba += sect_cnt;
+		count -= sect_cnt;
+		index = (index + 1) % DISK_QUEUE_SIZE;
+	}
+	
+	// Wait for all writes and check the results
+	u8 status = (count == 0);
+	for (u32 i = 0; i < DISK_QUEUE_SIZE; i++) {
+		if (!fat_req_wait(&reqs[i], vol->disk)) {
+			status = 0;
+		}
+	}
+	return status;
+}
+
+/// Mounts a physical disk. It checks for a valid FAT32 file system in all
+/// available disk partitions. All valid file system is dynamically allocated
+/// and added to the system volumes
+/// 
+/// Note that this is the only functions referencing the `disk` parameter. All
+/// further interactions happend will via the volume letter e.g. D: drive.
+u8 disk_mount(disk_e disk) {
+	
+	// Verify that the storage device are present
+	if (!disk_get_status(disk)) return 0;
+	
+	// Initialize the hardware and protocols
+	if (!disk_initialize(disk)) return 0;
+	
+	// The partition tables and the boot sectors use the logical sector size 
+	// of the disk, which must fit in the sector buffers
+	u32 sect_size = disk_get_sector_size(disk);
+	if ((sect_size < 512) || (sect_size > FAT_SECTOR_SIZE) || 
+		(sect_size & (sect_size - 1)) || 
+		(FAT_SECTOR_FIXED && (sect_size != FAT_SECTOR_SIZE))) {
+		return 0;
+	}
+	
+	// The partition tables and boot sectors are read into a temporary scratch
+	// buffer. If it can not be allocated the first sector buffer of a new 
+	// volume is used instead. Mounts on different disks never share any 
+	// memory
+	struct volume_s* vol = fat_volume_new();
+	if (vol == NULL) {
+		return 0;
+	}
+	u8* scratch = NULL;
+	u32 scratch_cnt = FAT_SECTOR_SIZE / sect_size;
+#if FAT_DYNAMIC_MEMORY
+	if (FAT_MOUNT_SECTORS > 1) {
+		scratch = (u8 *)dynamic_memory_new(DRAM_BANK_0, FAT_MOUNT_SECTORS * 
+			FAT_SECTOR_SIZE);
+		if (scratch) {
+			scratch_cnt = FAT_MOUNT_SECTORS * (FAT_SECTOR_SIZE / sect_size);
+		}
+	}
+#endif
+	u8* mount_buffer = scratch ? scratch : vol->cache_mem[0].buffer;
+	
+	// Collect the candidate partitions from the MBR, the EBR chains or the GPT
+	struct partition_s partitions[FAT_PARTITION_CNT];
+	u32 part_cnt = 0;
+	u8 status = fat_mount_scan(disk, mount_buffer, scratch_cnt, sect_size, 
+		partitions, &part_cnt);
+	
+	// The boot sectors are probed in batches. Each valid FAT32 file system is
+	// added to the system volumes in partition table order. Without a scratch
+	// buffer the boot sectors are read into the cache of the volume being set
+	// up, which would overwrite the rest of the batch, so one is probed at a
+	// time
+	u32 batch = 0;
+	for (u32 i = 0; status && (i < part_cnt); i += batch) {
+		batch = part_cnt - i;
+		if (batch > scratch_cnt) {
+			batch = scratch_cnt;
+		}
+		if (batch > DISK_QUEUE_SIZE) {
+			batch = DISK_QUEUE_SIZE;
+		}
+		if (scratch == NULL) {
+			batch = 1;
+		}
+		
+		// The last volume was taken into use
+		if (vol == NULL) {
+			vol = fat_volume_new();
+			if (vol == NULL) {
+				status = 0;
+				break;
+			}
+		}
+		if (scratch == NULL) {
+			mount_buffer = vol->cache_mem[0].buffer;
+		}
+		fat_mount_probe(disk, mount_buffer, sect_size, partitions + i, batch);
+		
+		for (u32 j = 0; j < batch; j++) {
+			u8* bpb = mount_buffer + j * sect_size;
+			
+			// Check if the current partition contains a FAT32 file system.
+			// The file system must use the sector size of the disk
+			if (!fat_search(bpb) || 
+				(fat_load16(bpb + BPB_SECTOR_SIZE) != sect_size)) {
+				continue;
+			}
+			if (vol == NULL) {
+				vol = fat_volume_new();
+				if (vol == NULL) {
+					status = 0;
+					break;
+				}
+			}
+			
+#if FAT_THREAD_SAFE
+			vol->lock = fat_os_mutex_new();
+			if (vol->lock == NULL) {
+				status = 0;
+				break;
+			}
+#endif
+			
+			vol->disk = disk;
+#if FAT_FAST_MOUNT
+			u32 vol_id = fat_load32(bpb + BPB_32_VOL_ID);
+#endif
+			fat_volume_setup(vol, bpb, partitions[i + j].lba);
+			
+			// The probe read of the boot sector is the first transfer of 
+			// the volume. The partition tables are shared by all volumes on
+			// the disk and are not counted
+			fat_stat_io(vol, 0, 1, 0);
+#if FAT_MIRROR == FAT_MIRROR_SINGLE
+			fat_mirror_disable(vol, bpb);
+#endif
+			
+#if FAT_FAST_MOUNT
+			// The label and FSinfo are restored from the mount snapshot if 
+			// valid, otherwise they are read on first use
+			fat_snap_load(vol, vol_id);
+#else
+			// Get the volume label
+			if (fat_get_vol_label(vol, vol->label) == FSTATUS_OK) {
+				vol->label_valid = 1;
+			}
+#endif
+			
+			// Add the newly made volume to the list of system volumes
+			fat_volume_add(vol);
+			vol = NULL;
+		}
+	}
+#if FAT_DYNAMIC_MEMORY
+	if (scratch) {
+		dynamic_memory_free(scratch);
+	}
+#endif
+	if (vol) {
+		fat_volume_delete(vol);
+	}
+	return status;
+}
+
+/// Adds a partition to the list of mount candidates. Partitions beyond 
+/// FAT_PARTITION_CNT are ignored
+static void fat_part_add(struct partition_s* parts, u32* count, u32 lba, 
+	u32 size, u8 type) {
+	if (*count < FAT_PARTITION_CNT) {
+		parts[*count].lba = lba;
+		parts[*count].size = size;
+		parts[*count].type = type;
+		parts[*count].status = 0;
+		(*count)++;
+	}
+}
+
+/// Returns `1` if the MBR partition type is an extended partition
+static inline u8 fat_part_extended(u8 type) {
+	return (type == PAR_TYPE_EXT_CHS) || (type == PAR_TYPE_EXT_LBA) || 
+		(type == PAR_TYPE_EXT_LINUX);
+}
+
+/// Reads the partition table of a disk and adds all partitions which may hold
+/// a file system to `parts`. A protective MBR hands over to the GPT, and the
+/// extended partitions are replaced by the logical partitions in their chain.
+/// `buffer` holds `buffer_cnt` sectors of `sect_size` bytes
+static u8 fat_mount_scan(disk_e disk, u8* buffer, u32 buffer_cnt, 
+	u32 sect_size, struct partition_s* parts, u32* count) {
+	
+	// Read MBR sector at LBA address zero and check the boot signature
+	if (!disk_read(disk, buffer, 0, 1) ||
+		(fat_load16(buffer + MBR_BOOT_SIG) != MBR_BOOT_SIG_VALUE)) {
+		return 0;
+	}
+	
+	// Retrieve the partition info from all four partitions, since the buffer
+	// is reused for the extended partitions
+	struct partition_s partitions[4];
+	for (u8 i = 0; i < 4; i++) {
+		u32 offset = MBR_PARTITION + i * MBR_PARTITION_SIZE;
+		
+		partitions[i].lba = fat_load32(buffer + offset + PAR_LBA);
+		partitions[i].size = fat_load32(buffer + offset + PAR_SIZE);
+		partitions[i].type = buffer[offset + PAR_TYPE];
+		partitions[i].status = buffer[offset + PAR_STATUS];
+		
+		if (partitions[i].type == PAR_TYPE_GPT) {
+			return fat_mount_gpt(disk, buffer, buffer_cnt, sect_size, parts,
+				count);
+		}
+	}
+	
+	for (u8 i = 0; i < 4; i++) {
+		if (partitions[i].lba == 0) {
+			continue;
+		}
+		if (fat_part_extended(partitions[i].type)) {
+			if (!fat_mount_ebr(disk, buffer, partitions[i].lba, parts, count)) {
+				return 0;
+			}
+		} else {
+			fat_part_add(parts, count, partitions[i].lba, partitions[i].size,
+				partitions[i].type);
+		}
+	}
+	return 1;
+}
+
+/// Follows the EBR chain of the extended partition at `ext_lba`. Each EBR 
+/// holds one logical partition relative to the EBR itself, and a link to the
+/// next EBR relative to the extended partition. The chain length is limited
+/// by FAT_PARTITION_CNT, so a looping chain can not hang the mount
+static u8 fat_mount_ebr(disk_e disk, u8* buffer, u32 ext_lba, 
+	struct partition_s* parts, u32* count) {
+	u32 ebr_lba = ext_lba;
+	
+	for (u32 i = 0; i < FAT_PARTITION_CNT; i++) {
+		if (!disk_read(disk, buffer, ebr_lba, 1)) {
+			return 0;
+		}
+		if (fat_load16(buffer + MBR_BOOT_SIG) != MBR_BOOT_SIG_VALUE) {
+			break;
+		}
+		const u8* logical = buffer + MBR_PARTITION;
+		const u8* next = logical + MBR_PARTITION_SIZE;
+		
+		if (logical[PAR_TYPE] && fat_load32(logical + PAR_LBA)) {
+			fat_part_add(parts, count, ebr_lba + fat_load32(logical + PAR_LBA),
+				fat_load32(logical + PAR_SIZE), logical[PAR_TYPE]);
+		}
+		if (!fat_part_extended(next[PAR_TYPE]) || !fat_load32(next + PAR_LBA)) {
+			break;
+		}
+		ebr_lba = ext_lba + fat_load32(next + PAR_LBA);
+	}
+	return 1;
+}
+
+/// Reads the GPT header at LBA one and the partition entry array. The array
+/// normally follows the header, so both are read in one transfer when the 
+/// buffer is large enough. The rest is read in transfers of `buffer_cnt` 
+/// sectors. The partitions are only used if both the header and the entry 
+/// array pass the CRC
+static u8 fat_mount_gpt(disk_e disk, u8* buffer, u32 buffer_cnt, 
+	u32 sect_size, struct partition_s* parts, u32* count) {
+	if (!disk_read(disk, buffer, 1, buffer_cnt)) {
+		return 0;
+	}
+	if (!fat_memcmp(buffer + GPT_SIGNATURE, "EFI PART", 8)) {
+		return 1;
+	}
+	
+	// The header CRC is calculated with the CRC field set to zero
+	const u8 zero[4] = {0};
+	u32 header_size = fat_load32(buffer + GPT_HEADER_SIZE);
+	if ((header_size < 92) || (header_size > sect_size)) {
+		return 1;
+	}
+	u32 crc = fat_crc32(0, buffer, GPT_HEADER_CRC);
+	crc = fat_crc32(crc, zero, 4);
+	crc = fat_crc32(crc, buffer + GPT_HEADER_CRC + 4, header_size - 
+		GPT_HEADER_CRC - 4);
+	if (crc != fat_load32(buffer + GPT_HEADER_CRC)) {
+		return 1;
+	}
+	
+	// The header is overwritten when the rest of the array is read
+	u32 entry_lba = fat_load32(buffer + GPT_ENTRY_LBA);
+	u32 entry_cnt = fat_load32(buffer + GPT_ENTRY_CNT);
+	u32 entry_size = fat_load32(buffer + GPT_ENTRY_SIZE);
+	u32 entry_crc = fat_load32(buffer + GPT_ENTRY_CRC);
+	if (fat_load32(buffer + GPT_ENTRY_LBA + 4) || (entry_size < 128) || 
+		(entry_size > sect_size) || (entry_size & (entry_size - 1))) {
+		return 1;
+	}
+	u32 per_sect = sect_size / entry_size;
+	u32 sect_cnt = (entry_cnt + per_sect - 1) / per_sect;
+	
+	// The window is the range of sectors currently held in the buffer
+	u32 win_lba = 1;
+	u32 win_cnt = buffer_cnt;
+	u32 first = *count;
+	u32 entry = 0;
+	crc = 0;
+	for (u32 i = 0; i < sect_cnt; i++) {
+		u32 lba = entry_lba + i;
+		if (lba - win_lba >= win_cnt) {
+			win_lba = lba;
+			win_cnt = sect_cnt - i;
+			if (win_cnt > buffer_cnt) {
+				win_cnt = buffer_cnt;
+			}
+			if (!disk_read(disk, buffer, win_lba, win_cnt)) {
+				return 0;
+			}
+		}
+		const u8* sect = buffer + (lba - win_lba) * sect_size;
+		
+		// Only the `entry_cnt` entries are covered by the CRC
+		u32 cnt = entry_cnt - entry;
+		if (cnt > per_sect) {
+			cnt = per_sect;
+		}
+		crc = fat_crc32(crc, sect, cnt * entry_size);
+		for (u32 j = 0; j < cnt; j++, entry++) {
+			const u8* ent = sect + j * entry_size;
+			
+			// Unused entries have a zero type GUID. Partitions above 2 TB
+			// can not be addressed by the driver
+			if (fat_is_blank(ent + GPT_ENT_TYPE, 16) || 
+				fat_load32(ent + GPT_ENT_FIRST_LBA + 4) || 
+				fat_load32(ent + GPT_ENT_LAST_LBA + 4)) {
+				continue;
+			}
+			u32 start = fat_load32(ent + GPT_ENT_FIRST_LBA);
+			u32 end = fat_load32(ent + GPT_ENT_LAST_LBA);
+			if (start && (end >= start)) {
+				fat_part_add(parts, count, start, end - start + 1, 0);
+			}
+		}
+	}
+	if (crc != entry_crc) {
+		*count = first;
+	}
+	return 1;
+}
+
+/// Reads the first sector of `count` partitions into consecutive sectors of
+/// `sect_size` bytes in `buffer`. The reads are queued on the disk together, 
+/// so the boot sectors in a batch are fetched without waiting for each other.
+/// A sector which can not be read is cleared, so a bad partition entry only 
+/// hides that partition
+static void fat_mount_probe(disk_e disk, u8* buffer, u32 sect_size,
+	const struct partition_s* parts, u32 count) {
+	
+	struct fat_req_s reqs[DISK_QUEUE_SIZE];
+	for (u32 i = 0; i < count; i++) {
+		fat_req_submit(&reqs[i], disk, buffer + i * sect_size, parts[i].lba, 
+			1, 0);
+	}
+	
+	for (u32 i = 0; i < count; i++) {
+		if (!fat_req_wait(&reqs[i], disk)) {
+			u8* sect = buffer + i * sect_size;
+			for (u32 j = 0; j < sect_size; j++) {
+				sect[j] = 0;
+			}
+		}
+	}
+}
+
+/// Remove the volumes corresponding with a physical disk and delete the memory.
+/// This function must be called before a storage device is unplugged, if not,
+/// cached data may be lost. 
+u8 disk_eject(disk_e disk) {
+	struct volume_s* vol = volume_get_first();
+	
+	while (vol != NULL) {
+		struct volume_s* next = vol->next;
+		
+		// Remove all volumes which matches the `disk` number
+		if (vol->disk == disk) {
+			// Commit any cached data before the memory is deleted
+			fat_lock(vol);
+			u8 status = fat_sync(vol);
+#if FAT_FAST_MOUNT
+			if (status) {
+				status = fat_snap_store(vol);
+			}
+#endif
+			fat_unlock(vol);
+			if (!status) {
+				return 0;
+			}
+			if (!fat_volume_remove(vol->letter)) {
+				return 0;
+			}
+#if FAT_THREAD_SAFE
+			fat_os_mutex_free(vol->lock);
+#endif
+			fat_volume_delete(vol);
+		}
+		vol = next;
+	}
+	return 1;
+}
+
+/// Gives the driver a pool of memory for volume objects. Each mounted volume
+/// takes one block of `fat_pool_block_size` bytes, including its sector 
+/// caches. The pool must be attached before any disk is mounted
+fstatus fat_pool_attach(void* memory, u32 size) {
+	if (volume_base != NULL) {
+		return FSTATUS_BUSY;
+	}
+	
+	// Blocks are word aligned
+	u32 block_size = fat_pool_block_size();
+	u8* block = (u8 *)(((size_t)memory + 3) & ~(size_t)3);
+	u32 align = (u32)(block - (u8 *)memory);
+	size = (size > align) ? (size - align) : 0;
+	
+	pool_free = NULL;
+	pool_start = block;
+	pool_end = block + (size / block_size) * block_size;
+	for (u8* it = pool_end; it > pool_start; it -= block_size) {
+		*(void **)(it - block_size) = pool_free;
+		pool_free = it - block_size;
+	}
+	return pool_free ? FSTATUS_OK : FSTATUS_ERROR;
+}
+
+/// Returns the number of pool bytes used by one volume
+u32 fat_pool_block_size(void) {
+	return (sizeof(struct volume_s) + 3) & ~3;
+}
+
+/// Get the first volume in the system. If no volumes are present it return
+/// NULL
+struct volume_s* volume_get_first(void) {
+	return volume_base;
+}
+
+/// Get a volume based on its letter. The volume list is walked without a lock,
+/// since it only changes in `disk_mount` and `disk_eject`
+struct volume_s* volume_get(char letter) {
+	
+	struct volume_s* vol = volume_base;
+	while (vol != NULL) {
+		if (vol->letter == letter) {
+			return vol;
+		}
+		vol = vol->next;
+	}
+	return NULL;
+}
+
+/// Set the volume label in the BPB SFN entry
+fstatus volume_set_label(struct volume_s* vol, const char* name, u8 length) {
+	fat_lock(vol);
+	fstatus result = volume_set_label_locked(vol, name, length);
+	fat_unlock(vol);
+	return result;
+}
+
+static fstatus volume_set_label_locked(struct volume_s* vol, const char* name,
+	u8 length) {
+	// Make a directory object pointing to the root directory
+	struct dir_s dir;
+	dir.vol = vol;
+	dir.sector = vol->root_lba;
+	dir.rw_offset = 0;
+	dir.cluster = fat_sect_to_clust(vol, dir.sector);
+	
+	while (1) {
+		if (!fat_read(vol, dir.sector)) {
+			return FSTATUS_ERROR;
+		}
+		
+		// A freshly formatted volume has no label entry. The first free entry
+		// at the end of the directory is used for a new one
+		u8* entry = vol->buffer + dir.rw_offset;
+		if (entry[0] == 0x00) {
+			for (u8 i = 0; i < 32; i++) {
+				entry[i] = 0;
+			}
+			entry[SFN_ATTR] = ATTR_VOL_LABEL;
+		}
+		
+		// Check if the attribute is volume label
+		u8 attribute = vol->buffer[dir.rw_offset + SFN_ATTR];
+		if (attribute & ATTR_VOL_LABEL) {
+			
+			// Check that it is not a LFN entry
+			if ((attribute & ATTR_LFN) != ATTR_LFN) {
+				char* src = (char *)(vol->buffer + dir.rw_offset);
+				for (u8 i = 0; i < 11; i++) {
+					// The volume label is padded with spaces
+					if (i >= length) {
+						*src++ = ' ';
+					} else {
+						*src++ = *name++;
+					}
+					fat_mark_dirty(vol);
+				}
+				// Writes the buffer back to the storage device
+				// TODO: Do I need this?
+				if (!fat_flush(vol)) {
+					return FSTATUS_ERROR;
+				}
+				vol->label_valid = 0;
+				return volume_get_label_locked(vol, vol->label);
+			}
+		}
+		// Get the next directory
+		if (!fat_dir_get_next(&dir)) {
+			return FSTATUS_ERROR;
+		}
+	}
+}
+
+/// Get the volume label. `name` must hold 12 characters including the null 
+/// terminator. The label is read from the disk once and then kept in `vol`
+fstatus volume_get_label(struct volume_s* vol, char* name) {
+	fat_lock(vol);
+	fstatus result = volume_get_label_locked(vol, name);
+	fat_unlock(vol);
+	return result;
+}
+
+static fstatus volume_get_label_locked(struct volume_s* vol, char* name) {
+	// The label is read from the root directory on first use
+	if (!vol->label_valid) {
+		if (fat_get_vol_label(vol, vol->label) != FSTATUS_OK) {
+			return FSTATUS_ERROR;
+		}
+		vol->label_valid = 1;
+	}
+	if (name != vol->label) {
+		fat_memcpy(vol->label, name, 12);
+	}
+	return FSTATUS_OK;
+}
+
+/// Writes all pending FAT, FSinfo and cached sector changes on the volume back
+/// to the storage device
+fstatus volume_sync(struct volume_s* vol) {
+	fat_lock(vol);
+	fstatus result = volume_sync_locked(vol);
+	fat_unlock(vol);
+	return result;
+}
+
+static fstatus volume_sync_locked(struct volume_s* vol) {
+	if (!fat_sync(vol)) {
+		return FSTATUS_ERROR;
+	}
+	return FSTATUS_OK;
+}
+
+/// Returns the number of bytes needed for the free cluster bitmap of `vol`
+u32 volume_bitmap_size(struct volume_s* vol) {
+	return ((vol->cluster_cnt + 2 + 31) / 32) * 4;
+}
+
+/// Attach a free cluster bitmap to a volume. The memory is owned by the user
+/// and must be at least `volume_bitmap_size` bytes. It must stay valid until
+/// the volume is ejected or the bitmap is detached by passing NULL. The 
+/// bitmap is not used before `volume_bitmap_build` has completed
+fstatus volume_bitmap_attach(struct volume_s* vol, u32* bitmap, u32 size) {
+	fat_lock(vol);
+	fstatus result = volume_bitmap_attach_locked(vol, bitmap, size);
+	fat_unlock(vol);
+	return result;
+}
+
+static fstatus volume_bitmap_attach_locked(struct volume_s* vol, u32* bitmap,
+	u32 size) {
+	if (bitmap && (size < volume_bitmap_size(vol))) {
+		return FSTATUS_ERROR;
+	}
+	vol->bitmap = bitmap;
+	vol->bitmap_fill = 0;
+	vol->bitmap_free = 0;
+	
+	if (bitmap) {
+		// Clusters are marked as used while the FAT is scanned. Cluster zero
+		// and one, and the unused bits in the last word are always used
+		u32 words = volume_bitmap_size(vol) / 4;
+		for (u32 i = 0; i < words; i++) {
+			bitmap[i] = 0xFFFFFFFF;
+		}
+	}
+	return FSTATUS_OK;
+}
+
+/// Fills the free cluster bitmap from the FAT table. At most `sector_cnt` FAT 
+/// sectors are scanned per call, which allows the bitmap to be built in the 
+/// background. A `sector_cnt` of zero scans the rest of the FAT. Returns
+/// FSTATUS_BUSY until the whole FAT is scanned. The FSinfo free cluster count
+/// is corrected when the scan completes
+fstatus volume_bitmap_build(struct volume_s* vol, u32 sector_cnt) {
+	fat_lock(vol);
+	fstatus result = volume_bitmap_build_locked(vol, sector_cnt);
+	fat_unlock(vol);
+	return result;
+}
+
+static fstatus volume_bitmap_build_locked(struct volume_s* vol,
+	u32 sector_cnt) {
+	if (vol->bitmap == NULL) {
+		return FSTATUS_ERROR;
+	}
+	if (sector_cnt == 0) {
+		sector_cnt = 0xFFFFFFFF;
+	}
+	
+#if FAT_FAST_MOUNT
+	// A bitmap saved by a clean eject replaces the FAT scan as long as the 
+	// FAT is unchanged since the mount
+	if ((vol->bitmap_fill == 0) && vol->snap_bitmap) {
+		fat_snap_bitmap_load(vol);
+		vol->snap_bitmap = 0;
+	}
+#endif
+	
+	while (sector_cnt-- && (vol->bitmap_fill < vol->fat_size)) {
+		struct cache_s* entry = fat_table_read(vol, vol->fat_lba + 
+			vol->bitmap_fill);
+		if (entry == NULL) {
+			return FSTATUS_ERROR;
+		}
+		
+		// Clear the bit for every free entry in this FAT sector
+		u32 entries = fat_sect_size(vol) / 4;
+		u32 cluster = vol->bitmap_fill * entries;
+		for (u32 i = 0; i < entries; i++, cluster++) {
+			if ((cluster >= 2) && (cluster < vol->cluster_cnt + 2) &&
+				((fat_load32(entry->buffer + i * 4) & 0xFFFFFFF) == 0)) {
+				fat_bitmap_mark(vol, cluster, 0);
+			}
+		}
+		vol->bitmap_fill++;
+	}
+	if (vol->bitmap_fill < vol->fat_size) {
+		return FSTATUS_BUSY;
+	}
+	
+	// The scan is complete and gives the exact free cluster count
+	if (!fat_fsinfo_load(vol)) {
+		return FSTATUS_ERROR;
+	}
+	if (vol->free_count != vol->bitmap_free) {
+		vol->free_count = vol->bitmap_free;
+		vol->fsinfo_dirty = 1;
+	}
+	return FSTATUS_OK;
+}
+
+/// Measures the fragmentation of the volume from the FAT table. At most 
+/// `sector_cnt` FAT sectors are scanned per call, and a `sector_cnt` of zero
+/// scans the rest of the FAT. Returns FSTATUS_BUSY until the whole FAT is 
+/// scanned. The report is complete when FSTATUS_OK is returned
+fstatus volume_frag_scan(struct volume_s* vol, struct frag_s* frag, 
+	u32 sector_cnt) {
+	fat_lock(vol);
+	fstatus result = volume_frag_scan_locked(vol, frag, sector_cnt);
+	fat_unlock(vol);
+	return result;
+}
+
+static fstatus volume_frag_scan_locked(struct volume_s* vol, 
+	struct frag_s* frag, u32 sector_cnt) {
+	if (sector_cnt == 0) {
+		sector_cnt = 0xFFFFFFFF;
+	}
+	
+	u32 entries = fat_sect_size(vol) / 4;
+	u32 end = vol->cluster_cnt + 2;
+	while (sector_cnt-- && (frag->sector < vol->fat_size)) {
+		struct cache_s* entry = fat_table_read(vol, vol->fat_lba + 
+			frag->sector);
+		if (entry == NULL) {
+			return FSTATUS_ERROR;
+		}
+		
+		// `run` is the length of the free run reaching the current cluster,
+		// which may continue from the previous FAT sector
+		u32 cluster = frag->sector * entries;
+		for (u32 i = 0; i < entries; i++, cluster++) {
+			if ((cluster < 2) || (cluster >= end)) {
+				continue;
+			}
+			u32 value = fat_load32(entry->buffer + i * 4) & 0xFFFFFFF;
+			if (value == 0) {
+				frag->free_cnt++;
+				if (frag->run++ == 0) {
+					frag->free_runs++;
+				}
+				if (frag->run > frag->free_max) {
+					frag->free_max = frag->run;
+				}
+				continue;
+			}
+			frag->run = 0;
+			
+			// Bad clusters are neither free nor part of a file
+			if (value == 0xFFFFFF7) {
+				continue;
+			}
+			frag->clusters++;
+			if ((value < 0xFFFFFF8) && (value != cluster + 1)) {
+				frag->fragments++;
+			}
+		}
+		frag->sector++;
+	}
+	return (frag->sector < vol->fat_size) ? FSTATUS_BUSY : FSTATUS_OK;
+}
+
+/// Attach a memory pool for directory name indexes to a volume. The pool is 
+/// split between FAT_DIR_INDEX_CNT directories, and each table uses 8 bytes
+/// per slot. A name with a LFN takes two slots, since the SFN alias is added
+/// as well. Directories filling more than 75 % of the slots are indexed
+/// partially. The memory must stay valid until the volume is ejected or the
+/// pool is detached by passing NULL
+fstatus volume_index_attach(struct volume_s* vol, void* memory, u32 size) {
+	fat_lock(vol);
+	fstatus result = volume_index_attach_locked(vol, memory, size);
+	fat_unlock(vol);
+	return result;
+}
+
+static fstatus volume_index_attach_locked(struct volume_s* vol, void* memory,
+	u32 size) {
+	u32 slots = size / FAT_DIR_INDEX_CNT / sizeof(struct dir_hash_s);
+	if (memory && (slots < 4)) {
+		return FSTATUS_ERROR;
+	}
+	
+	struct dir_hash_s* base = (struct dir_hash_s *)memory;
+	for (u32 i = 0; i < FAT_DIR_INDEX_CNT; i++) {
+		struct dir_index_s* index = &vol->dir_index[i];
+		
+		index->slots = (memory) ? base + i * slots : NULL;
+		index->size = (memory) ? slots : 0;
+		index->count = 0;
+		index->start_sect = 0;
+		index->stamp = 0;
+		index->complete = 0;
+	}
+	vol->index_tick = 0;
+	return FSTATUS_OK;
+}
+
+/// Attach a write buffer used to merge consecutive dirty sectors into larger
+/// disk writes. The memory is owned by the user and must hold at least two 
+/// sectors. It must stay valid until the volume is ejected or the buffer is 
+/// detached by passing NULL
+fstatus volume_write_attach(struct volume_s* vol, u8* buffer, u32 size) {
+	fat_lock(vol);
+	fstatus result = volume_write_attach_locked(vol, buffer, size);
+	fat_unlock(vol);
+	return result;
+}
+
+static fstatus volume_write_attach_locked(struct volume_s* vol, u8* buffer,
+	u32 size) {
+	u32 count = size >> fat_sect_shift(vol);
+	if (buffer && (count < 2)) {
+		return FSTATUS_ERROR;
+	}
+	vol->wbuf = buffer;
+	vol->wbuf_cnt = (buffer) ? count : 0;
+	return FSTATUS_OK;
+}
+
+/// Copies the I/O statistics of `vol` into `stats`. The counters are cleared
+/// afterwards if `reset` is set. The partition discovery in `disk_mount` is 
+/// not counted. Returns FSTATUS_ERROR if the driver is built without 
+/// FAT_STATS
+fstatus volume_get_stats(struct volume_s* vol, struct fat_stats_s* stats, 
+	u8 reset) {
+	fat_lock(vol);
+	fstatus result = volume_get_stats_locked(vol, stats, reset);
+	fat_unlock(vol);
+	return result;
+}
+
+static fstatus volume_get_stats_locked(struct volume_s* vol,
+	struct fat_stats_s* stats, u8 reset) {
+#if FAT_STATS
+	vol->stats.cache_hits = vol->cache.hits;
+	vol->stats.cache_misses = vol->cache.misses;
+	vol->stats.fat_hits = vol->fat_cache.hits;
+	vol->stats.fat_misses = vol->fat_cache.misses;
+	*stats = vol->stats;
+	
+	if (reset) {
+		struct fat_stats_s empty = { 0 };
+		vol->stats = empty;
+		vol->cache.hits = 0;
+		vol->cache.misses = 0;
+		vol->fat_cache.hits = 0;
+		vol->fat_cache.misses = 0;
+	}
+	return FSTATUS_OK;
+#else
+	(void)vol;
+	(void)stats;
+	(void)reset;
+	return FSTATUS_ERROR;
+#endif
+}
+
+/// Formats the volume to a blank FAT32 volume in its partition. The FAT and 
+/// the root directory are cleared with large writes from one zeroed buffer,
+/// which are queued on the disk so several are in flight at the same time. A
+/// normal format also erases the data region, with the erase command of the
+/// disk if it has one. All files on the volume must be closed, and the 
+/// bitmap, name index and write buffer have to be attached again afterwards.
+/// Without an explicit alignment the data region is aligned to the allocation
+/// unit of the disk
+fstatus volume_format(struct volume_s* vol, struct fat_fmt_s* fmt) {
+	fat_lock(vol);
+	fstatus result = volume_format_locked(vol, fmt);
+	fat_unlock(vol);
+	return result;
+}
+
+static fstatus volume_format_locked(struct volume_s* vol, 
+	struct fat_fmt_s* fmt) {
+	u32 sector_size = fat_sect_size(vol);
+	u32 lba = vol->part_lba;
+	u32 total = vol->total_size;
+	
+	// The lookup table gives the cluster size in 512 byte sectors
+	u32 clust_size;
+	if (fmt->allocation_size) {
+		clust_size = fmt->allocation_size / sector_size;
+	} else {
+		// The table thresholds are counts of 512 byte sectors, and the last
+		// entry covers everything larger
+		u64 total_512 = (u64)total * (sector_size / 512);
+		u32 last = sizeof(cluster_size_lut) / sizeof(cluster_size_lut[0]) - 1;
+		u32 i = 0;
+		while ((i < last) && (total_512 > cluster_size_lut[i].sector_cnt)) {
+			i++;
+		}
+		clust_size = cluster_size_lut[i].clust_size * 512 / sector_size;
+		if (cluster_size_lut[i].clust_size && (clust_size == 0)) {
+			clust_size = 1;
+		}
+	}
+	if ((clust_size == 0) || (clust_size > 128) || 
+		(clust_size & (clust_size - 1))) {
+		return FSTATUS_ERROR;
+	}
+	
+	// The FAT must have room for all data clusters plus the two reserved
+	// entries. The reserved region is then grown so the data region starts 
+	// on an erase block boundary. This can only make the data region smaller
+	u32 rsvd_cnt = 32;
+	u32 entries = sector_size / 4;
+	u32 fat_size = (total - rsvd_cnt + 2 * clust_size + 
+		clust_size * entries + 1) / (clust_size * entries + 2);
+	u32 align = fmt->allignment / sector_size;
+	if (fmt->allignment == 0) {
+		align = vol->au_size;
+	}
+	if (align > 1) {
+		u32 data_lba = lba + rsvd_cnt + 2 * fat_size;
+		rsvd_cnt += (align - (data_lba % align)) % align;
+	}
+	u32 data_offset = rsvd_cnt + 2 * fat_size;
+	if ((rsvd_cnt > 0xFFFF) || (data_offset + clust_size > total)) {
+		return FSTATUS_ERROR;
+	}
+	u32 cluster_cnt = (total - data_offset) / clust_size;
+	if (cluster_cnt < 65525) {
+		return FSTATUS_ERROR;
+	}
+	
+	// Everything cached belongs to the old file system
+	fat_cache_init(vol);
+	vol->bitmap = NULL;
+	
+	// Use the caller buffer for the zero writes, or one cache sector
+	u8* zero = fmt->buffer;
+	u32 zero_sect = fmt->buffer_size / sector_size;
+	if ((zero == NULL) || (zero_sect == 0)) {
+		zero = vol->cache_mem[0].buffer;
+		zero_sect = 1;
+	}
+	if (zero_sect > FAT_MAX_TRANSFER) {
+		zero_sect = FAT_MAX_TRANSFER;
+	}
+	for (u32 i = 0; i < zero_sect * sector_size; i++) {
+		zero[i] = 0;
+	}
+	
+	// A normal format clears the data region. The erase command is used if 
+	// the disk has one, since it is much faster and frees the flash blocks
+	if (!fmt->quick_format) {
+		if (!disk_erase(vol->disk, lba + data_offset, total - data_offset) &&
+			!fat_format_clear(vol, lba + data_offset, total - data_offset,
+			zero, zero_sect)) {
+			return FSTATUS_ERROR;
+		}
+	}
+	
+	// The reserved region and both FATs are contiguous. The root directory
+	// is the first cluster in the data region
+	if (!fat_format_clear(vol, lba, data_offset, zero, zero_sect) ||
+		!fat_format_clear(vol, lba + data_offset, clust_size, zero, 
+		zero_sect)) {
+		return FSTATUS_ERROR;
+	}
+	
+	// Boot sector and its backup
+	u8* sect = vol->cache_mem[0].buffer;
+	for (u32 i = 0; i < sector_size; i++) {
+		sect[i] = 0;
+	}
+	sect[BPB_JUMP_BOOT + 0] = 0xEB;
+	sect[BPB_JUMP_BOOT + 1] = 0x58;
+	sect[BPB_JUMP_BOOT + 2] = 0x90;
+	fat_memcpy("MSWIN4.1", sect + BPB_OEM, 8);
+	fat_store16(sect + BPB_SECTOR_SIZE, sector_size);
+	sect[BPB_CLUSTER_SIZE] = clust_size;
+	fat_store16(sect + BPB_RSVD_CNT, rsvd_cnt);
+	sect[BPB_NUM_FATS] = 2;
+	sect[BPB_MEDIA] = 0xF8;
+	fat_store16(sect + BPB_SEC_PER_TRACK, 63);
+	fat_store16(sect + BPB_NUM_HEADS, 255);
+	fat_store32(sect + BPB_HIDD_SECT, lba);
+	fat_store32(sect + BPB_TOT_SECT_32, total);
+	fat_store32(sect + BPB_32_FAT_SIZE, fat_size);
+#if FAT_MIRROR == FAT_MIRROR_SINGLE
+	fat_store16(sect + BPB_32_EXT_FLAGS, EXT_FLAGS_NO_MIRROR);
+#endif
+	fat_store32(sect + BPB_32_ROOT_CLUST, 2);
+	fat_store16(sect + BPB_32_FSINFO, 1);
+	fat_store16(sect + BPB_32_BOOT_SECT, 6);
+	sect[BPB_32_DRV_NUM] = 0x80;
+	sect[BPB_32_BOOT_SIG] = 0x29;
+	fat_store32(sect + BPB_32_VOL_ID, disk_get_time() ^ lba);
+	fat_memcpy("NO NAME    ", sect + BPB_32_VOL_LABEL, 11);
+	fat_memcpy("FAT32   ", sect + BPB_32_FSTYPE, 8);
+	fat_store16(sect + MBR_BOOT_SIG, MBR_BOOT_SIG_VALUE);
+	if (!fat_disk_write(vol, sect, lba, 1) || 
+		!fat_disk_write(vol, sect, lba + 6, 1)) {
+		return FSTATUS_ERROR;
+	}
+	
+	// The volume is set up from the new boot sector before it is reused
+	fat_volume_setup(vol, sect, lba);
+	
+	// FSinfo sector and its backup. The root directory uses cluster 2
+	for (u32 i = 0; i < sector_size; i++) {
+		sect[i] = 0;
+	}
+	fat_store32(sect + INFO_LEAD_SIG, INFO_LEAD_SIG_VALUE);
+	fat_store32(sect + INFO_STRUCT_SIG, INFO_STRUCT_SIG_VALUE);
+	fat_store32(sect + INFO_CLUST_CNT, vol->cluster_cnt - 1);
+	fat_store32(sect + INFO_NEXT_FREE, 3);
+	fat_store32(sect + INFO_TRAIL_SIG, INFO_TRAIL_SIG_VALUE);
+	if (!fat_disk_write(vol, sect, lba + 1, 1) || 
+		!fat_disk_write(vol, sect, lba + 7, 1)) {
+		return FSTATUS_ERROR;
+	}
+	
+	// First sector in both FATs with the media entry, the EOC entry and the
+	// end of the root directory chain
+	for (u32 i = 0; i < sector_size; i++) {
+		sect[i] = 0;
+	}
+	fat_store32(sect + 0, 0x0FFFFFF8);
+	fat_store32(sect + 4, 0x0FFFFFFF);
+	fat_store32(sect + 8, 0x0FFFFFFF);
+	if (!fat_disk_write(vol, sect, vol->fat_lba, 1) || 
+		!fat_disk_write(vol, sect, vol->fat_lba + fat_size, 1)) {
+		return FSTATUS_ERROR;
+	}
+	
+	// The cache buffer was used outside the cache
+	fat_cache_init(vol);
+	return volume_get_label_locked(vol, vol->label);
+}
+
+/// Open a directory specified by `path`. The `dir` object will point to this
+/// directory
+fstatus fat_dir_open(struct dir_s* dir, const char* path, u16 length) {
+	// The volume is determined from the first character
+	struct volume_s* vol = volume_get(path[0]);
+	if (vol == NULL) {
+		return FSTATUS_NO_VOLUME;
+	}
+	fat_lock(vol);
+	fstatus result = fat_follow_path(dir, path, length);
+	fat_unlock(vol);
+	return result;
+}
+
+/// Close an open directory
+fstatus fat_dir_close(struct dir_s* dir) {
+	fat_lock(dir->vol);
+	fstatus result = fat_dir_close_locked(dir);
+	fat_unlock(dir->vol);
+	return result;
+}
+
+static fstatus fat_dir_close_locked(struct dir_s* dir) {
+	// Check if the volume is clean
+	if (!fat_sync(dir->vol)) {
+		return FSTATUS_ERROR;
+	}
+	return FSTATUS_OK;
+}
+
+/// Read one entry pointed to by `dir` and move the directory pointer to the
+/// next directory entry
+fstatus fat_dir_read(struct dir_s* dir, struct info_s* info) {
+	fat_lock(dir->vol);
+	fstatus result = fat_dir_read_locked(dir, info);
+	fat_unlock(dir->vol);
+	return result;
+}
+
+static fstatus fat_dir_read_locked(struct dir_s* dir, struct info_s* info) {
+	u8 lfn_crc = 0;
+	u8 name_length = 0;
+	u8 lfn_valid = 1;
+	
+	while (1) {
+		if (!fat_read(dir->vol, dir->sector)) {
+			return FSTATUS_ERROR;
+		}
+		u8* entry_ptr = dir->vol->buffer + dir->rw_offset;
+		
+		// Check if the entry is in use
+		u8 sfn_check = entry_ptr[0];
+		
+		// Check for the end marker
+		if (sfn_check == 0x00) {
+			return FSTATUS_EOF;
+		}
+		if ((sfn_check != 0xE5) && (sfn_check != 0x05)) {
+			u8 sfn_attr = entry_ptr[SFN_ATTR];
+			
+			// Check if the directory entry is a LFN or a SFN
+			if ((sfn_attr & ATTR_LFN) == ATTR_LFN) {
+				
+				// LFN case
+				u32 name_offset = 13 * ((entry_ptr[0] & LFN_SEQ_MSK) - 1);
+				for (u8 i = 0; i < 13; i++) {
+					u8 tmp_char = entry_ptr[lfn_lut[i]]; 
+					if (!((tmp_char == 0x00) || (tmp_char == 0xFF))) {
+						if (name_offset + i >= sizeof(info->name)) {
+							lfn_valid = 0;
+							break;
+						}
+						info->name[name_offset + i] = tmp_char;
+						name_length++;
+					}
+				}
+				lfn_crc = entry_ptr[LFN_CRC];
+			} else {
+				if (lfn_crc) {
+					// This SFN entry is the last entry in a chain of
+					// LFN entries. Return CRC error if the checksum is wrong
+					if (lfn_crc != fat_dir_sfn_crc(entry_ptr)) {
+						return FSTATUS_ERROR;
 					}
 				}
-				if (match) {
-					// Update the `dir` pointer
-					dir->cluster = (fat_load16(buffer + rw_offset +
-						SFN_CLUSTH) << 16) | fat_load16(buffer +
-						rw_offset + SFN_CLUSTL);
-					dir->sector = fat_clust_to_sect(dir->vol, dir->cluster);
-					dir->start_sect = dir->sector;
-					dir->size = fat_load32(buffer + rw_offset + SFN_FILE_SIZE);
-					dir->rw_offset = 0;
+				if (!lfn_crc || !lfn_valid) {
+					// The directory contains only one SFN entry, or the long
+					// name does not fit in the name buffer
+					name_length = 0;
+					for (u8 i = 0; i < 11; i++) {
+						info->name[i] = entry_ptr[i];
+						name_length++;
+					}
+				}
+				
+				// In any case the last SFN entry will contain the information
+				// about the directory
+				info->attribute = entry_ptr[SFN_ATTR];
+				info->c_time_tenth = entry_ptr[SFN_CTIME_TH];
+				info->c_time = fat_load16(entry_ptr + SFN_CTIME);
+				info->c_date = fat_load16(entry_ptr + SFN_CDATE);
+				info->w_time = fat_load16(entry_ptr + SFN_WTIME);
+				info->w_date = fat_load16(entry_ptr + SFN_WDATE);
+				info->a_date = fat_load16(entry_ptr + SFN_ADATE);
+				info->size = fat_load32(entry_ptr + SFN_FILE_SIZE);
+				info->name_length = name_length;
+				
+				// Make `dir` point to the next entry
+				fat_dir_get_next(dir);
+				
+				return FSTATUS_OK;
+			}
+		}
+		// Get the next entry
+		fat_dir_get_next(dir);
+	}
+}
 
-					return 1;
+/// Stores the current position of `dir` in `pos`. After `fat_dir_read` or 
+/// `fat_dir_read_many` it points to the first entry not returned yet
+fstatus fat_dir_tell(struct dir_s* dir, struct dir_pos_s* pos) {
+	fat_lock(dir->vol);
+	pos->start_sect = dir->start_sect;
+	pos->cluster = dir->cluster;
+	pos->sector = dir->sector;
+	pos->rw_offset = dir->rw_offset;
+	
+	// At the end of the directory the pointer can be past the last cluster,
+	// and there is no entry to check
+	fstatus result = FSTATUS_OK;
+	pos->lfn_start = 0;
+	if ((dir->sector - fat_clust_to_sect(dir->vol, dir->cluster) < 
+		dir->vol->cluster_size) && !fat_dir_lfn_start(dir, &pos->lfn_start)) {
+		result = FSTATUS_ERROR;
+	}
+	fat_unlock(dir->vol);
+	return result;
+}
+
+/// Moves `dir` to a position stored by `fat_dir_tell`. The directory may have
+/// been closed and opened again in between, so a paged listing costs the same
+/// for every page. Only the directory cluster chain is followed to check that
+/// the position belongs to `dir`
+fstatus fat_dir_seek(struct dir_s* dir, const struct dir_pos_s* pos) {
+	fat_lock(dir->vol);
+	fstatus result = fat_dir_set_index(dir, pos) ? FSTATUS_OK : FSTATUS_ERROR;
+	fat_unlock(dir->vol);
+	return result;
+}
+
+/// Reads up to `max` entries from `dir` into `entries` in one pass over each 
+/// directory sector. Names are stored zero terminated in the `names` arena of
+/// `names_size` bytes. Volume labels are skipped, and `filter` can limit the
+/// result to files or directories. The number of entries read is returned in
+/// `count`. Returns FSTATUS_EOF when the end of the directory is reached, and
+/// FSTATUS_OK when `entries` or `names` is full and more entries might follow.
+/// FSTATUS_ERROR is returned if not even one entry fits
+fstatus fat_dir_read_many(struct dir_s* dir, struct dir_entry_s* entries,
+	u32 max, char* names, u32 names_size, dir_filter_e filter, u32* count) {
+	fat_lock(dir->vol);
+	fstatus result = fat_dir_read_many_locked(dir, entries, max, names,
+		names_size, filter, count);
+	fat_unlock(dir->vol);
+	return result;
+}
+
+static fstatus fat_dir_read_many_locked(struct dir_s* dir,
+	struct dir_entry_s* entries, u32 max, char* names, u32 names_size,
+	dir_filter_e filter, u32* count) {
+	
+	struct volume_s* vol = dir->vol;
+	u32 names_used = 0;
+	u32 lfn_length = 0;
+	u8 lfn_crc = 0;
+	*count = 0;
+	
+	// Position of the first entry in the current LFN chain. If a result does
+	// not fit, `dir` is moved back here so the next call starts at the chain
+	struct dir_s chain = *dir;
+	
+	while (1) {
+		if (!fat_read(vol, dir->sector)) {
+			return FSTATUS_ERROR;
+		}
+		
+		// All entries in the sector are parsed from the same buffer
+		for (; dir->rw_offset < vol->sector_size; dir->rw_offset += 32) {
+			const u8* entry = vol->buffer + dir->rw_offset;
+			
+			// Check for the EOD marker
+			if (entry[0] == 0x00) {
+				return FSTATUS_EOF;
+			}
+			if ((entry[0] == 0xE5) || (entry[0] == 0x05)) {
+				lfn_crc = 0;
+				continue;
+			}
+			if ((entry[SFN_ATTR] & ATTR_LFN) == ATTR_LFN) {
+				
+				// The LFN fragments are collected in the volume LFN buffer
+				u8 seq = entry[LFN_SEQ] & LFN_SEQ_MSK;
+				if (entry[LFN_SEQ] & 0x40) {
+					chain = *dir;
+					lfn_length = fat_dir_lfn_length(entry);
+				}
+				if (seq && (13 * seq <= sizeof(vol->lfn))) {
+					for (u8 i = 0; i < 13; i++) {
+						vol->lfn[13 * (seq - 1) + i] = entry[lfn_lut[i]];
+					}
 				}
-				lfn_match = 1;
+				lfn_crc = entry[LFN_CRC];
+				continue;
+			}
+			
+			// Without a valid LFN chain the entry starts at the SFN
+			u8 attribute = entry[SFN_ATTR];
+			if (!lfn_crc || (lfn_crc != fat_dir_sfn_crc(entry)) ||
+				(lfn_length > sizeof(vol->lfn))) {
+				lfn_crc = 0;
+				chain = *dir;
+			}
+			if ((attribute & ATTR_VOL_LABEL) ||
+				((filter == DIR_FILTER_FILES) && (attribute & ATTR_DIR)) ||
+				((filter == DIR_FILTER_DIRS) && !(attribute & ATTR_DIR))) {
 				lfn_crc = 0;
+				continue;
+			}
+			
+			// Stop before the entry if there is no room for it
+			char sfn_name[12];
+			u32 length = lfn_crc ? lfn_length : 
+				fat_dir_sfn_name(entry, sfn_name);
+			if ((*count >= max) || (names_used + length + 1 > names_size)) {
+				*dir = chain;
+				return (*count) ? FSTATUS_OK : FSTATUS_ERROR;
 			}
+			
+			char* name = names + names_used;
+			fat_memcpy(lfn_crc ? vol->lfn : sfn_name, name, length);
+			name[length] = '\0';
+			
+			struct dir_entry_s* info = &entries[(*count)++];
+			info->name_offset = names_used;
+			info->name_length = (u8)length;
+			info->attribute = attribute;
+			info->size = fat_load32(entry + SFN_FILE_SIZE);
+			info->cluster = (fat_load16(entry + SFN_CLUSTH) << 16) |
+				fat_load16(entry + SFN_CLUSTL);
+			info->c_time = fat_load16(entry + SFN_CTIME);
+			info->c_date = fat_load16(entry + SFN_CDATE);
+			info->a_date = fat_load16(entry + SFN_ADATE);
+			info->w_time = fat_load16(entry + SFN_WTIME);
+			info->w_date = fat_load16(entry + SFN_WDATE);
+			names_used += length + 1;
+			lfn_crc = 0;
 		}
-		// Get the next 32-byte directory entry
+		
+		// Move to the first entry in the next sector of the directory
+		dir->rw_offset -= 32;
 		if (!fat_dir_get_next(dir)) {
-			return 0;
+			return FSTATUS_EOF;
+		}
+	}
+}
+
+/// Make a new directory in the specified `path`
+fstatus fat_dir_make(const char* path) {
+	return FSTATUS_OK;
+}
+
+/// Rename a directory item
+fstatus fat_dir_rename(struct dir_s* dir, const char* name, u8 length) {
+	fat_lock(dir->vol);
+	fstatus result = fat_dir_rename_locked(dir, name, length);
+	fat_unlock(dir->vol);
+	return result;
+}
+
+static fstatus fat_dir_rename_locked(struct dir_s* dir, const char* name,
+	u8 length) {
+	
+	// The parent directory of the entry is not known, so all name indexes and
+	// cached paths on the volume are removed
+	fat_dir_index_drop(dir->vol, 0);
+	fat_path_drop(dir->vol);
+	
+	// Get the lenght of the name
+	u8 name_length = 0;
+	for (u8 i = 0; i < length; i++) {
+		if ((name[i] == '.') && (i != 0)) {
+			break;
+		}
+		name_length++;
+	}
+	
+	print("Name length: %d\n", name_length);
+	u8 entries_req = 1;
+	if (name_length > 8) {
+		entries_req = (length / 13) - 1;
+	}
+	
+	// Check the number of entries pointed to by dir
+	if (!fat_read(dir->vol, dir->sector)) {
+		return FSTATUS_ERROR;
+	}
+	u8 entries_pres = 1;
+	if ((dir->vol->buffer[dir->rw_offset + SFN_ATTR] & ATTR_LFN) == ATTR_LFN) {
+		entries_pres = (dir->vol->buffer[dir->rw_offset] & LFN_SEQ_MSK) + 1;
+	}
+	
+	if (entries_req > entries_pres) {
+		// Allocate a chain of entries
+		
+	} else {
+		// Enough entry are present
+	}
+	print("Ent req: %d\nEnt pres: %d\n", entries_req, entries_pres);
+	return FSTATUS_OK;
+}
+
+/// Open a file and return the file object. It takes in a global path.
+fstatus fat_file_open(struct file_s* file, const char* path, u16 length) {
+	// The volume is determined from the first character
+	struct volume_s* vol = volume_get(path[0]);
+	if (vol == NULL) {
+		return FSTATUS_NO_VOLUME;
+	}
+	fat_lock(vol);
+	fstatus result = fat_file_open_locked(file, path, length);
+	fat_unlock(vol);
+	return result;
+}
+
+static fstatus fat_file_open_locked(struct file_s* file, const char* path,
+	u16 length) {
+	// Make a pointer to the directory where the file is stored
+	struct dir_s dir;
+	fstatus status = fat_follow_path(&dir, path, length);
+	if (status != FSTATUS_OK) {
+		return status;
+	}
+	
+	// Grab the last name fragment which will be the file name
+	const char* char_ptr = path + length - 1;
+	if (*char_ptr == 0x00) return FSTATUS_PATH_ERR;
+	if (*char_ptr == '/') {
+		char_ptr--;
+	}
+	u8 frag_size = 0;
+	
+	while ((*char_ptr != '/') && (*char_ptr != 0x00)) {
+		frag_size++;
+		char_ptr--;
+	}
+	if (*char_ptr == 0x00) {
+		return FSTATUS_PATH_ERR;
+	}
+	
+	// Try to find the file in the directory pointed to by `dir`
+	if (!fat_dir_search(&dir, char_ptr + 1, frag_size)) {
+		return FSTATUS_PATH_ERR;
+	}
+	
+	// Update whe address of the file. An empty file might not have a cluster
+	if (dir.cluster == 0) {
+		dir.sector = 0;
+	}
+	file->sector = dir.sector;
+	file->start_sect = dir.sector;
+	file->cluster = dir.cluster;
+	file->entry_lba = dir.entry_lba;
+	file->entry_offset = dir.entry_offset;
+	file->rw_offset = 0;
+	file->glob_offset = 0;
+	file->vol = dir.vol;
+	file->size = dir.size;
+	file->map = NULL;
+	file->map_cnt = 0;
+	file->dirty = 0;
+	file->clust_cnt = 0;
+	file->last_cluster = 0;
+	file->pending = 0;
+	file->req_status = 1;
+	file->req.count = 0;
+	file->ra = NULL;
+	return FSTATUS_OK;
+}
+
+/// Closes a currently open file object
+fstatus fat_file_close(struct file_s* file) {
+	return fat_file_flush(file);
+}
+
+/// Commits all pending changes on the file and its volume to the storage 
+/// device. The file size and write time are stored in the directory entry
+fstatus fat_file_flush(struct file_s* file) {
+	fat_lock(file->vol);
+	fstatus result = fat_file_flush_locked(file);
+	fat_unlock(file->vol);
+	return result;
+}
+
+static fstatus fat_file_flush_locked(struct file_s* file) {
+	struct volume_s* vol = file->vol;
+	
+	// The file size must not be committed before the data is written
+	if (fat_file_wait(file) != FSTATUS_OK) {
+		return FSTATUS_ERROR;
+	}
+	
+	// No prefetch may target the caller buffer after the file is closed
+	fat_file_ra_reset(file);
+	if (file->dirty) {
+		if (!fat_read(vol, file->entry_lba)) {
+			return FSTATUS_ERROR;
+		}
+		u8* entry = vol->buffer + file->entry_offset;
+		fat_store32(entry + SFN_FILE_SIZE, file->size);
+		entry[SFN_ATTR] |= ATTR_ARCH;
+		
+		// The time is only updated if the system has a clock
+		u32 time = disk_get_time();
+		if (time) {
+			fat_store16(entry + SFN_WTIME, (u16)time);
+			fat_store16(entry + SFN_WDATE, (u16)(time >> 16));
+			fat_store16(entry + SFN_ADATE, (u16)(time >> 16));
 		}
+		fat_mark_dirty(vol);
+		file->dirty = 0;
 	}
-	return 0;
+	if (!fat_sync(vol)) {
+		return FSTATUS_ERROR;
+	}
+	return FSTATUS_OK;
 }
 
-/// Follows the `path` and returns the `dir` object pointing to the last found 
-/// folder. If not found the functions returns `0`, but the `dir` object may
-/// still be changed
-/// 
-/// Path should be on the form: C:/home/usr/bin/chrome.exe
-static fstatus fat_follow_path(struct dir_s* dir, const char* path, u32 length) {
+/// Reads `count` number of bytes from the file (at whatever position `file` is
+/// pointing to). It returns the `status` field which contains the number of
+/// bytes written. If the `count` and `status` does not match the EOF marker
+/// has been hit.
+///
+/// Only the unaligned head and tail of the request goes through the volume 
+/// buffer. Whole sectors are read straight into `buffer` with one multi-sector
+/// command for each contiguous run of clusters
+fstatus fat_file_read(struct file_s* file, u8* buffer, u32 count, u32* status) {
+	fat_lock(file->vol);
+	fstatus result = fat_file_read_locked(file, buffer, count, status);
+	fat_unlock(file->vol);
+	return result;
+}
+
+static fstatus fat_file_read_locked(struct file_s* file, u8* buffer, u32 count,
+	u32* status) {
+	*status = 0;
+	struct volume_s* vol = file->vol;
+	u32 sector_size = fat_sect_size(vol);
+	u32 sector_shift = fat_sect_shift(vol);
 	
-	// Volume object is determined from the first character
-	struct volume_s* vol = volume_get(*path++);
-	if (vol == NULL) {
-		return FSTATUS_NO_VOLUME;
+	if (fat_file_wait(file) != FSTATUS_OK) {
+		return FSTATUS_ERROR;
 	}
-	// Rewind the `dir` object to the root directory
-	dir->vol = vol;
-	dir->start_sect = dir->sector = vol->root_lba;
-	dir->cluster = fat_clust_to_sect(vol, vol->root_lba);
-	dir->rw_offset = 0;
 	
-	// Check for the colon
-	if (*path++ != ':') {
-		return FSTATUS_PATH_ERR;
+	// Never read past the end of the file
+	if (file->glob_offset >= file->size) {
+		return FSTATUS_OK;
 	}
-	if (*path != '/') {
-		return FSTATUS_PATH_ERR;
+	if (count > file->size - file->glob_offset) {
+		count = file->size - file->glob_offset;
 	}
 	
-	// `frag_ptr` and `frag_size` will contain one fragment of the path name
-	const char* frag_ptr;
-	u8 frag_size;
-	while (1) {
-		
-		// Search for the first `/`
-		while (*path && (*path != '/')) {
-			path++;
+	// The read-ahead buffer is used as long as the reads are sequential
+	u8 ra_active = 0;
+	if (file->ra) {
+		ra_active = (file->ra->last_end == file->glob_offset);
+		if (!ra_active) {
+			fat_file_ra_reset(file);
 		}
-		// TODO: This is not right is it?
-		// Check if the next fragment exist
-		if (*path++ == '\0') break;
-		if (*path == '\0') break;
-		
-		// `path` points to the first character in the current name fragment
-		const char* tmp_ptr = path;
-		frag_ptr = path;
-		frag_size = 0;
+	}
+	
+	while (count) {
 		
-		while ((*tmp_ptr != '\0') && (*tmp_ptr != '/')) {
-						
-			// The current fragment describes is a file, However, the name 
-			// fragment before it has been found
-			if (*tmp_ptr == '.') {
-				return FSTATUS_OK;
+		// Resolve the address
+		if (file->rw_offset >= sector_size) {
+			if (!fat_file_addr_resolve(file)) {
+				return FSTATUS_ERROR;
 			}
-			frag_size++;
-			tmp_ptr++;
 		}
 		
-		// Now `frag_ptr` will point to the first character in the name
-		// fragment, and `frag_size` will contain the size
-
-		print("Searching for directory: " ANSI_NORMAL);
-		print_count(frag_ptr, frag_size);
-		print("\n");
-
-		// Search for a matching directory name in the current directory. If
-		// matched, the `fat_dir_search` will update the `dir` pointer as well
-		if (!fat_dir_search(dir, frag_ptr, frag_size)) {
-			print(ANSI_RED "Directory not fount\n" ANSI_NORMAL);
-			return 0;
+		u32 chunk;
+		const u8* ra_data;
+		u32 ra_length;
+		if (ra_active && fat_file_ra_get(file, &ra_data, &ra_length)) {
+			
+			// The data is in the read-ahead buffer. Slots never cross a 
+			// cluster boundary, so only the sector has to be updated
+			chunk = (count < ra_length) ? count : ra_length;
+			fat_memcpy(ra_data, buffer, chunk);
+			u32 end = file->rw_offset + chunk;
+			u32 sect_cnt = (end - 1) >> sector_shift;
+			file->sector += sect_cnt;
+			file->rw_offset = end - sect_cnt * sector_size;
+		} else if ((file->rw_offset == 0) && (count >= sector_size)) {
+			
+			// The file pointer is sector aligned, so as many whole sectors as
+			// possible are read directly into the user buffer
+			u32 sect_cnt;
+			if (!fat_file_span(file, count >> sector_shift, &sect_cnt)) {
+				return FSTATUS_ERROR;
+			}
+			
+			// The volume cache might hold modified copies of the sectors. 
+			// Write them back so the storage device is up to date
+			if (!fat_flush_range(vol, file->sector, sect_cnt)) {
+				return FSTATUS_ERROR;
+			}
+			
+			// The transfer does not touch any volume state, so other files
+			// can use the volume in the meantime
+			fat_unlock(vol);
+			u32 start = fat_stat_clock();
+			u8 ok = disk_read(vol->disk, buffer, file->sector, sect_cnt);
+			u32 cycles = fat_stat_clock() - start;
+			fat_lock(vol);
+			fat_stat_io(vol, 0, sect_cnt, cycles);
+			if (!ok) {
+				return FSTATUS_ERROR;
+			}
+			
+			// Make the file point to the end of the last sector read. The next
+			// address resolve will move it to the following sector
+			chunk = sect_cnt * sector_size;
+			file->sector += sect_cnt - 1;
+			file->cluster = fat_sect_to_clust(vol, file->sector);
+			file->rw_offset = sector_size;
+		} else {
+			
+			// Partial sector. Copy the data from the volume buffer
+			if (!fat_read(vol, file->sector)) {
+				return FSTATUS_ERROR;
+			}
+			chunk = sector_size - file->rw_offset;
+			if (chunk > count) {
+				chunk = count;
+			}
+			fat_memcpy(vol->buffer + file->rw_offset, buffer, chunk);
+			file->rw_offset += chunk;
 		}
-	}	
+		
+		// Update the offsets
+		buffer += chunk;
+		count -= chunk;
+		file->glob_offset += chunk;
+		*status += chunk;
+	}
+	if (file->ra) {
+		file->ra->last_end = file->glob_offset;
+	}
 	return FSTATUS_OK;
 }
 
-/// Get the volume label stored in the root directory. This is the one used by
-/// Microsoft, not the BPB volume ID
-static fstatus fat_get_vol_label(struct volume_s* vol, char* label) {	
-	// Make a directory object pointing to the root directory
-	struct dir_s dir;
-	dir.sector = vol->root_lba;
-	dir.rw_offset = 0;
-	dir.cluster = fat_sect_to_clust(vol, dir.sector);
+/// Write a number of characters to the location pointed to be file. All 
+/// clusters needed are allocated up front. Whole sectors are written straight
+/// from `buffer` with multi-sector commands, while partial sectors are 
+/// buffered in the volume cache. The directory entry is updated on flush
+fstatus fat_file_write(struct file_s* file, const u8* buffer, u32 count) {
+	fat_lock(file->vol);
+	fstatus result = fat_file_write_locked(file, buffer, count);
+	fat_unlock(file->vol);
+	return result;
+}
+
+static fstatus fat_file_write_locked(struct file_s* file, const u8* buffer,
+	u32 count) {
+	struct volume_s* vol = file->vol;
+	u32 sector_size = fat_sect_size(vol);
+	u32 sector_shift = fat_sect_shift(vol);
 	
-	// The volume label is a SFN entry in the root directory with bit 3 set in
-	// the attribute field. Volume label is limited to 13 uppercase characters
-	while (1) {
-		if (!fat_read(vol, dir.sector)) {
-			return FSTATUS_ERROR;
+	if (count == 0) {
+		return FSTATUS_OK;
+	}
+	if (fat_file_wait(file) != FSTATUS_OK) {
+		return FSTATUS_ERROR;
+	}
+	
+	// The prefetched data might be outdated by the write
+	fat_file_ra_reset(file);
+	
+	// The file size is limited to 4 GB
+	if (file->glob_offset + count < file->glob_offset) {
+		return FSTATUS_ERROR;
+	}
+	if (!fat_file_grow(file, file->glob_offset + count)) {
+		return FSTATUS_ERROR;
+	}
+	
+	while (count) {
+		
+		// Resolve the address
+		if (file->rw_offset >= sector_size) {
+			if (!fat_file_addr_resolve(file)) {
+				return FSTATUS_ERROR;
+			}
 		}
 		
-		// Check if the attribute is volume label
-		u8 attribute = vol->buffer[dir.rw_offset + SFN_ATTR];
-		if (attribute & ATTR_VOL_LABEL) {
+		u32 chunk;
+		if ((file->rw_offset == 0) && (count >= sector_size)) {
 			
-			// LFN file name entries are also marked with volume label
-			if ((attribute & ATTR_LFN) != ATTR_LFN) {
-				const char* src = (const char *)(vol->buffer + dir.rw_offset);
-				
-				for (u8 i = 0; i < 11; i++) {
-					*label++ = *src++;
-				}
-				return 1;
+			// Whole sectors are written directly from the user buffer
+			u32 sect_cnt;
+			if (!fat_file_span(file, count >> sector_shift, &sect_cnt)) {
+				return FSTATUS_ERROR;
+			}
+			
+			// Any cached copy of these sectors is outdated after the write
+			fat_cache_drop(vol, file->sector, sect_cnt);
+			fat_unlock(vol);
+			u32 start = fat_stat_clock();
+			u8 ok = disk_write(vol->disk, buffer, file->sector, sect_cnt);
+			u32 cycles = fat_stat_clock() - start;
+			fat_lock(vol);
+			fat_stat_io(vol, 1, sect_cnt, cycles);
+			if (!ok) {
+				return FSTATUS_ERROR;
+			}
+			
+			chunk = sect_cnt * sector_size;
+			file->sector += sect_cnt - 1;
+			file->cluster = fat_sect_to_clust(vol, file->sector);
+			file->rw_offset = sector_size;
+		} else {
+			
+			// Partial sector. A sector with no existing file data does not 
+			// have to be read from the storage device
+			u8 status;
+			if (file->glob_offset - file->rw_offset >= file->size) {
+				status = fat_read_new(vol, file->sector);
+			} else {
+				status = fat_read(vol, file->sector);
+			}
+			if (!status) {
+				return FSTATUS_ERROR;
+			}
+			chunk = sector_size - file->rw_offset;
+			if (chunk > count) {
+				chunk = count;
 			}
+			fat_memcpy(buffer, vol->buffer + file->rw_offset, chunk);
+			fat_mark_dirty(vol);
+			file->rw_offset += chunk;
 		}
-		// Get the next directory
-		if (!fat_dir_get_next(&dir)) {
-			return FSTATUS_ERROR;
+		
+		// Update the offsets
+		buffer += chunk;
+		count -= chunk;
+		file->glob_offset += chunk;
+		if (file->glob_offset > file->size) {
+			file->size = file->glob_offset;
 		}
+		file->dirty = 1;
 	}
+	return FSTATUS_OK;
 }
 
-/// Remove
-/// Print directory information
-static void fat_print_info(struct info_s* info) {
-	print(BLUE);
-	u32 size = info->size;
-	char ext = 0;	
-	u8 ext_cnt = 0;
-	while (size >= 1000) {
-		size /= 1000;
-		ext = file_size_ext[ext_cnt++];
-	}
-	print("%d", size);
-	if (ext) {
-		print("%c", ext);
-	}
-	print("B\t");
-	u16 time = info->w_time;
-	u16 date = info->w_date;
-	
-	print("%d/%d/%d %d:%d\t", 
-		date & 0b11111,
-		(date >> 5) & 0b1111,
-		((date >> 9) & 0b1111111) + 1980,
-		(time >> 11) & 0b11111,
-		(time >> 5) & 0b111111);
-		
-	if (info->attribute & ATTR_DIR) {
-		print("DIR\t");
-	} else {
-		print("\t");
-	}
-	
-	print_count(info->name, info->name_length);
-	print("\n");
+/// Starts reading up to `count` bytes without waiting for the storage device. 
+/// Whole sectors are read straight into `buffer` by one queued disk request
+/// covering at most one contiguous span. A partial sector at the file pointer
+/// is copied from the volume cache and completes at once. The number of bytes
+/// covered is returned in `status`. Returns FSTATUS_BUSY while the transfer 
+/// runs, and `buffer` is valid when `fat_file_poll` returns FSTATUS_OK. The 
+/// application can consume the previous buffer in the meantime
+fstatus fat_file_read_async(struct file_s* file, u8* buffer, u32 count, 
+	u32* status) {
+	fat_lock(file->vol);
+	fstatus result = fat_file_read_async_locked(file, buffer, count, status);
+	fat_unlock(file->vol);
+	return result;
 }
 
-
-//------------------------------------------------------------------------------
-// FAT23 file system API
-// This section will implement the file system API exposed to the user
-//------------------------------------------------------------------------------
-
-/// This is the `main` functions that is used to tast the file system
-void fat32_thread(void* arg) {
-	
-	// Configure the hardware
-	board_sd_card_config();
-	
-	// Wait for the SD card to be insterted
-	while (!board_sd_card_get_status());
-	
-	// Try to mount the disk. If this is not working the disk initialize 
-	// functions may be ehh...
-	disk_mount(DISK_SD_CARD);
+static fstatus fat_file_read_async_locked(struct file_s* file, u8* buffer,
+	u32 count, u32* status) {
+	*status = 0;
+	struct volume_s* vol = file->vol;
+	u32 sector_size = fat_sect_size(vol);
+	u32 sector_shift = fat_sect_shift(vol);
 	
-	for (u8 i = 0; i < 6; i++) {
-		print("S: %d c: %d\n", cluster_size_lut[i].clust_size, cluster_size_lut[i].sector_cnt);
+	if (fat_file_wait(file) != FSTATUS_OK) {
+		return FSTATUS_ERROR;
 	}
-	
-	struct volume_s* tmp = volume_get('C');
-	u32 cluster;
-	
-	fat_get_cluster(tmp, &cluster);
-	fat_table_set(tmp, 33, 0);
-	fat_print_table(tmp, 0);
-
-	// Print all the volumes on the system
-	print(BLUE "Displaying system volumes:\n");
-	struct volume_s* vol = volume_get_first();
-	while (vol) {
-		for (u8 i = 0; i < 11; i++) {
-			if (vol->label[i]) {
-				print("%c", vol->label[i]);
-			}
+	if (file->glob_offset >= file->size) {
+		return FSTATUS_OK;
+	}
+	if (count > file->size - file->glob_offset) {
+		count = file->size - file->glob_offset;
+	}
+	if (file->rw_offset >= sector_size) {
+		if (!fat_file_addr_resolve(file)) {
+			return FSTATUS_ERROR;
 		}
-		print(" (%c:)\n", vol->letter);
-		vol = vol->next;
 	}
-	print("\n");
 	
-	
-	// List all directories
-	struct dir_s dir;
-	fat_dir_open(&dir, "C:/alpha/", 0);
-	
-	struct info_s* info = (struct info_s *)dynamic_memory_new(DRAM_BANK_0,
-		sizeof(struct info_s));
-	fstatus status;
-	print("\nListing directories in: C:/alpha\n");
-	do {
-		status = fat_dir_read(&dir, info);
-		
-		if (fat_memcmp(info->name, "uuuuuughh.txt", info->name_length)) {
-			//fat_dir_rename(&dir, "dude", 4);
-		}
-		
-		// Print the information
-		if (status == FSTATUS_OK) {
-			fat_print_info(info);
+	// Partial sectors are served by the volume cache
+	if ((file->rw_offset != 0) || (count < sector_size)) {
+		u32 chunk = sector_size - file->rw_offset;
+		if (chunk > count) {
+			chunk = count;
 		}
-	} while (status != FSTATUS_EOF);
-	print(BLUE "- EOD -\n");
-
-	while (1) {
-		
+		return fat_file_read_locked(file, buffer, chunk, status);
+	}
+	
+	u32 sect_cnt;
+	if (!fat_file_span(file, count >> sector_shift, &sect_cnt)) {
+		return FSTATUS_ERROR;
+	}
+	if (!fat_flush_range(vol, file->sector, sect_cnt)) {
+		return FSTATUS_ERROR;
+	}
+	if (!fat_file_submit(file, buffer, sect_cnt, 0)) {
+		return FSTATUS_ERROR;
 	}
+	*status = sect_cnt * sector_size;
+	file->glob_offset += *status;
+	return FSTATUS_BUSY;
 }
 
-/// Mounts a physical disk. It checks for a valid FAT32 file system in all
-/// available disk partitions. All valid file system is dynamically allocated
-/// and added to the system volumes
-/// 
-/// Note that this is the only functions referencing the `disk` parameter. All
-/// further interactions happend will via the volume letter e.g. D: drive.
-u8 disk_mount(disk_e disk) {
-	
-	// Verify that the storage device are present
-	if (!disk_get_status(disk)) return 0;
-	
-	// Initialize the hardware and protocols
-	if (!disk_initialize(disk)) return 0;
-	
-	// Read MBR sector at LBA address zero
-	if (!disk_read(disk, mount_buffer, 0, 1)) return 0;
+/// Starts writing up to `count` bytes without waiting for the storage device.
+/// Clusters are allocated up front like in `fat_file_write`. Whole sectors are
+/// written from `buffer` by one queued disk request, and `buffer` must not be 
+/// changed until `fat_file_poll` returns FSTATUS_OK. A partial sector is 
+/// written to the volume cache and completes at once. The number of bytes 
+/// covered is returned in `status`. The file size only grows when the write 
+/// has completed
+fstatus fat_file_write_async(struct file_s* file, const u8* buffer, u32 count,
+	u32* status) {
+	fat_lock(file->vol);
+	fstatus result = fat_file_write_async_locked(file, buffer, count, status);
+	fat_unlock(file->vol);
+	return result;
+}
 
-	// Check the boot signature in the MBR
-	if (fat_load16(mount_buffer + MBR_BOOT_SIG) != MBR_BOOT_SIG_VALUE) {
-		return 0;
-	}
+static fstatus fat_file_write_async_locked(struct file_s* file,
+	const u8* buffer, u32 count, u32* status) {
+	*status = 0;
+	struct volume_s* vol = file->vol;
+	u32 sector_size = fat_sect_size(vol);
+	u32 sector_shift = fat_sect_shift(vol);
 	
-	// Retrieve the partition info from all four partitions, thus avoiding 
-	// multiple accesses to the MBR sector
-	struct partition_s partitions[4];
-	for (u8 i = 0; i < 4; i++) {
-		u32 offset = MBR_PARTITION + i * MBR_PARTITION_SIZE;
-		
-		partitions[i].lba = fat_load32(mount_buffer + offset + PAR_LBA);
-		partitions[i].size = fat_load32(mount_buffer + offset + PAR_SIZE);
-		partitions[i].type = mount_buffer[offset + PAR_TYPE];
-		partitions[i].status = mount_buffer[offset + PAR_STATUS];
+	if (count == 0) {
+		return FSTATUS_OK;
+	}
+	if (fat_file_wait(file) != FSTATUS_OK) {
+		return FSTATUS_ERROR;
+	}
+	fat_file_ra_reset(file);
+	if (file->glob_offset + count < file->glob_offset) {
+		return FSTATUS_ERROR;
+	}
+	if (!fat_file_grow(file, file->glob_offset + count)) {
+		return FSTATUS_ERROR;
+	}
+	if (file->rw_offset >= sector_size) {
+		if (!fat_file_addr_resolve(file)) {
+			return FSTATUS_ERROR;
+		}
 	}
 	
-	// Search for a valid FAT32 file systems on all valid paritions
-	for (u8 i = 0; i < 4; i++) {
-		if (partitions[i].lba) {
-			if (!disk_read(disk, mount_buffer, partitions[i].lba, 1)) {
-				return 0;
-			}
-			
-			// Check if the current partition contains a FAT32 file system
-			if (fat_search(mount_buffer)) {
-				
-				// Allocate the file system structure
-				struct volume_s* vol = (struct volume_s *)
-					dynamic_memory_new(DRAM_BANK_0, sizeof(struct volume_s));
-				
-				// Update FAT32 information
-				vol->sector_size = fat_load16(mount_buffer + BPB_SECTOR_SIZE);
-				vol->cluster_size = mount_buffer[BPB_CLUSTER_SIZE];
-				vol->total_size = fat_load32(mount_buffer + BPB_TOT_SECT_32);
-				
-				// Update FAT32 offsets that will be used by the driver
-				vol->fsinfo_lba = partitions[i].lba + fat_load16(mount_buffer +
-					BPB_32_FSINFO);
-				vol->fat_lba = partitions[i].lba + fat_load16(mount_buffer + 
-					BPB_RSVD_CNT);
-				vol->data_lba = vol->fat_lba + (fat_load32(mount_buffer + 
-					BPB_32_FAT_SIZE) * mount_buffer[BPB_NUM_FATS]);
-				
-				vol->root_lba = fat_clust_to_sect(vol, fat_load32(mount_buffer +
-					BPB_32_ROOT_CLUST));
-				vol->disk = disk;
-				
-				// Sector zero will not exist in any file system. This forces 
-				// the code to read the first block from the storage device
-				vol->buffer_lba = 0;
-				
-				// Get the volume label
-				fat_get_vol_label(vol, vol->label);
-
-				// Add the newly made volume to the list of system volumes
-				fat_volume_add(vol);
-			}
+	// Partial sectors are buffered in the volume cache
+	if ((file->rw_offset != 0) || (count < sector_size)) {
+		u32 chunk = sector_size - file->rw_offset;
+		if (chunk > count) {
+			chunk = count;
+		}
+		if (fat_file_write_locked(file, buffer, chunk) != FSTATUS_OK) {
+			return FSTATUS_ERROR;
 		}
+		*status = chunk;
+		return FSTATUS_OK;
 	}
-	return 1;
+	
+	u32 sect_cnt;
+	if (!fat_file_span(file, count >> sector_shift, &sect_cnt)) {
+		return FSTATUS_ERROR;
+	}
+	fat_cache_drop(vol, file->sector, sect_cnt);
+	if (!fat_file_submit(file, (u8 *)buffer, sect_cnt, 1)) {
+		return FSTATUS_ERROR;
+	}
+	// The file size grows when `fat_file_poll` collects the result
+	*status = sect_cnt * sector_size;
+	file->glob_offset += *status;
+	return FSTATUS_BUSY;
 }
 
-/// Remove the volumes corresponding with a physical disk and delete the memory.
-/// This function must be called before a storage device is unplugged, if not,
-/// cached data may be lost. 
-u8 disk_eject(disk_e disk) {
-	struct volume_s* vol = volume_get_first();
+/// Checks the asynchronous transfer on `file`. Returns FSTATUS_BUSY while it 
+/// is running, and FSTATUS_OK or FSTATUS_ERROR when it has completed. A write
+/// which completes commits the new file size. If the transfer fails the file 
+/// pointer is moved back to where it started
+fstatus fat_file_poll(struct file_s* file) {
+	struct volume_s* vol = file->vol;
+	if (file->pending) {
+		disk_poll(vol->disk);
+		if (file->pending) {
+			return FSTATUS_BUSY;
+		}
+	}
 	
-	while (vol != NULL) {
-		
-		// Remove all volumes which matches the `disk` number
-		if (vol->disk == disk) {
-			if (!fat_volume_remove(vol->letter)) {
-				return 0;
+	// The result is reported once. Every other file call waits for it first,
+	// so the file pointer is still at the end of the transfer
+	u8 status = file->req_status;
+	file->req_status = 1;
+	if (file->req.count) {
+		if (!status) {
+			file->glob_offset -= file->req.count << fat_sect_shift(vol);
+			file->sector = file->req.lba;
+			file->cluster = fat_sect_to_clust(vol, file->req.lba);
+			file->rw_offset = 0;
+		} else if (file->req.write) {
+			if (file->glob_offset > file->size) {
+				file->size = file->glob_offset;
 			}
-			dynamic_memory_free(vol);
+			file->dirty = 1;
 		}
-		vol = vol->next;
+		file->req.count = 0;
 	}
-	return 1;
+	return status ? FSTATUS_OK : FSTATUS_ERROR;
 }
 
-/// Get the first volume in the system. If no volumes are present it return
-/// NULL
-struct volume_s* volume_get_first(void) {
-	return volume_base;
+/// Waits for the asynchronous transfer on `file` to complete
+fstatus fat_file_wait(struct file_s* file) {
+	fstatus status;
+	do {
+		status = fat_file_poll(file);
+	} while (status == FSTATUS_BUSY);
+	return status;
 }
 
-/// Get a volume based on its letter
-struct volume_s* volume_get(char letter) {
+/// Move the read / write file pointer. The offset is cumputed with respect 
+/// to the file start address. With an extent map attached, the seek is a
+/// binary search in the map and only the unmapped part of the chain is read
+/// from the FAT
+fstatus fat_file_jump(struct file_s* file, u32 offset) {
+	fat_lock(file->vol);
+	fstatus result = fat_file_jump_locked(file, offset);
+	fat_unlock(file->vol);
+	return result;
+}
+
+static fstatus fat_file_jump_locked(struct file_s* file, u32 offset) {
+	struct volume_s* vol = file->vol;
 	
-	struct volume_s* vol = volume_base;
-	while (vol != NULL) {
-		if (vol->letter == letter) {
-			return vol;
-		}
-		vol = vol->next;
+	if (fat_file_wait(file) != FSTATUS_OK) {
+		return FSTATUS_ERROR;
 	}
-	return NULL;
+	
+	// A sector aligned offset is stored as the end of the previous sector, the 
+	// same way as the read path leaves it. This way a jump to the end of a 
+	// cluster aligned file does not need the cluster after the EOC
+	u32 pos = offset;
+	if (pos && ((pos & (fat_sect_size(vol) - 1)) == 0)) {
+		pos--;
+	}
+	
+	// Get the relative offsets
+	u32 sector_offset = pos >> fat_sect_shift(vol);
+	u32 cluster_offset = sector_offset / vol->cluster_size;
+	sector_offset = sector_offset % vol->cluster_size;
+	
+	u32 cluster;
+	if (!fat_file_walk(file, cluster_offset, &cluster)) {
+		return FSTATUS_ERROR;
+	}
+	
+	// The base cluster address is determined. Update the sector and rw offset
+	// from the relative offsets calulated above. 
+	file->cluster = cluster;
+	file->sector = fat_clust_to_sect(vol, cluster) + sector_offset;
+	file->rw_offset = (pos & (fat_sect_size(vol) - 1)) + (pos != offset);
+	file->glob_offset = offset;
+	
+	return FSTATUS_OK;
 }
 
-/// Set the volume label in the BPB SFN entry
-fstatus volume_set_label(struct volume_s* vol, const char* name, u8 length) {
-	// Make a directory object pointing to the root directory
-	struct dir_s dir;
-	dir.sector = vol->root_lba;
-	dir.rw_offset = 0;
-	dir.cluster = fat_sect_to_clust(vol, dir.sector);
-	
-	while (1) {
-		if (!fat_read(vol, dir.sector)) {
-			return FSTATUS_ERROR;
+/// Follows the cluster chain of `file` to the file relative cluster `index`.
+/// The walk starts from the deepest known cluster in the extent map, and the
+/// clusters passed are added to the map
+static u8 fat_file_walk(struct file_s* file, u32 index, u32* cluster) {
+	u32 curr = 0;
+	u32 clust = fat_sect_to_clust(file->vol, file->start_sect);
+	struct extent_s* ext = fat_file_map_find(file, index);
+	if (ext) {
+		curr = index;
+		if (curr >= ext->offset + ext->length) {
+			curr = ext->offset + ext->length - 1;
 		}
-		
-		// Check if the attribute is volume label
-		u8 attribute = vol->buffer[dir.rw_offset + SFN_ATTR];
-		if (attribute & ATTR_VOL_LABEL) {
-			
-			// Check that it is not a LFN entry
-			if ((attribute & ATTR_LFN) != ATTR_LFN) {
-				char* src = (char *)(vol->buffer + dir.rw_offset);
-				for (u8 i = 0; i < 11; i++) {
-					// The volume label is padded with spaces
-					if (i >= length) {
-						*src++ = ' ';
-					} else {
-						*src++ = *name++;
-					}
-					vol->buffer_dirty = 1;
-				}
-				// Writes the buffer back to the storage device
-				// TODO: Do I need this?
-				fat_flush(vol);
-				return 1;
-			}
+		clust = ext->cluster + (curr - ext->offset);
+	}
+	
+	while (curr < index) {
+		u32 new_cluster;
+		if (!fat_table_get(file->vol, clust, &new_cluster)) {
+			return 0;
 		}
-		// Get the next directory
-		if (!fat_dir_get_next(&dir)) {
+		// Check if the FAT table entry is EOC
+		u32 eoc_value = new_cluster & 0xFFFFFFF;
+		if ((eoc_value >= 0xFFFFFF8) && (eoc_value <= 0xFFFFFFF)) {
 			return 0;
 		}
+		clust = new_cluster;
+		curr++;
+		fat_file_map_add(file, curr, clust, 1);
 	}
+	*cluster = clust;
+	return 1;
 }
 
-/// Get the volume label
-fstatus volume_get_label(struct volume_s* vol, char* name) {
-	// TODO: Hmm, this label is stored in the vol->label. Why fetch it two times
-	return fat_get_vol_label(vol, name);
+/// Walks the cluster chain of `file` to the end. `last` returns the last 
+/// cluster, and `count` the number of clusters in the chain
+static u8 fat_file_chain_end(struct file_s* file, u32* last, u32* count) {
+	u32 index = 0;
+	u32 cluster = fat_sect_to_clust(file->vol, file->start_sect);
+	
+	// The extent map gives a shortcut into the chain
+	if (file->map && file->map_cnt) {
+		struct extent_s* ext = &file->map[file->map_cnt - 1];
+		index = ext->offset + ext->length - 1;
+		cluster = ext->cluster + ext->length - 1;
+	}
+	
+	while (1) {
+		u32 new_cluster;
+		if (!fat_table_get(file->vol, cluster, &new_cluster)) {
+			return 0;
+		}
+		u32 eoc_value = new_cluster & 0xFFFFFFF;
+		if ((eoc_value >= 0xFFFFFF8) && (eoc_value <= 0xFFFFFFF)) {
+			break;
+		}
+		cluster = new_cluster;
+		index++;
+		fat_file_map_add(file, index, cluster, 1);
+	}
+	*last = cluster;
+	*count = index + 1;
+	file->last_cluster = cluster;
+	file->clust_cnt = index + 1;
+	return 1;
 }
 
-/// Formats the volume to a blank FAT32 volume
-fstatus volume_format(struct volume_s* vol, struct fat_fmt_s* fmt) {
-	return FSTATUS_OK;
+/// Gives an empty file its first cluster and stores it in the directory entry
+static u8 fat_file_set_first(struct file_s* file, u32 cluster) {
+	struct volume_s* vol = file->vol;
+	
+	if (!fat_read(vol, file->entry_lba)) {
+		return 0;
+	}
+	u8* entry = vol->buffer + file->entry_offset;
+	fat_store16(entry + SFN_CLUSTH, (u16)(cluster >> 16));
+	fat_store16(entry + SFN_CLUSTL, (u16)cluster);
+	fat_mark_dirty(vol);
+	
+	file->start_sect = fat_clust_to_sect(vol, cluster);
+	file->sector = file->start_sect;
+	file->cluster = cluster;
+	file->rw_offset = 0;
+	file->glob_offset = 0;
+	
+	if (file->map && file->map_size) {
+		file->map_cnt = 0;
+		fat_file_map_add(file, 0, cluster, 1);
+	}
+	return 1;
 }
 
-/// Open a directory specified by `path`. The `dir` object will point to this
-/// directory
-fstatus fat_dir_open(struct dir_s* dir, const char* path, u16 length) {
-	return fat_follow_path(dir, path, length);
+/// Preallocates clusters so that the file can hold `size` bytes without any
+/// further cluster allocation. The clusters are taken from the largest free
+/// runs on the volume, so the file gets as few fragments as possible. The 
+/// file size is not changed
+fstatus fat_file_reserve(struct file_s* file, u32 size) {
+	fat_lock(file->vol);
+	fstatus result = fat_file_reserve_locked(file, size);
+	fat_unlock(file->vol);
+	return result;
 }
 
-/// Close an open directory
-fstatus fat_dir_close(struct dir_s* dir) {
-	// Check if the volume is clean
-	if (!fat_flush(dir->vol)) {
+static fstatus fat_file_reserve_locked(struct file_s* file, u32 size) {
+	struct volume_s* vol = file->vol;
+	u32 clust_bytes = vol->sector_size * vol->cluster_size;
+	u32 needed = size / clust_bytes + ((size % clust_bytes) != 0);
+	
+	// Find the end of the current cluster chain
+	u32 last = file->last_cluster;
+	u32 count = file->clust_cnt;
+	if (file->start_sect && (count == 0)) {
+		if (!fat_file_chain_end(file, &last, &count)) {
+			return FSTATUS_ERROR;
+		}
+	}
+	if (count >= needed) {
+		return FSTATUS_OK;
+	}
+	needed -= count;
+	
+	if (!fat_fsinfo_load(vol)) {
+		return FSTATUS_ERROR;
+	}
+	if ((vol->free_count != 0xFFFFFFFF) && (vol->free_count < needed)) {
 		return FSTATUS_ERROR;
 	}
-	return FSTATUS_OK;
-}
-
-/// Read one entry pointed to by `dir` and move the directory pointer to the
-/// next directory entry
-fstatus fat_dir_read(struct dir_s* dir, struct info_s* info) {
-	u8 lfn_crc = 0;
-	u8 name_length = 0;
 	
-	while (1) {
-		if (!fat_read(dir->vol, dir->sector)) {
+	while (needed) {
+		u32 start;
+		u32 length;
+		if (!fat_find_run(vol, needed, &start, &length)) {
 			return FSTATUS_ERROR;
 		}
-		u8* entry_ptr = dir->vol->buffer + dir->rw_offset;
-		
-		// Check if the entry is in use
-		u8 sfn_check = entry_ptr[0];
+		if (length > needed) {
+			length = needed;
+		}
 		
-		// Check for the end marker
-		if (sfn_check == 0x00) {
-			return FSTATUS_EOF;
+		// Link the whole run in one pass over the FAT sectors
+		for (u32 i = 0; i < length - 1; i++) {
+			if (!fat_table_set(vol, start + i, start + i + 1)) {
+				return FSTATUS_ERROR;
+			}
 		}
-		if ((sfn_check != 0xE5) && (sfn_check != 0x05)) {
-			u8 sfn_attr = entry_ptr[SFN_ATTR];
-			
-			// Check if the directory entry is a LFN or a SFN
-			if ((sfn_attr & ATTR_LFN) == ATTR_LFN) {
-				
-				// LFN case
-				u8 name_offset = 13 * ((entry_ptr[0] & LFN_SEQ_MSK) - 1);
-				for (u8 i = 0; i < 13; i++) {
-					u8 tmp_char = entry_ptr[lfn_lut[i]]; 
-					if (!((tmp_char == 0x00) || (tmp_char == 0xFF))) {
-						info->name[name_offset + i] = tmp_char;
-						name_length++;
-					}
-				}
-				lfn_crc = entry_ptr[LFN_CRC];
-			} else {
-				if (lfn_crc) {
-					// This SFN entry is the last entry in a chain of
-					// LFN entries. Return CRC error if the checksum is wrong
-					if (lfn_crc != fat_dir_sfn_crc(entry_ptr)) {
-						return FSTATUS_ERROR;
-					}
-					
-				} else {
-					// The directory contains only one SFN entry
-					for (u8 i = 0; i < 11; i++) {
-						info->name[i] = entry_ptr[i];
-						name_length++;
-					}
-				}
-				
-				// In any case the last SFN entry will contain the information
-				// about the directory
-				info->attribute = entry_ptr[SFN_ATTR];
-				info->c_time_tenth = entry_ptr[SFN_CTIME_TH];
-				info->c_time = fat_load16(entry_ptr + SFN_CTIME);
-				info->c_date = fat_load16(entry_ptr + SFN_CDATE);
-				info->w_time = fat_load16(entry_ptr + SFN_WTIME);
-				info->w_date = fat_load16(entry_ptr + SFN_WDATE);
-				info->a_date = fat_load16(entry_ptr + SFN_ADATE);
-				info->size = fat_load32(entry_ptr + SFN_FILE_SIZE);
-				info->name_length = name_length;
-				
-				// Make `dir` point to the next entry
-				fat_dir_get_next(dir);
-				
-				return FSTATUS_OK;
+		if (!fat_table_set(vol, start + length - 1, 0xFFFFFFF)) {
+			return FSTATUS_ERROR;
+		}
+		
+		// Append the run to the file chain
+		if (last) {
+			if (!fat_table_set(vol, last, start)) {
+				return FSTATUS_ERROR;
+			}
+		} else {
+			if (!fat_file_set_first(file, start)) {
+				return FSTATUS_ERROR;
 			}
 		}
-		// Get the next entry
-		fat_dir_get_next(dir);
+		fat_file_map_add(file, count, start, length);
+		
+		last = start + length - 1;
+		count += length;
+		needed -= length;
+		file->last_cluster = last;
+		file->clust_cnt = count;
+		
+		vol->next_free = last + 1;
+		if (vol->free_count != 0xFFFFFFFF) {
+			vol->free_count -= length;
+		}
+		vol->fsinfo_dirty = 1;
 	}
-}
-
-/// Make a new directory in the specified `path`
-fstatus fat_dir_make(const char* path) {
+	
+#if FAT_SYNC_WRITES
+	if (!fat_sync(vol)) {
+		return FSTATUS_ERROR;
+	}
+#endif
 	return FSTATUS_OK;
 }
 
-/// Rename a directory item
-fstatus fat_dir_rename(struct dir_s* dir, const char* name, u8 length) {
+/// Makes sure the cluster chain of `file` can hold `size` bytes. All missing
+/// clusters are allocated in one batch and appended to the chain
+static u8 fat_file_grow(struct file_s* file, u32 size) {
+	struct volume_s* vol = file->vol;
+	u32 clust_bytes = vol->sector_size * vol->cluster_size;
+	u32 needed = size / clust_bytes + ((size % clust_bytes) != 0);
 	
-	// Get the lenght of the name
-	u8 name_length = 0;
-	for (u8 i = 0; i < length; i++) {
-		if ((name[i] == '.') && (i != 0)) {
-			break;
+	if (file->start_sect && (file->clust_cnt == 0)) {
+		u32 last;
+		u32 count;
+		if (!fat_file_chain_end(file, &last, &count)) {
+			return 0;
 		}
-		name_length++;
 	}
 	
-	print("Name length: %d\n", name_length);
-	u8 entries_req = 1;
-	if (name_length > 8) {
-		entries_req = (length / 13) - 1;
+	while (file->clust_cnt < needed) {
+		u32 cluster;
+		if (!fat_get_cluster(vol, &cluster)) {
+			return 0;
+		}
+		if (file->clust_cnt) {
+			if (!fat_table_set(vol, file->last_cluster, cluster)) {
+				return 0;
+			}
+		} else {
+			if (!fat_file_set_first(file, cluster)) {
+				return 0;
+			}
+		}
+		fat_file_map_add(file, file->clust_cnt, cluster, 1);
+		file->last_cluster = cluster;
+		file->clust_cnt++;
 	}
-	
-	// Check the number of entries pointed to by dir
-	if (!fat_read(dir->vol, dir->sector)) {
-		return FSTATUS_ERROR;
+	return 1;
+}
+
+/// Waits for all prefetch transfers on `file` and empties the read-ahead ring
+static void fat_file_ra_reset(struct file_s* file) {
+	struct readahead_s* ra = file->ra;
+	if (ra == NULL) {
+		return;
 	}
-	u8 entries_pres = 1;
-	if ((dir->vol->buffer[dir->rw_offset + SFN_ATTR] & ATTR_LFN) == ATTR_LFN) {
-		entries_pres = (dir->vol->buffer[dir->rw_offset] & LFN_SEQ_MSK) + 1;
+	for (u32 i = 0; i < ra->slot_cnt; i++) {
+		fat_req_wait(&ra->slots[i].io, file->vol->disk);
 	}
+	ra->count = 0;
+}
+
+/// Queues prefetch transfers for all free slots in the read-ahead ring. The 
+/// cluster chain is followed through the FAT cache
+static u8 fat_file_ra_fill(struct file_s* file) {
+	struct readahead_s* ra = file->ra;
+	struct volume_s* vol = file->vol;
+	u32 clust_bytes = vol->cluster_size * vol->sector_size;
 	
-	if (entries_req > entries_pres) {
-		// Allocate a chain of entries
+	while (!ra->end && (ra->count < ra->slot_cnt) && 
+		(ra->next_offset < file->size)) {
 		
-	} else {
-		// Enough entry are present
+		u32 index = (ra->head + ra->count) % ra->slot_cnt;
+		struct ra_slot_s* slot = &ra->slots[index];
+		u32 lba = fat_clust_to_sect(vol, ra->next_cluster) + 
+			((ra->next_offset % clust_bytes) >> fat_sect_shift(vol));
+		
+		// The storage device must be up to date with the volume cache
+		if (!fat_flush_range(vol, lba, ra->slot_sect)) {
+			return 0;
+		}
+		slot->offset = ra->next_offset;
+		fat_req_submit(&slot->io, vol->disk, ra->buffer + index * 
+			ra->slot_size, lba, ra->slot_sect, 0);
+		fat_stat_io(vol, 0, ra->slot_sect, 0);
+		ra->count++;
+		
+		// Move the prefetch cursor to the next slot
+		ra->next_offset += ra->slot_size;
+		if (((ra->next_offset % clust_bytes) == 0) && 
+			(ra->next_offset < file->size)) {
+			u32 cluster;
+			if (!fat_table_get(vol, ra->next_cluster, &cluster)) {
+				return 0;
+			}
+			cluster &= 0xFFFFFFF;
+			if ((cluster < 2) || (cluster >= 0xFFFFFF8)) {
+				ra->end = 1;
+			} else {
+				ra->next_cluster = cluster;
+			}
+		}
 	}
-	print("Ent req: %d\nEnt pres: %d\n", entries_req, entries_pres);
+	return 1;
 }
 
-/// Open a file and return the file object. It takes in a global path.
-fstatus fat_file_open(struct file_s* file, const char* path, u16 length) {
-	// Make a pointer to the directory where the file is stored
-	struct dir_s dir;
-	fstatus status = fat_follow_path(&dir, path, length);
-	if (status != FSTATUS_OK) {
-		return status;
+/// Returns a pointer to the prefetched data at the file pointer in `data` and
+/// the number of bytes available there in `length`. The file pointer must be 
+/// resolved. Returns 0 if the data has to be read through the volume instead
+static u8 fat_file_ra_get(struct file_s* file, const u8** data, u32* length) {
+	struct readahead_s* ra = file->ra;
+	struct volume_s* vol = file->vol;
+	u32 offset = file->glob_offset;
+	
+	// Slots behind the file pointer are free for new prefetches
+	while (ra->count) {
+		struct ra_slot_s* slot = &ra->slots[ra->head];
+		if (slot->offset + ra->slot_size > offset) {
+			break;
+		}
+		fat_req_wait(&slot->io, vol->disk);
+		ra->head = (ra->head + 1) % ra->slot_cnt;
+		ra->count--;
 	}
 	
-	// Grab the last name fragment which will be the file name
-	const char* char_ptr = path + length - 1;
-	if (*char_ptr == 0x00) return FSTATUS_PATH_ERR;
-	if (*char_ptr == '/') {
-		char_ptr--;
+	// Restart the prefetch at the slot holding the file pointer
+	if ((ra->count == 0) || (ra->slots[ra->head].offset > offset)) {
+		fat_file_ra_reset(file);
+		ra->next_offset = offset - (offset % ra->slot_size);
+		ra->next_cluster = file->cluster;
+		ra->end = 0;
+	}
+	if (!fat_file_ra_fill(file) || (ra->count == 0)) {
+		return 0;
 	}
-	u8 frag_size;
 	
-	while ((*char_ptr != '/') && (*char_ptr != 0x00)) {
-		frag_size++;
-		char_ptr--;
+	struct ra_slot_s* slot = &ra->slots[ra->head];
+	if (slot->io.pending) {
+		ra->misses++;
+	} else {
+		ra->hits++;
 	}
-	if (*char_ptr == 0x00) {
-		return FSTATUS_PATH_ERR;
+	if (!fat_req_wait(&slot->io, vol->disk)) {
+		fat_file_ra_reset(file);
+		return 0;
 	}
+	u32 pos = offset - slot->offset;
+	*data = ra->buffer + ra->head * ra->slot_size + pos;
+	*length = ra->slot_size - pos;
+	return 1;
+}
+
+/// Completion callback of the asynchronous file transfers
+static void fat_file_complete(void* arg, u8 status) {
+	struct file_s* file = (struct file_s *)arg;
+	file->req_status = status;
+	file->pending = 0;
+}
+
+/// Queues a transfer of `count` sectors at the file pointer and moves the file
+/// pointer to the end of the last sector, the same way as the direct path in 
+/// `fat_file_read`. Waits for room if the disk queue is full
+static u8 fat_file_submit(struct file_s* file, u8* buffer, u32 count, 
+	u8 write) {
+	struct volume_s* vol = file->vol;
 	
-	// Try to find the file in the directory pointed to by `dir`
-	if (!fat_dir_search(&dir, char_ptr + 1, frag_size)) {
-		return FSTATUS_PATH_ERR;
+	file->req.disk = vol->disk;
+	file->req.buffer = buffer;
+	file->req.lba = file->sector;
+	file->req.count = count;
+	file->req.write = write;
+	file->req.callback = fat_file_complete;
+	file->req.arg = file;
+	file->pending = 1;
+	while (!disk_submit(&file->req)) {
+		disk_poll(vol->disk);
 	}
+	fat_stat_io(vol, write, count, 0);
 	
-	// Update whe address of the file
-	file->sector = dir.sector;
-	file->start_sect = dir.sector;
-	file->cluster = dir.cluster;
-	file->rw_offset = 0;
-	file->vol = dir.vol;
-	file->size = dir.size;
+	file->sector += count - 1;
+	file->cluster = fat_sect_to_clust(vol, file->sector);
+	file->rw_offset = vol->sector_size;
+	return 1;
+}
+
+/// Returns in `span` the number of whole sectors, up to `max`, which can be
+/// transferred with one multi-sector command from the current file position.
+/// Clusters which follows each other on the disk are merged into one span
+static u8 fat_file_span(struct file_s* file, u32 max, u32* span) {
+	struct volume_s* vol = file->vol;
 	
-	print(ANSI_RED "File size: %d\n" ANSI_NORMAL, file->size);
-	return FSTATUS_OK;
+	if (max > FAT_MAX_TRANSFER) {
+		max = FAT_MAX_TRANSFER;
+	}
+	u32 clust_off = file->sector - fat_clust_to_sect(vol, file->cluster);
+	u32 clust_cnt = (clust_off + max + vol->cluster_size - 1) / 
+		vol->cluster_size;
+	
+	// Use the extent map if it covers the transfer
+	u32 index = (file->glob_offset >> fat_sect_shift(vol)) / vol->cluster_size;
+	struct extent_s* ext = fat_file_map_find(file, index);
+	u32 extent;
+	if (ext && (index + clust_cnt <= ext->offset + ext->length)) {
+		extent = clust_cnt;
+	} else {
+		if (!fat_table_extent(vol, file->cluster, clust_cnt, &extent)) {
+			return 0;
+		}
+		fat_file_map_add(file, index, file->cluster, extent);
+	}
+	
+	*span = extent * vol->cluster_size - clust_off;
+	if (*span > max) {
+		*span = max;
+	}
+	return 1;
 }
 
-/// Closes a currently open file object
-fstatus fat_file_close(struct file_s* file) {
-	if(!fat_flush(file->vol)) {
-		return FSTATUS_ERROR;
+/// Attach an extent map with room for `size` extents to an open file. The map
+/// memory is owned by the caller and must stay valid until the file is closed.
+/// The map is filled lazily as the cluster chain is walked
+fstatus fat_file_set_map(struct file_s* file, struct extent_s* map, u32 size) {
+	fat_lock(file->vol);
+	fstatus result = fat_file_set_map_locked(file, map, size);
+	fat_unlock(file->vol);
+	return result;
+}
+
+static fstatus fat_file_set_map_locked(struct file_s* file,
+	struct extent_s* map, u32 size) {
+	file->map = map;
+	file->map_size = size;
+	file->map_cnt = 0;
+	
+	if (map && size && file->start_sect) {
+		fat_file_map_add(file, 0, fat_sect_to_clust(file->vol, 
+			file->start_sect), 1);
 	}
 	return FSTATUS_OK;
 }
 
-/// Reads `count` number of bytes from the file (at whatever position `file` is
-/// pointing to). It returns the `status` field which contains the number of
-/// bytes written. If the `count` and `status` does not match the EOF marker
-/// has been hit.
-fstatus fat_file_read(struct file_s* file, u8* buffer, u32 count, u32* status) {
-	*status = 0;
-	u16 sector_size = file->vol->sector_size;
-	u32 file_size = file->size;
+/// Returns the sector ranges on the disk holding the file data from byte 
+/// `offset` to the end of the file, so it can be streamed by a DMA engine 
+/// without a copy through the volume cache. Up to `size` extents are written
+/// to `extents` and `count` returns the number used. The first extent starts
+/// at the sector holding `offset`. If the array fills up, the call can be 
+/// repeated from the end of the last extent. Cached sectors in the ranges are
+/// written back first. The ranges are only valid until the file is changed
+fstatus fat_file_get_extents(struct file_s* file, u32 offset, 
+	struct lba_extent_s* extents, u32 size, u32* count) {
+	fat_lock(file->vol);
+	fstatus result = fat_file_get_extents_locked(file, offset, extents, size,
+		count);
+	fat_unlock(file->vol);
+	return result;
+}
+
+static fstatus fat_file_get_extents_locked(struct file_s* file, u32 offset,
+	struct lba_extent_s* extents, u32 size, u32* count) {
+	struct volume_s* vol = file->vol;
+	u32 sector_shift = fat_sect_shift(vol);
+	*count = 0;
 	
-	if (!fat_read(file->vol, file->sector)) {
+	if (fat_file_wait(file) != FSTATUS_OK) {
 		return FSTATUS_ERROR;
 	}
-	while (count--) {
+	if (offset >= file->size) {
+		return FSTATUS_OK;
+	}
+	
+	// File relative sector and cluster numbers
+	u32 sector = offset >> sector_shift;
+	u32 sect_end = ((file->size - 1) >> sector_shift) + 1;
+	u32 index = sector / vol->cluster_size;
+	u32 index_end = (sect_end - 1) / vol->cluster_size + 1;
+	
+	u32 cluster;
+	if (!fat_file_walk(file, index, &cluster)) {
+		return FSTATUS_ERROR;
+	}
+	
+	while (*count < size) {
 		
-		// Resolve the address
-		if (file->rw_offset >= sector_size) {
-			fat_file_addr_resolve(file);
-			
-			// Update the file system buffer
-			if (!fat_read(file->vol, file->sector)) {
+		// Find the physically contiguous run from this cluster
+		u32 length;
+		struct extent_s* ext = fat_file_map_find(file, index);
+		if (ext && (index < ext->offset + ext->length)) {
+			length = ext->offset + ext->length - index;
+			if (length > index_end - index) {
+				length = index_end - index;
+			}
+		} else {
+			if (!fat_table_extent(vol, cluster, index_end - index, &length)) {
 				return FSTATUS_ERROR;
 			}
+			fat_file_map_add(file, index, cluster, length);
 		}
-		*buffer++ = file->vol->buffer[file->rw_offset++];
 		
-		// Update the offsets
-		file->glob_offset++;
-		(*status)++;
+		// The run is clipped to the file size
+		u32 clust_off = sector - index * vol->cluster_size;
+		u32 lba = fat_clust_to_sect(vol, cluster) + clust_off;
+		u32 sect_cnt = length * vol->cluster_size - clust_off;
+		if (sect_cnt > sect_end - sector) {
+			sect_cnt = sect_end - sector;
+		}
+		if (!fat_flush_range(vol, lba, sect_cnt)) {
+			return FSTATUS_ERROR;
+		}
+		
+		struct lba_extent_s* dest = &extents[(*count)++];
+		dest->offset = sector << sector_shift;
+		dest->lba = lba;
+		dest->count = sect_cnt;
 		
-		if (file->glob_offset >= file_size) {
+		sector += sect_cnt;
+		index += length;
+		if (index >= index_end) {
 			break;
 		}
+		
+		// Continue with the cluster following the last one in the run
+		ext = fat_file_map_find(file, index);
+		if (ext && (index < ext->offset + ext->length)) {
+			cluster = ext->cluster + (index - ext->offset);
+		} else {
+			u32 new_cluster;
+			if (!fat_table_get(vol, cluster + length - 1, &new_cluster)) {
+				return FSTATUS_ERROR;
+			}
+			u32 eoc_value = new_cluster & 0xFFFFFFF;
+			if ((eoc_value >= 0xFFFFFF8) && (eoc_value <= 0xFFFFFFF)) {
+				return FSTATUS_ERROR;
+			}
+			cluster = new_cluster;
+			fat_file_map_add(file, index, cluster, 1);
+		}
 	}
 	return FSTATUS_OK;
 }
 
-/// Write a number of characters to the location pointed to be file
-fstatus fat_file_write(struct file_s* file, const u8* buffer, u32 count) {
+/// Counts the clusters of `file` and the physically contiguous runs they are
+/// stored in
+static u8 fat_file_runs(struct file_s* file, u32* clusters, u32* fragments) {
+	struct volume_s* vol = file->vol;
+	*clusters = 0;
+	*fragments = 0;
+	if (file->start_sect == 0) {
+		return 1;
+	}
+	
+	u32 cluster = fat_sect_to_clust(vol, file->start_sect);
+	while (1) {
+		u32 length;
+		if (!fat_table_extent(vol, cluster, vol->cluster_cnt, &length)) {
+			return 0;
+		}
+		*clusters += length;
+		(*fragments)++;
+		
+		// A chain longer than the volume is broken
+		if (*clusters > vol->cluster_cnt) {
+			return 0;
+		}
+		u32 next;
+		if (!fat_table_get(vol, cluster + length - 1, &next)) {
+			return 0;
+		}
+		u32 eoc_value = next & 0xFFFFFFF;
+		if ((eoc_value >= 0xFFFFFF8) && (eoc_value <= 0xFFFFFFF)) {
+			return 1;
+		}
+		cluster = eoc_value;
+	}
+}
+
+/// Marks the cluster chain from `cluster` as free
+static u8 fat_chain_free(struct volume_s* vol, u32 cluster) {
+	if (!fat_fsinfo_load(vol)) {
+		return 0;
+	}
+	while ((cluster >= 2) && (cluster < vol->cluster_cnt + 2)) {
+		u32 next;
+		if (!fat_table_get(vol, cluster, &next) || 
+			!fat_table_set(vol, cluster, 0)) {
+			return 0;
+		}
+		if (vol->free_count != 0xFFFFFFFF) {
+			vol->free_count++;
+		}
+		vol->fsinfo_dirty = 1;
+		cluster = next & 0xFFFFFFF;
+	}
+	return 1;
+}
+
+/// Reports the number of clusters of an open file and the number of runs 
+/// they are split into on the disk
+fstatus fat_file_frag(struct file_s* file, struct frag_s* frag) {
+	fat_lock(file->vol);
+	fstatus result = fat_file_frag_locked(file, frag);
+	fat_unlock(file->vol);
+	return result;
+}
+
+static fstatus fat_file_frag_locked(struct file_s* file, struct frag_s* frag) {
+	struct frag_s empty = { 0 };
+	*frag = empty;
+	if (!fat_file_runs(file, &frag->clusters, &frag->fragments)) {
+		return FSTATUS_ERROR;
+	}
 	return FSTATUS_OK;
 }
 
-/// Move the read / write file pointer. The offset is cumputed with respect 
-/// to the file start address
-fstatus fat_file_jump(struct file_s* file, u32 offset) {
+/// Moves a fragmented file to one run of free clusters. The run is found with
+/// the free cluster bitmap if one is complete, and is linked as a separate 
+/// chain on the first call. Each call then copies what fits in `buffer` of 
+/// `size` bytes and returns FSTATUS_BUSY, so the work can be spread out and 
+/// stopped at any time with `fat_file_defrag_abort`. When all data is copied
+/// the directory entry is switched to the new chain with a single sector 
+/// write, and the old chain is freed. A power loss at any point leaves either
+/// the old or the new chain in the entry, and at most a lost chain. Returns 
+/// FSTATUS_OK when the file is contiguous, and FSTATUS_ERROR if no free run
+/// is large enough. The file may be read, but not written, in between calls, 
+/// and no other handle may have it open
+fstatus fat_file_defrag(struct file_s* file, struct defrag_s* df, u8* buffer,
+	u32 size) {
+	fat_lock(file->vol);
+	fstatus result = fat_file_defrag_locked(file, df, buffer, size);
+	fat_unlock(file->vol);
+	return result;
+}
+
+static fstatus fat_file_defrag_locked(struct file_s* file, struct defrag_s* df,
+	u8* buffer, u32 size) {
+	struct volume_s* vol = file->vol;
+	u32 sector_shift = fat_sect_shift(vol);
+	u32 buf_sect = size >> sector_shift;
 	
-	// Get the file start address
-	file->cluster = fat_sect_to_clust(file->vol, file->start_sect);
+	if ((buf_sect == 0) || (fat_file_wait(file) != FSTATUS_OK) || 
+		!fat_flush(vol)) {
+		return FSTATUS_ERROR;
+	}
 	
-	// Get the relative offsets
-	u32 sector_offset = offset / file->vol->sector_size;
-	u32 cluster_offset = sector_offset / file->vol->cluster_size;
-	sector_offset = sector_offset % file->vol->cluster_size;
+	if (df->start == 0) {
+		u32 clusters;
+		u32 fragments;
+		if (!fat_file_runs(file, &clusters, &fragments)) {
+			return FSTATUS_ERROR;
+		}
+		if (fragments <= 1) {
+			return FSTATUS_OK;
+		}
+		u32 start;
+		u32 length;
+		if (!fat_fsinfo_load(vol) || 
+			!fat_find_run(vol, clusters, &start, &length) || 
+			(length < clusters)) {
+			return FSTATUS_ERROR;
+		}
+		
+		// The new chain is complete in the FAT before any data is moved, and
+		// nothing refers to it until the switch
+		for (u32 i = 0; i < clusters - 1; i++) {
+			if (!fat_table_set(vol, start + i, start + i + 1)) {
+				return FSTATUS_ERROR;
+			}
+		}
+		if (!fat_table_set(vol, start + clusters - 1, 0xFFFFFFF)) {
+			return FSTATUS_ERROR;
+		}
+		if (vol->free_count != 0xFFFFFFFF) {
+			vol->free_count -= clusters;
+		}
+		vol->fsinfo_dirty = 1;
+		
+		df->start = start;
+		df->count = clusters;
+		df->copied = 0;
+		df->total = file->size ? ((file->size - 1) >> sector_shift) + 1 : 0;
+		df->cluster = fat_sect_to_clust(vol, file->start_sect);
+		df->size = file->size;
+		return FSTATUS_BUSY;
+	}
 	
-	while (cluster_offset) {
-		u32 new_cluster;
-		if (!fat_table_get(file->vol, file->cluster, &new_cluster)) {
+	// The copy is only valid as long as the file is unchanged
+	if (df->size != file->size) {
+		fat_file_defrag_abort_locked(file, df);
+		return FSTATUS_ERROR;
+	}
+	
+	if (df->copied < df->total) {
+		
+		// Copy from one contiguous part of the old chain
+		u32 clust_off = df->copied % vol->cluster_size;
+		u32 count = df->total - df->copied;
+		if (count > buf_sect) {
+			count = buf_sect;
+		}
+		u32 length;
+		if (!fat_table_extent(vol, df->cluster, (clust_off + count + 
+			vol->cluster_size - 1) / vol->cluster_size, &length)) {
 			return FSTATUS_ERROR;
 		}
-		// Check if the FAT table entry is EOC
-		u32 eoc_value = new_cluster & 0xFFFFFFF;
-		if ((eoc_value >= 0xFFFFFF8) && (eoc_value <= 0xFFFFFFF)) {
-			return 0;
+		if (count > length * vol->cluster_size - clust_off) {
+			count = length * vol->cluster_size - clust_off;
+		}
+		
+		u32 src = fat_clust_to_sect(vol, df->cluster) + clust_off;
+		u32 dest = fat_clust_to_sect(vol, df->start) + df->copied;
+		fat_cache_drop(vol, dest, count);
+		if (!fat_disk_read(vol, buffer, src, count) ||
+			!fat_disk_write(vol, buffer, dest, count)) {
+			return FSTATUS_ERROR;
+		}
+		df->copied += count;
+		
+		// Move the source to the cluster holding the next sector
+		u32 passed = (clust_off + count) / vol->cluster_size;
+		if (passed && (df->copied < df->total)) {
+			if (passed < length) {
+				df->cluster += passed;
+			} else {
+				u32 next;
+				if (!fat_table_get(vol, df->cluster + length - 1, &next)) {
+					return FSTATUS_ERROR;
+				}
+				df->cluster = next & 0xFFFFFFF;
+			}
+		}
+		if (df->copied < df->total) {
+			return FSTATUS_BUSY;
 		}
-		 
-		file->cluster = new_cluster;		
-		cluster_offset--;
 	}
 	
-	// The base cluster address is determined. Update the sector and rw offset
-	// from the relative offsets calulated above. 
-	file->sector = fat_clust_to_sect(file->vol, file->cluster) + sector_offset;
-	file->rw_offset = offset % file->vol->sector_size;
-	file->glob_offset = offset;
+	// The new chain must be on the disk before the entry points to it, and 
+	// the old chain is freed only after the switch
+	if (!fat_flush(vol) || !fat_read(vol, file->entry_lba)) {
+		return FSTATUS_ERROR;
+	}
+	u32 old = fat_sect_to_clust(vol, file->start_sect);
+	u8* entry = vol->buffer + file->entry_offset;
+	fat_store16(entry + SFN_CLUSTH, (u16)(df->start >> 16));
+	fat_store16(entry + SFN_CLUSTL, (u16)df->start);
+	fat_mark_dirty(vol);
+	if (!fat_flush(vol) || !fat_chain_free(vol, old)) {
+		return FSTATUS_ERROR;
+	}
+	
+	fat_file_ra_reset(file);
+	file->start_sect = fat_clust_to_sect(vol, df->start);
+	file->last_cluster = df->start + df->count - 1;
+	file->clust_cnt = df->count;
+	if (file->map && file->map_size) {
+		file->map_cnt = 0;
+		fat_file_map_add(file, 0, df->start, df->count);
+	}
+	df->start = 0;
+	
+	if ((fat_file_jump_locked(file, file->glob_offset) != FSTATUS_OK) ||
+		!fat_sync(vol)) {
+		return FSTATUS_ERROR;
+	}
+	return FSTATUS_OK;
+}
+
+/// Stops a defragmentation started by `fat_file_defrag` and frees the 
+/// clusters taken for the new chain. The file is left as it was
+fstatus fat_file_defrag_abort(struct file_s* file, struct defrag_s* df) {
+	fat_lock(file->vol);
+	fstatus result = fat_file_defrag_abort_locked(file, df);
+	fat_unlock(file->vol);
+	return result;
+}
+
+static fstatus fat_file_defrag_abort_locked(struct file_s* file, 
+	struct defrag_s* df) {
+	struct volume_s* vol = file->vol;
+	if (df->start == 0) {
+		return FSTATUS_OK;
+	}
+	u32 start = df->start;
+	df->start = 0;
+	if (!fat_chain_free(vol, start) || !fat_sync(vol)) {
+		return FSTATUS_ERROR;
+	}
+	return FSTATUS_OK;
+}
+
+/// Attach a read-ahead buffer of `size` bytes to an open file. The buffer is
+/// split into slots of up to one cluster, and while the file is read 
+/// sequentially the slots following the file pointer are prefetched with the
+/// asynchronous disk interface. `ra` and `buffer` are owned by the caller and 
+/// must stay valid until the file is closed. A NULL `buffer` detaches it
+fstatus fat_file_set_readahead(struct file_s* file, struct readahead_s* ra,
+	u8* buffer, u32 size) {
+	fat_lock(file->vol);
+	fstatus result = fat_file_set_readahead_locked(file, ra, buffer, size);
+	fat_unlock(file->vol);
+	return result;
+}
+
+static fstatus fat_file_set_readahead_locked(struct file_s* file,
+	struct readahead_s* ra, u8* buffer, u32 size) {
+	struct volume_s* vol = file->vol;
 	
+	fat_file_ra_reset(file);
+	file->ra = NULL;
+	if (buffer == NULL) {
+		return FSTATUS_OK;
+	}
+	
+	// A slot is a whole number of sectors inside one cluster, and the buffer
+	// must have room for at least two of them
+	u32 slot_sect = vol->cluster_size;
+	while ((slot_sect > 1) && (size < 2 * slot_sect * vol->sector_size)) {
+		slot_sect /= 2;
+	}
+	u32 slot_cnt = size / (slot_sect * vol->sector_size);
+	if (slot_cnt < 2) {
+		return FSTATUS_ERROR;
+	}
+	if (slot_cnt > FAT_READAHEAD_SLOTS) {
+		slot_cnt = FAT_READAHEAD_SLOTS;
+	}
+	
+	ra->buffer = buffer;
+	ra->slot_sect = slot_sect;
+	ra->slot_size = slot_sect * vol->sector_size;
+	ra->slot_cnt = slot_cnt;
+	ra->head = 0;
+	ra->count = 0;
+	ra->end = 0;
+	ra->last_end = file->glob_offset;
+	ra->hits = 0;
+	ra->misses = 0;
+	for (u32 i = 0; i < FAT_READAHEAD_SLOTS; i++) {
+		ra->slots[i].io.pending = 0;
+	}
+	file->ra = ra;
 	return FSTATUS_OK;
 }
 
 fstatus fat_dir_delete(struct dir_s* dir);
-fstatus fat_dir_chmod(struct dir_s* dir, const char* mod);
-fstatus fat_file_flush(struct file_s* file);
\ No newline at end of file
+fstatus fat_dir_chmod(struct dir_s* dir, const char* mod);
\ No newline at end of file
@@ -16,6 +16,7 @@
 #define FAT32_H
 
 #include "fat_types.h"
+#include "fat_config.h"
 #include "disk_interface.h"
 
 /// Most of the FAT32 file system functions returns one of these status codes
@@ -24,9 +25,88 @@ typedef enum {
 	FSTATUS_ERROR,
 	FSTATUS_NO_VOLUME,
 	FSTATUS_PATH_ERR,
-	FSTATUS_EOF
+	FSTATUS_EOF,
+	FSTATUS_BUSY
 } fstatus;
 
+/// One sector in the volume cache. Sector zero will never be cached, so an
+/// `lba` of zero marks an unused entry
+struct cache_s {
+	u8 buffer[FAT_SECTOR_SIZE];
+	u32 lba;
+	u32 stamp;
+	u8 dirty;
+};
+
+/// One slot in a directory name index. `sector` and `offset` locate the first
+/// entry of the LFN chain, or the SFN entry if the name has no LFN. An empty
+/// slot has a `sector` of zero
+struct dir_hash_s {
+	u32 sector;
+	u16 offset;
+	u16 hash;
+};
+
+/// Hash table mapping the case folded names in one directory to the position
+/// of their entries. If the directory did not fit in the table, `complete` is
+/// cleared and names not in the table must be searched for
+struct dir_index_s {
+	struct dir_hash_s* slots;
+	u32 size;
+	u32 count;
+	u32 start_sect;
+	u32 stamp;
+	u8 complete;
+};
+
+/// One resolved directory path. `path` is the case folded path following the 
+/// volume letter and colon, without a trailing slash e.g. /HOME/USR
+struct path_cache_s {
+	char path[FAT_PATH_CACHE_LEN];
+	u8 length;
+	u32 start_sect;
+	u32 stamp;
+};
+
+/// A set of cache entries with its own LRU replacement and hit statistics
+struct sect_cache_s {
+	struct cache_s* entries;
+	u32 size;
+	u32 hits;
+	u32 misses;
+};
+
+/// I/O statistics of a volume returned by `volume_get_stats`. Transfers are 
+/// counted per disk command issued for the volume, including queued ones and
+/// the boot sector read when it is mounted. The partition table reads during
+/// `disk_mount` belong to no volume and are not counted. The cycle counts 
+/// cover the blocking transfers and need FAT_STATS_CLOCK
+struct fat_stats_s {
+	u32 read_cmds;
+	u32 read_sects;
+	u32 write_cmds;
+	u32 write_sects;
+	u32 read_cycles;
+	u32 write_cycles;
+	u32 cache_hits;
+	u32 cache_misses;
+	u32 fat_hits;
+	u32 fat_misses;
+	u32 fat_lookups;
+	u32 dir_entries;
+	u32 alloc_cnt;
+	u32 alloc_scan;
+	u32 path_hits;
+	u32 path_misses;
+};
+
+/// A range of FAT sectors, relative to the start of the FAT, which has been
+/// written to the first FAT but not yet to the mirrors
+struct mirror_s {
+	u32 start;
+	u32 count;
+};
+
 struct volume_s {
 	struct volume_s* next;
 	
@@ -35,26 +115,99 @@ struct volume_s {
 	// characters while the root label can contain 13 characters.
 	char label[13];
 	char letter;
+	u8 label_valid;
 	
-	// FAT32 info
+	// FAT32 info. The sector size is a power of two and `sector_shift` is its
+	// base two logarithm
 	u16 sector_size;
+	u8 sector_shift;
 	u8 cluster_size;
 	u32 total_size;
 	u32 fat_lba;
+	u32 fat_size;
 	u32 fsinfo_lba;
 	u32 data_lba;
 	u32 root_lba;
+	u32 part_lba;
+	u32 cluster_cnt;
 	
-	// All file system operations require a 512-byte buffer for storing the
-	// current sector.
-	u8 buffer[512];
+	// The volume has `fat_num` FATs. `fat_lba` is the FAT in use and 
+	// `fat_cnt` is the number of FATs kept in sync with it, which is one when
+	// mirroring is turned off. Mirror writes which are not done yet are kept 
+	// as ranges until the volume is synced
+	u8 fat_num;
+	u8 fat_cnt;
+#if FAT_MIRROR != FAT_MIRROR_EAGER
+	struct mirror_s mirror[FAT_MIRROR_RANGES];
+#endif
+	
+	// All file system operations go through a small LRU sector cache. The
+	// `buffer` and `buffer_lba` always refer to the last sector fetched by
+	// `fat_read`, so the sector can be accessed directly after a read. FAT 
+	// table sectors have a separate cache
+	struct cache_s cache_mem[FAT_CACHE_SIZE];
+	struct cache_s fat_cache_mem[FAT_TABLE_CACHE_SIZE];
+	struct sect_cache_s cache;
+	struct sect_cache_s fat_cache;
+	struct cache_s* cache_curr;
+	u32 cache_tick;
+	u8* buffer;
 	u32 buffer_lba;
 	disk_e disk;
-	u32 buffer_dirty;
 	
-	char lfn[256];
+#if FAT_STATS
+	// The cache hit counters are kept in the caches and copied in when the
+	// statistics are read
+	struct fat_stats_s stats;
+#endif
+	
+	// The FSinfo free cluster count and next free hint are kept here and only
+	// written back to the FSinfo sector when the volume is synced
+	u32 free_count;
+	u32 next_free;
+	u8 fsinfo_valid;
+	u8 fsinfo_dirty;
+	
+	// Optional free cluster bitmap provided by the user. One bit is used for 
+	// each cluster and a set bit marks a used cluster. The bitmap is only used
+	// for allocation when all `fat_size` FAT sectors have been scanned
+	u32* bitmap;
+	u32 bitmap_fill;
+	u32 bitmap_free;
+	
+#if FAT_FAST_MOUNT
+	// Number of bitmap sectors in the restored mount snapshot. This is 
+	// cleared on the first FAT change, since the saved bitmap is then stale
+	u32 snap_bitmap;
+#endif
+	
+	// Allocation unit (erase block) size of the disk in sectors, or zero if
+	// unknown. Dirty sectors are written back in address order, and with an
+	// optional write buffer from the user consecutive sectors within one 
+	// unit are merged into a single disk write
+	u32 au_size;
+	u8* wbuf;
+	u32 wbuf_cnt;
+	
+	char lfn[FAT_LFN_SIZE];
 	u8 lfn_size;
 	
+	// Optional directory name indexes using a memory pool provided by the
+	// user. An index is built on the first search in a directory
+	struct dir_index_s dir_index[FAT_DIR_INDEX_CNT];
+	u32 index_tick;
+	
+#if FAT_THREAD_SAFE
+	// Recursive OS mutex protecting the volume
+	void* lock;
+#endif
+	
+#if FAT_PATH_CACHE_SIZE
+	// Cache of resolved directory paths
+	struct path_cache_s path_cache[FAT_PATH_CACHE_SIZE];
+	u32 path_tick;
+#endif
+	
 };
 
 struct dir_s {
@@ -65,6 +218,71 @@ struct dir_s {
 	u32 start_sect;
 	u32 size;
 	struct volume_s* vol;
+	
+	// Location and attribute of the SFN entry describing the object found by
+	// the last search
+	u32 entry_lba;
+	u32 entry_offset;
+	u8 attribute;
+};
+
+/// One run of physically contiguous clusters in a file. `offset` is the file 
+/// relative cluster index of the first cluster in the run
+struct extent_s {
+	u32 cluster;
+	u32 offset;
+	u32 length;
+};
+
+/// Physical location of a part of a file returned by `fat_file_get_extents`.
+/// `count` sectors starting at `lba` hold the file data from byte `offset`
+struct lba_extent_s {
+	u32 offset;
+	u32 lba;
+	u32 count;
+};
+
+/// Disk request with the completion flags set by its callback. It is used for
+/// the internal transfers which are queued several at a time
+struct fat_req_s {
+	struct disk_req_s req;
+	volatile u8 pending;
+	volatile u8 status;
+};
+
+/// One slot in a read-ahead buffer. It holds `slot_size` bytes of the file
+/// starting at the file offset `offset`
+struct ra_slot_s {
+	struct fat_req_s io;
+	u32 offset;
+};
+
+/// Read-ahead state of a file. The caller buffer is split into a ring of 
+/// slots, which are filled with the data following the file pointer while the 
+/// file is read sequentially
+struct readahead_s {
+	struct ra_slot_s slots[FAT_READAHEAD_SLOTS];
+	u8* buffer;
+	u32 slot_size;
+	u32 slot_sect;
+	u32 slot_cnt;
+	
+	// The ring holds `count` slots starting at index `head`
+	u32 head;
+	u32 count;
+	
+	// Prefetch cursor. `next_cluster` is the cluster holding `next_offset`, 
+	// and `end` is set when the cluster chain ends
+	u32 next_offset;
+	u32 next_cluster;
+	u8 end;
+	
+	// End of the last read. A read starting here is sequential
+	u32 last_end;
+	
+	// Number of reads served without and with waiting for the storage device
+	u32 hits;
+	u32 misses;
 };
 
 struct file_s {
@@ -75,15 +293,44 @@ struct file_s {
 	u32 start_sect;
 	u32 glob_offset;
 	struct volume_s* vol;
+	
+	// Location of the SFN entry of the file in the parent directory. A file
+	// without any clusters has a `start_sect` of zero
+	u32 entry_lba;
+	u32 entry_offset;
+	
+	// The size and write time in the directory entry are only updated when
+	// the file is flushed. `clust_cnt` and `last_cluster` describe the end of 
+	// the cluster chain, and are valid when `clust_cnt` is not zero
+	u8 dirty;
+	u32 clust_cnt;
+	u32 last_cluster;
+	
+	// Optional cluster chain cache provided by the user. It maps the start of
+	// the file chain and is extended each time the chain is walked, so seeks
+	// inside the mapped area never touches the FAT
+	struct extent_s* map;
+	u32 map_size;
+	u32 map_cnt;
+	
+	// Asynchronous transfer started by `fat_file_read_async` or 
+	// `fat_file_write_async`. `req_status` holds the result until it is 
+	// collected by `fat_file_poll` or `fat_file_wait`
+	struct disk_req_s req;
+	volatile u8 pending;
+	volatile u8 req_status;
+	
+	// Optional read-ahead buffer for sequential reads
+	struct readahead_s* ra;
 };
 
 /// This structure will contain all information needed for a file or a folder. 
 /// It is mainly used to read directory entries from a path
 struct info_s {
 	
-	// By default this code supports long file name entries (LFN) up to 
-	// 256 characters. The same buffer will be used for LFN and SFN entries.
-	char name[256];
+	// The name buffer holds long file names (LFN) up to FAT_LFN_SIZE 
+	// characters. The same buffer will be used for LFN and SFN entries.
+	char name[FAT_LFN_SIZE];
 	u8 name_length;
 	
 	// The attribute field apply to a file or a folder
@@ -108,7 +355,71 @@ struct info_s {
 	// Contains the total size of a file or a folder
 	// A folder has 
 	u32 size;
-}
+};
+
+/// Attribute filters used by `fat_dir_read_many`
+typedef enum {
+	DIR_FILTER_ALL,
+	DIR_FILTER_FILES,
+	DIR_FILTER_DIRS
+} dir_filter_e;
+
+/// Compact directory entry used by the batched directory read. The name is 
+/// stored zero terminated at `name_offset` in a string arena supplied by the 
+/// caller
+struct dir_entry_s {
+	u32 name_offset;
+	u32 size;
+	u32 cluster;
+	u16 c_time;
+	u16 c_date;
+	u16 a_date;
+	u16 w_time;
+	u16 w_date;
+	u8 name_length;
+	u8 attribute;
+};
+
+/// Fragmentation reported by `fat_file_frag` and `volume_frag_scan`. A file 
+/// stored in one run of clusters has one fragment. For a volume `fragments` 
+/// counts the chain links to a cluster other than the next one on the disk, 
+/// and the free space is described as well. `sector` and `run` hold the scan
+/// progress and must be cleared before the first scan call
+struct frag_s {
+	u32 clusters;
+	u32 fragments;
+	u32 free_cnt;
+	u32 free_runs;
+	u32 free_max;
+	u32 sector;
+	u32 run;
+};
+
+/// Progress of `fat_file_defrag`. It must be cleared before the first call. 
+/// The new clusters are kept in `start` and `count`, and `copied` of the 
+/// `total` data sectors have been moved to them
+struct defrag_s {
+	u32 start;
+	u32 count;
+	u32 copied;
+	u32 total;
+	u32 cluster;
+	u32 size;
+};
+
+/// Position in a directory returned by `fat_dir_tell`. It points to the first
+/// entry of the next object, so a listing can be resumed without scanning the
+/// entries before it. `lfn_start` is set if that entry is the first of a LFN
+/// name, and is checked again by `fat_dir_seek`. The content is private to the
+/// driver. A position is only valid for the directory it was taken from, and 
+/// until entries are added to or removed from the directory
+struct dir_pos_s {
+	u32 start_sect;
+	u32 cluster;
+	u32 sector;
+	u32 rw_offset;
+	u8 lfn_start;
+};
 
 /// The classical generic MBR located at sector zero at a MSD contains four 
 /// partition fields. This structure describe one partition. 
@@ -119,11 +430,17 @@ struct partition_s {
 	u8 type;
 };
 
-/// Format structure
+/// Format structure. `allocation_size` is the cluster size in bytes, or zero
+/// for the default size for the volume. `allignment` is the erase block size 
+/// in bytes which the data region is aligned to, or zero. A normal format 
+/// clears the data region, which a quick format leaves as it is. The optional
+/// `buffer` lets the zero writes cover more than one sector
 struct fat_fmt_s {
 	u32 allocation_size;
 	u32 allignment;
 	u32 quick_format;
+	u8* buffer;
+	u32 buffer_size;
 };
 
 //------------------------------------------------------------------------------
@@ -146,6 +463,24 @@ struct fat_fmt_s {
 #define PAR_LBA				8
 #define PAR_SIZE			12
 
+#define PAR_TYPE_EXT_CHS	0x05
+#define PAR_TYPE_EXT_LBA	0x0F
+#define PAR_TYPE_EXT_LINUX	0x85
+#define PAR_TYPE_GPT		0xEE
+
+/// GUID partition table header and partition entry
+#define GPT_SIGNATURE		0
+#define GPT_HEADER_SIZE		12
+#define GPT_HEADER_CRC		16
+#define GPT_ENTRY_LBA		72
+#define GPT_ENTRY_CNT		80
+#define GPT_ENTRY_SIZE		84
+#define GPT_ENTRY_CRC		88
+
+#define GPT_ENT_TYPE		0
+#define GPT_ENT_FIRST_LBA	32
+#define GPT_ENT_LAST_LBA	40
+
 /// Old BPB and BS
 #define BPB_JUMP_BOOT		0
 #define BPB_OEM				3
@@ -185,6 +520,9 @@ struct fat_fmt_s {
 #define BPB_32_VOL_LABEL	71
 #define BPB_32_FSTYPE		82
 
+#define EXT_FLAGS_ACTIVE	0x0F
+#define EXT_FLAGS_NO_MIRROR	0x80
+
 /// Directory entry defines
 #define SFN_NAME			0
 #define SFN_ATTR			11
@@ -217,12 +555,43 @@ struct fat_fmt_s {
 #define ATTR_LFN			0x0F
 
 /// FSinfo structure
+#define INFO_LEAD_SIG		0
+#define INFO_STRUCT_SIG		484
 #define INFO_CLUST_CNT		488
 #define INFO_NEXT_FREE		492
+#define INFO_TRAIL_SIG		508
+
+#define INFO_LEAD_SIG_VALUE		0x41615252
+#define INFO_STRUCT_SIG_VALUE	0x61417272
+#define INFO_TRAIL_SIG_VALUE	0xAA550000
+
+/// Mount snapshot sector. This is not part of the FAT32 specification
+#define SNAP_MAGIC			0
+#define SNAP_CLEAN			4
+#define SNAP_VOL_ID			8
+#define SNAP_FAT_LBA		12
+#define SNAP_FAT_SIZE		16
+#define SNAP_DATA_LBA		20
+#define SNAP_ROOT_LBA		24
+#define SNAP_CLUST_CNT		28
+#define SNAP_FREE_CNT		32
+#define SNAP_NEXT_FREE		36
+#define SNAP_BITMAP_CNT		40
+#define SNAP_BITMAP_FREE	44
+#define SNAP_BITMAP_CRC		48
+#define SNAP_LABEL			52
+#define SNAP_FAT_CRC		64
+#define SNAP_CRC			68
+
+#define SNAP_MAGIC_VALUE	0x50414E53
 
 /// File system thread
 void fat32_thread(void* arg);
 
+/// Memory functions
+fstatus fat_pool_attach(void* memory, u32 size);
+u32 fat_pool_block_size(void);
+
 /// Disk functions
 u8 disk_mount(disk_e disk);
 u8 disk_eject(disk_e disk);
@@ -233,11 +602,25 @@ struct volume_s* volume_get(char letter);
 fstatus volume_set_label(struct volume_s* vol, const char* name, u8 length);
 fstatus volume_get_label(struct volume_s* vol, char* name);
 fstatus volume_format(struct volume_s* vol, struct fat_fmt_s* fmt);
+fstatus volume_sync(struct volume_s* vol);
+u32 volume_bitmap_size(struct volume_s* vol);
+fstatus volume_bitmap_attach(struct volume_s* vol, u32* bitmap, u32 size);
+fstatus volume_bitmap_build(struct volume_s* vol, u32 sector_cnt);
+fstatus volume_write_attach(struct volume_s* vol, u8* buffer, u32 size);
+fstatus volume_index_attach(struct volume_s* vol, void* memory, u32 size);
+fstatus volume_get_stats(struct volume_s* vol, struct fat_stats_s* stats, 
+	u8 reset);
+fstatus volume_frag_scan(struct volume_s* vol, struct frag_s* frag, 
+	u32 sector_cnt);
 
 /// Directory actions
 fstatus fat_dir_open(struct dir_s* dir, const char* path, u16 length);
 fstatus fat_dir_close(struct dir_s* dir);
 fstatus fat_dir_read(struct dir_s* dir, struct info_s* info);
+fstatus fat_dir_read_many(struct dir_s* dir, struct dir_entry_s* entries,
+	u32 max, char* names, u32 names_size, dir_filter_e filter, u32* count);
+fstatus fat_dir_tell(struct dir_s* dir, struct dir_pos_s* pos);
+fstatus fat_dir_seek(struct dir_s* dir, const struct dir_pos_s* pos);
 fstatus fat_dir_make(const char* path);
 
 /// File actions
@@ -247,6 +630,22 @@ fstatus fat_file_read(struct file_s* file, u8* buffer, u32 count, u32* status);
 fstatus fat_file_write(struct file_s* file, const u8* buffer, u32 count);
 fstatus fat_file_jump(struct file_s* file, u32 offset);
 fstatus fat_file_flush(struct file_s* file);
+fstatus fat_file_set_map(struct file_s* file, struct extent_s* map, u32 size);
+fstatus fat_file_get_extents(struct file_s* file, u32 offset, 
+	struct lba_extent_s* extents, u32 size, u32* count);
+fstatus fat_file_frag(struct file_s* file, struct frag_s* frag);
+fstatus fat_file_defrag(struct file_s* file, struct defrag_s* df, u8* buffer,
+	u32 size);
+fstatus fat_file_defrag_abort(struct file_s* file, struct defrag_s* df);
+fstatus fat_file_reserve(struct file_s* file, u32 size);
+fstatus fat_file_read_async(struct file_s* file, u8* buffer, u32 count, 
+	u32* status);
+fstatus fat_file_write_async(struct file_s* file, const u8* buffer, u32 count,
+	u32* status);
+fstatus fat_file_poll(struct file_s* file);
+fstatus fat_file_set_readahead(struct file_s* file, struct readahead_s* ra,
+	u8* buffer, u32 size);
+fstatus fat_file_wait(struct file_s* file);
 
 /// Directory and file actions
 fstatus fat_dir_rename(struct dir_s* dir, const char* name, u8 length);
@@ -0,0 +1,251 @@
+// DO WHAT THE FUCK YOU WANT TO PUBLIC LICENSE
+//                    Version 2, December 2004
+//  
+// Copyright (C) 2004 Sam Hocevar <sam@hocevar.net>
+// 
+// Everyone is permitted to copy and distribute verbatim or modified
+// copies of this license document, and changing it is allowed as long
+// as the name is changed.
+//  
+//            DO WHAT THE FUCK YOU WANT TO PUBLIC LICENSE
+//   TERMS AND CONDITIONS FOR COPYING, DISTRIBUTION AND MODIFICATION
+// 
+//  0. You just DO WHAT THE FUCK YOU WANT TO.
+
+#ifndef FAT_CONFIG_H
+#define FAT_CONFIG_H
+
+// Compile time configuration of the FAT32 driver. All options can be 
+// overridden from the compiler command line e.g. -DFAT_MAX_TRANSFER=64
+
+/// Set to `1` for a compact build on targets with little RAM. It lowers the 
+/// default of the cache, index and name buffer sizes below. Options set on 
+/// the command line are still used as is
+#ifndef FAT_COMPACT
+#define FAT_COMPACT		0
+#endif
+
+/// Largest sector size supported by the driver. All sector buffers are this
+/// size, and volumes with larger sectors are not mounted. Set this to 4096 
+/// for 4K native media
+#ifndef FAT_SECTOR_SIZE
+#define FAT_SECTOR_SIZE		512
+#endif
+
+#if FAT_SECTOR_SIZE == 512
+#define FAT_SECTOR_SHIFT	9
+#elif FAT_SECTOR_SIZE == 1024
+#define FAT_SECTOR_SHIFT	10
+#elif FAT_SECTOR_SIZE == 2048
+#define FAT_SECTOR_SHIFT	11
+#elif FAT_SECTOR_SIZE == 4096
+#define FAT_SECTOR_SHIFT	12
+#else
+#error "FAT_SECTOR_SIZE must be 512, 1024, 2048 or 4096"
+#endif
+
+/// Set to `1` if all disks use sectors of exactly FAT_SECTOR_SIZE bytes. The 
+/// sector and FAT entry math is then done on constants, which turns it into 
+/// shifts and masks for 512 and 4096 byte sectors. Otherwise the sector size
+/// is taken from the boot sector when the volume is mounted
+#ifndef FAT_SECTOR_FIXED
+#define FAT_SECTOR_FIXED	0
+#endif
+
+/// Size of the long file name buffers in `struct info_s` and `struct volume_s`.
+/// A long file name which does not fit is reported with its 8.3 alias instead
+#ifndef FAT_LFN_SIZE
+#if FAT_COMPACT
+#define FAT_LFN_SIZE		64
+#else
+#define FAT_LFN_SIZE		256
+#endif
+#endif
+
+/// Volume objects are allocated from the pool given to `fat_pool_attach`. If no
+/// pool is attached they are taken from the dynamic memory driver. Set this to
+/// `0` to build without the dynamic memory driver
+#ifndef FAT_DYNAMIC_MEMORY
+#define FAT_DYNAMIC_MEMORY	1
+#endif
+
+/// Set to `1` to make the driver safe for use from several threads. Each 
+/// volume gets a lock from the OS port in `fat_os.h`, which is taken around 
+/// all access to the sector caches and the FAT, and released during direct 
+/// transfers to and from file buffers. A `file_s` or `dir_s` object must only
+/// be used by one thread at a time. The volume list is only changed by 
+/// `disk_mount` and `disk_eject`, and `volume_get`, `fat_dir_open` and 
+/// `fat_file_open` look up volumes in it without a lock. Disks must therefore 
+/// not be mounted or ejected while other threads use any volume
+#ifndef FAT_THREAD_SAFE
+#define FAT_THREAD_SAFE		0
+#endif
+
+/// Maximum number of sectors issued in one multi-sector disk command. File 
+/// reads on contiguous clusters are merged up to this size
+#ifndef FAT_MAX_TRANSFER
+#define FAT_MAX_TRANSFER	256
+#endif
+
+/// Size of the temporary buffer used while a disk is mounted, in sectors. The
+/// default of 33 reads the GPT header and a full 128 entry array in one 
+/// transfer. The buffer is taken from the dynamic memory driver and freed 
+/// again before the mount returns. A size of one, or a failed allocation, 
+/// reads the partition tables one sector at a time
+#ifndef FAT_MOUNT_SECTORS
+#if FAT_COMPACT
+#define FAT_MOUNT_SECTORS	1
+#else
+#define FAT_MOUNT_SECTORS	33
+#endif
+#endif
+
+/// Maximum number of partitions probed for a FAT32 file system on one disk,
+/// including the logical partitions in extended partitions
+#ifndef FAT_PARTITION_CNT
+#if FAT_COMPACT
+#define FAT_PARTITION_CNT	4
+#else
+#define FAT_PARTITION_CNT	16
+#endif
+#endif
+
+/// Number of sectors cached per volume. Each entry holds one sector and is
+/// replaced in least recently used order. A size of one gives the classic 
+/// single sector buffer
+#ifndef FAT_CACHE_SIZE
+#if FAT_COMPACT
+#define FAT_CACHE_SIZE		1
+#else
+#define FAT_CACHE_SIZE		4
+#endif
+#endif
+
+/// Number of sectors in the volume cache reserved for the FAT table. FAT 
+/// sectors are reused a lot during cluster chain walks and are kept apart
+/// from the data cache, so file data can never evict them
+#ifndef FAT_TABLE_CACHE_SIZE
+#if FAT_COMPACT
+#define FAT_TABLE_CACHE_SIZE	1
+#else
+#define FAT_TABLE_CACHE_SIZE	2
+#endif
+#endif
+
+/// By default FAT table and FSinfo updates stay dirty in the cache until the 
+/// volume is synced by a file flush, file close, disk eject or an explicit
+/// `volume_sync`. Set this to `1` to write them back after every change
+#ifndef FAT_SYNC_WRITES
+#define FAT_SYNC_WRITES		0
+#endif
+
+/// Policy for keeping the second FAT in sync with the first. With 
+/// FAT_MIRROR_EAGER every FAT sector is written to all FATs. FAT_MIRROR_DEFER
+/// only writes the first FAT and copies the changed ranges to the others when
+/// the volume is synced. FAT_MIRROR_SINGLE turns off mirroring in the boot 
+/// sector when the volume is mounted, so only one FAT is ever written. A 
+/// volume which already has mirroring turned off only uses its active FAT
+#define FAT_MIRROR_EAGER	0
+#define FAT_MIRROR_DEFER	1
+#define FAT_MIRROR_SINGLE	2
+
+#ifndef FAT_MIRROR
+#define FAT_MIRROR			FAT_MIRROR_DEFER
+#endif
+
+/// Number of separate FAT sector ranges remembered for the deferred mirror 
+/// copy. Nearby ranges are merged when all are in use
+#ifndef FAT_MIRROR_RANGES
+#if FAT_COMPACT
+#define FAT_MIRROR_RANGES	1
+#else
+#define FAT_MIRROR_RANGES	4
+#endif
+#endif
+
+/// Number of directories which can be indexed at the same time when a name
+/// index pool is attached to a volume. The pool is split evenly between them
+#ifndef FAT_DIR_INDEX_CNT
+#if FAT_COMPACT
+#define FAT_DIR_INDEX_CNT	1
+#else
+#define FAT_DIR_INDEX_CNT	4
+#endif
+#endif
+
+/// Number of resolved directory paths cached per volume. `fat_follow_path` 
+/// resumes from the deepest cached ancestor of a path. Paths longer than 
+/// FAT_PATH_CACHE_LEN characters are not cached. A size of zero disables it
+#ifndef FAT_PATH_CACHE_SIZE
+#if FAT_COMPACT
+#define FAT_PATH_CACHE_SIZE	0
+#else
+#define FAT_PATH_CACHE_SIZE	8
+#endif
+#endif
+
+#ifndef FAT_PATH_CACHE_LEN
+#define FAT_PATH_CACHE_LEN	48
+#endif
+
+/// Maximum number of slots in a read-ahead buffer. Each slot has its own disk
+/// request, so this is also the number of prefetch transfers per file
+#ifndef FAT_READAHEAD_SLOTS
+#if FAT_COMPACT
+#define FAT_READAHEAD_SLOTS	2
+#else
+#define FAT_READAHEAD_SLOTS	8
+#endif
+#endif
+
+/// Set to `1` for a fast mount. The volume label is then read on the first 
+/// `volume_get_label`, and a clean eject stores a mount snapshot in the 
+/// reserved region with the FSinfo counts, the label and the free cluster 
+/// bitmap. If the next mount finds a valid snapshot, these are restored 
+/// instead of read from the root directory and the FAT. The snapshot is only
+/// trusted if the FSinfo sector and a CRC of the first FAT sectors still 
+/// match it, which catches most changes by other hosts. The card should still
+/// not be modified elsewhere between ejects, since a change outside the 
+/// checked sectors which leaves FSinfo alone goes unnoticed and the restored
+/// free cluster state would then be stale
+#ifndef FAT_FAST_MOUNT
+#define FAT_FAST_MOUNT		0
+#endif
+
+/// Sector in the reserved region, relative to the start of the partition, 
+/// which holds the mount snapshot. The bitmap is stored in the sectors after 
+/// it if they are inside the reserved region. The snapshot is only written if
+/// the sector is blank or already holds a snapshot
+#ifndef FAT_SNAPSHOT_SECT
+#define FAT_SNAPSHOT_SECT	16
+#endif
+
+/// Number of sectors at the start of the FAT covered by the CRC in the mount 
+/// snapshot. They are read on every fast mount
+#ifndef FAT_SNAPSHOT_FAT_CNT
+#define FAT_SNAPSHOT_FAT_CNT	4
+#endif
+
+/// Set to `1` to count the disk transfers, cache hits, FAT lookups, directory 
+/// entries scanned and allocation work of each volume. The counters are read
+/// with `volume_get_stats`. With `0` all counting compiles to nothing
+#ifndef FAT_STATS
+#define FAT_STATS			0
+#endif
+
+/// Optional cycle counter used to time the blocking disk transfers when 
+/// FAT_STATS is set. It must be an expression giving a free running 32-bit 
+/// count, e.g. -DFAT_STATS_CLOCK=DWT_CYCCNT. Timing is off when not defined
+
+/// Set to `1` if the CPU is little endian and allows unaligned 32-bit access.
+/// The FAT32 on-disk format is little endian, so loads and stores of 16 and 
+/// 32-bit fields are then single memory accesses
+#ifndef FAT_LITTLE_ENDIAN
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+#define FAT_LITTLE_ENDIAN	1
+#else
+#define FAT_LITTLE_ENDIAN	0
+#endif
+#endif
+
+#endif
@@ -0,0 +1,35 @@
+// DO WHAT THE FUCK YOU WANT TO PUBLIC LICENSE
+//                    Version 2, December 2004
+//  
+// Copyright (C) 2004 Sam Hocevar <sam@hocevar.net>
+// 
+// Everyone is permitted to copy and distribute verbatim or modified
+// copies of this license document, and changing it is allowed as long
+// as the name is changed.
+//  
+//            DO WHAT THE FUCK YOU WANT TO PUBLIC LICENSE
+//   TERMS AND CONDITIONS FOR COPYING, DISTRIBUTION AND MODIFICATION
+// 
+//  0. You just DO WHAT THE FUCK YOU WANT TO.
+
+#include "fat_os.h"
+
+// This board runs the file system from a single thread, so the mutexes below
+// do nothing. Map them to the recursive mutex API of the RTOS in use
+
+void* fat_os_mutex_new(void) {
+	static u8 mutex;
+	return &mutex;
+}
+
+void fat_os_mutex_free(void* mutex) {
+	
+}
+
+void fat_os_mutex_lock(void* mutex) {
+	
+}
+
+void fat_os_mutex_unlock(void* mutex) {
+	
+}
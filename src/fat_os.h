@@ -0,0 +1,33 @@
+// DO WHAT THE FUCK YOU WANT TO PUBLIC LICENSE
+//                    Version 2, December 2004
+//  
+// Copyright (C) 2004 Sam Hocevar <sam@hocevar.net>
+// 
+// Everyone is permitted to copy and distribute verbatim or modified
+// copies of this license document, and changing it is allowed as long
+// as the name is changed.
+//  
+//            DO WHAT THE FUCK YOU WANT TO PUBLIC LICENSE
+//   TERMS AND CONDITIONS FOR COPYING, DISTRIBUTION AND MODIFICATION
+// 
+//  0. You just DO WHAT THE FUCK YOU WANT TO.
+
+#ifndef FAT_OS_H
+#define FAT_OS_H
+
+#include "fat_types.h"
+
+/// Returns a new recursive mutex, or NULL if it could not be made. The same 
+/// thread must be able to take the mutex again while it holds it
+void* fat_os_mutex_new(void);
+
+/// Deletes a mutex made by `fat_os_mutex_new`
+void fat_os_mutex_free(void* mutex);
+
+/// Takes the mutex. Blocks until the mutex is available
+void fat_os_mutex_lock(void* mutex);
+
+/// Releases the mutex
+void fat_os_mutex_unlock(void* mutex);
+
+#endif